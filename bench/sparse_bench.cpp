@@ -0,0 +1,588 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+#include <type_traits>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "graph.hpp"
+#include "simd.hpp"
+#include "generator.hpp"
+
+/*
+ * Benchmark suite of the matrix and graph operations
+ * Runs every operation on a synthetic matrix for each requested thread
+ * count and writes the timings as JSON, so two builds can be compared by
+ * diffing their output. Rates are derived from a simple traffic model of
+ * every operation: bytes of the CSR arrays and vectors touched once,
+ * two flops per multiply-add and one edge per stored element visited.
+ *
+ * sparse_bench [--generator rmat|er|band] [--scale 16] [--degree 16]
+ *              [--seed 1] [--type double|float|int32|bool] [--index 64|32]
+ *              [--threads 1,8] [--repeat 5] [--ops spmv,bfs,...]
+ *              [--spgemm-max-flops 1e9] [--tmpdir /tmp] [--output out.json]
+*/
+
+struct Options
+{
+    std::string generator = "rmat";
+    size_t scale = 16;
+    size_t degree = 16;
+    uint64_t seed = 1;
+    std::string type = "double";
+    size_t index = 64;
+    std::vector<int> threads;
+    size_t repeat = 5;
+    std::vector<std::string> ops;
+    double spgemm_max_flops = 1e9;
+    std::string tmpdir = "/tmp";
+    std::string output;
+};
+
+// Work of a single run of an operation
+struct Work
+{
+    double bytes = 0;
+    double flops = 0;
+    double edges = 0;
+};
+
+struct Measurement
+{
+    std::string op;
+    int threads;
+    std::vector<double> times;
+    Work work;
+};
+
+static int max_threads()
+{
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+static void set_threads(int threads)
+{
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#else
+    (void)threads;
+#endif
+}
+
+static std::vector<std::string> split(std::string const & list)
+{
+    std::vector<std::string> ret;
+    std::stringstream stream(list);
+    for (std::string item; std::getline(stream, item, ',');)
+        if (!item.empty()) ret.push_back(item);
+    return ret;
+}
+
+static std::string escape(std::string const & text)
+{
+    std::string ret;
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\') ret += '\\';
+        ret += c;
+    }
+    return ret;
+}
+
+/*
+ * Runs the selected operations and collects their timings
+*/
+class Suite {
+
+public:
+
+    explicit Suite(Options const & options) : m_options(options) {}
+
+    bool selected(std::string const & op) const
+    {
+        return m_options.ops.empty() ||
+               std::find(m_options.ops.begin(), m_options.ops.end(), op) != m_options.ops.end();
+    }
+
+    /*
+     * Time an operation for every thread count
+     * setup runs untimed before every run, body returns the work it did.
+     * The first run of every thread count warms up and is not recorded.
+    */
+    void run(std::string const & op, std::function<void()> setup, std::function<Work()> body)
+    {
+        if (!selected(op)) return;
+        for (int threads : m_options.threads)
+        {
+            set_threads(threads);
+            Measurement ret{op, threads, {}, Work()};
+            for(size_t r=0; r<=m_options.repeat; ++r)
+            {
+                if (setup) setup();
+                const auto start = std::chrono::steady_clock::now();
+                ret.work = body();
+                const auto stop = std::chrono::steady_clock::now();
+                if (r) ret.times.push_back(std::chrono::duration<double>(stop - start).count());
+            }
+            std::sort(ret.times.begin(), ret.times.end());
+            std::cerr << op << " threads=" << threads << " " << ret.times[ret.times.size()/2] << " s" << std::endl;
+            m_results.push_back(std::move(ret));
+        }
+    }
+
+    void skip(std::string const & op, std::string const & reason)
+    {
+        if (!selected(op)) return;
+        std::cerr << op << " skipped, " << reason << std::endl;
+        m_skipped.emplace_back(op, reason);
+    }
+
+    void write(std::ostream & out, std::string const & matrix) const;
+
+private:
+
+    Options const & m_options;
+    std::vector<Measurement> m_results;
+    std::vector<std::pair<std::string, std::string>> m_skipped;
+
+};
+
+static void write_rate(std::ostream & out, char const * name, double amount, double time, double scale)
+{
+    out << ", \"" << name << "\": ";
+    if (amount > 0 && time > 0) out << amount / time / scale;
+    else out << "null";
+}
+
+static const char * simd_name(SimdLevel level)
+{
+    switch (level)
+    {
+        case SimdLevel::avx512: return "avx512";
+        case SimdLevel::avx2: return "avx2";
+        default: return "scalar";
+    }
+}
+
+void Suite::write(std::ostream & out, std::string const & matrix) const
+{
+    out.precision(6);
+    out << "{\n";
+    out << "  \"benchmark\": \"sparse_bench\",\n";
+    out << "  \"config\": {\"generator\": \"" << escape(m_options.generator) << "\", \"scale\": " << m_options.scale
+        << ", \"degree\": " << m_options.degree << ", \"seed\": " << m_options.seed
+        << ", \"type\": \"" << escape(m_options.type) << "\", \"index\": " << m_options.index
+        << ", \"repeat\": " << m_options.repeat << "},\n";
+    out << "  \"host\": {\"hardware_threads\": " << std::thread::hardware_concurrency()
+        << ", \"compiler\": \"" << escape(__VERSION__) << "\", \"simd\": \"" << simd_name(simd_level()) << "\"},\n";
+    out << "  \"matrix\": " << matrix << ",\n";
+    out << "  \"results\": [";
+    for(size_t i=0; i<m_results.size(); ++i)
+    {
+        Measurement const & result = m_results[i];
+        const double median = result.times[result.times.size()/2];
+        out << (i ? ",\n" : "\n") << "    {\"op\": \"" << result.op << "\", \"threads\": " << result.threads
+            << ", \"time_s\": " << median << ", \"min_s\": " << result.times.front();
+        write_rate(out, "gbytes_per_s", result.work.bytes, median, 1e9);
+        write_rate(out, "gflops_per_s", result.work.flops, median, 1e9);
+        write_rate(out, "edges_per_s", result.work.edges, median, 1);
+        out << "}";
+    }
+    out << "\n  ],\n";
+    out << "  \"skipped\": [";
+    for(size_t i=0; i<m_skipped.size(); ++i)
+    {
+        out << (i ? ",\n" : "\n") << "    {\"op\": \"" << m_skipped[i].first
+            << "\", \"reason\": \"" << escape(m_skipped[i].second) << "\"}";
+    }
+    out << (m_skipped.empty() ? "]\n" : "\n  ]\n");
+    out << "}\n";
+}
+
+template<typename fT, typename IndexT>
+static SparseMatrix<fT, IndexT> generate(Options const & options)
+{
+    if (options.generator == "rmat")
+        return rmat_matrix<fT, IndexT>(options.scale, options.degree, options.seed);
+    if (options.generator == "er")
+        return erdos_renyi_matrix<fT, IndexT>(static_cast<size_t>(1) << options.scale,
+                                              static_cast<double>(options.degree), options.seed);
+    if (options.generator == "band")
+        return banded_matrix<fT, IndexT>(static_cast<size_t>(1) << options.scale, options.degree / 2, options.seed);
+    throw std::domain_error("unknown generator " + options.generator);
+}
+
+static double file_size(std::string const & filename)
+{
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    return static_cast<double>(file.tellg());
+}
+
+/*
+ * Run the whole suite on one value and index type
+*/
+template<typename fT, typename IndexT>
+static void run(Options const & options)
+{
+    using Matrix = SparseMatrix<fT, IndexT>;
+    using Graph = SparseGraph<fT, IndexT>;
+
+    std::cerr << "generating " << options.generator << " matrix" << std::endl;
+    const Matrix A = generate<fT, IndexT>(options);
+    const size_t n = A.nrow(), nnz = A.nnz();
+    const Buffer<size_t> & index = A.index();
+    const Buffer<IndexT> & indices = A.indices();
+
+    size_t max_row = 0, hub = 0;
+    for(size_t i=0; i<n; ++i)
+    {
+        if (index[i+1] - index[i] > max_row)
+        {
+            max_row = index[i+1] - index[i];
+            hub = i;
+        }
+    }
+    // Bytes of the CSR arrays of a matrix with the given number of elements
+    auto csr_bytes = [&](double elements)
+    {
+        return static_cast<double>((n + 1) * sizeof(size_t)) + elements *
+               static_cast<double>(sizeof(IndexT) + (is_pattern<fT>::value ? 0 : sizeof(fT)));
+    };
+    const double matrix_bytes = csr_bytes(static_cast<double>(nnz));
+    const double vector_bytes = static_cast<double>(n * sizeof(fT));
+
+    Suite suite(options);
+    std::mt19937_64 random(options.seed);
+
+    // Matrix operations
+
+    std::vector<size_t> rows(nnz), cols(indices.begin(), indices.end());
+    std::vector<fT> values(nnz, static_cast<fT>(1));
+    for(size_t i=0; i<n; ++i)
+    {
+        for(size_t j=index[i]; j<index[i+1]; ++j)
+        {
+            rows[j] = i;
+            if constexpr (!is_pattern<fT>::value) values[j] = A.data()[j];
+        }
+    }
+    suite.run("build", nullptr, [&]()
+    {
+        SparseMatrixBuilder<fT, IndexT> builder(n, n);
+        builder.add(rows, cols, values);
+        Matrix ret = builder.build();
+        return Work{static_cast<double>(nnz * (2 * sizeof(size_t) + sizeof(fT))) + matrix_bytes, 0,
+                    static_cast<double>(ret.nnz())};
+    });
+
+    std::vector<fT> x(n), y(n);
+    for(size_t i=0; i<n; ++i) x[i] = static_cast<fT>(1 + i % 3);
+    suite.run("spmv", nullptr, [&]()
+    {
+        A.multiply(x, y);
+        return Work{matrix_bytes + 2 * vector_bytes, 2.0 * static_cast<double>(nnz), static_cast<double>(nnz)};
+    });
+
+    const size_t k = 8;
+    Buffer<fT> block(n * k, static_cast<fT>(1)), block_ret(n * k);
+    suite.run("spmm", nullptr, [&]()
+    {
+        A.multiply(block.data(), block_ret.data(), k);
+        return Work{matrix_bytes + 2 * k * vector_bytes, 2.0 * static_cast<double>(nnz * k), static_cast<double>(nnz)};
+    });
+
+    // Products through the other layouts, the warm-up run converts the
+    // matrix and the work is counted as for CSR to compare the rates
+    const std::pair<const char *, Format> formats[] = {
+        {"sell", Format::sell}, {"bcsr", Format::bcsr}, {"auto", Format::automatic}};
+    for (auto const & format : formats)
+    {
+        const std::string name = format.first;
+        if constexpr (is_pattern<fT>::value)
+        {
+            suite.skip("spmv_" + name, "patterns multiply in CSR");
+            suite.skip("spmm_" + name, "patterns multiply in CSR");
+            continue;
+        }
+        Matrix F(A);
+        F.set_format(format.second);
+        suite.run("spmv_" + name, nullptr, [&]()
+        {
+            F.multiply(x, y);
+            return Work{matrix_bytes + 2 * vector_bytes, 2.0 * static_cast<double>(nnz), static_cast<double>(nnz)};
+        });
+        suite.run("spmm_" + name, nullptr, [&]()
+        {
+            F.multiply(block.data(), block_ret.data(), k);
+            return Work{matrix_bytes + 2 * k * vector_bytes, 2.0 * static_cast<double>(nnz * k),
+                        static_cast<double>(nnz)};
+        });
+    }
+
+    double spgemm_flops = 0;
+    for(size_t j=0; j<nnz; ++j) spgemm_flops += 2.0 * static_cast<double>(index[indices[j]+1] - index[indices[j]]);
+    if (spgemm_flops <= options.spgemm_max_flops)
+    {
+        suite.run("spgemm", nullptr, [&]()
+        {
+            Matrix ret = A.multiply(A);
+            return Work{2 * matrix_bytes + csr_bytes(static_cast<double>(ret.nnz())), spgemm_flops,
+                        spgemm_flops / 2};
+        });
+    }
+    else
+        suite.skip("spgemm", "needs " + std::to_string(spgemm_flops) + " flops, above --spgemm-max-flops");
+
+    suite.run("transpose", nullptr, [&]()
+    {
+        Matrix ret = A.transpose();
+        return Work{2 * matrix_bytes, 0, static_cast<double>(nnz)};
+    });
+
+    suite.run("add", nullptr, [&]()
+    {
+        Matrix ret = A + A * static_cast<fT>(2);
+        return Work{3 * matrix_bytes, 2.0 * static_cast<double>(nnz), static_cast<double>(2 * nnz)};
+    });
+
+    Matrix B;
+    suite.run("scale", [&]() { B = A; }, [&]()
+    {
+        B *= static_cast<fT>(2);
+        return Work{2.0 * static_cast<double>(nnz * sizeof(fT)), static_cast<double>(nnz), static_cast<double>(nnz)};
+    });
+
+    // Half of the lookups hit a stored element, half land anywhere
+    const size_t naccess = 1 << 20;
+    std::vector<std::pair<size_t, size_t>> access(naccess);
+    for(size_t t=0; t<naccess; ++t)
+    {
+        if (nnz && t % 2 == 0)
+        {
+            const size_t j = random() % nnz;
+            access[t] = {std::upper_bound(index.begin(), index.end(), j) - index.begin() - 1, indices[j]};
+        }
+        else
+            access[t] = {random() % n, random() % n};
+    }
+    suite.run("get", nullptr, [&]()
+    {
+        fT sum = 0;
+        for (auto const & pos : access) sum += A(pos.first, pos.second);
+        volatile bool sink = sum != 0;
+        (void)sink;
+        return Work{0, 0, static_cast<double>(naccess)};
+    });
+    suite.run("set", [&]() { B = A; }, [&]()
+    {
+        for(size_t t=0; t<naccess; t+=2) B(access[t].first, access[t].second, static_cast<fT>(1));
+        return Work{0, 0, static_cast<double>(naccess / 2)};
+    });
+
+    const std::string binary = options.tmpdir + "/sparse_bench.bin";
+    const std::string text = options.tmpdir + "/sparse_bench.txt";
+    suite.run("save_binary", nullptr, [&]()
+    {
+        A.save_binary(binary);
+        return Work{file_size(binary), 0, static_cast<double>(nnz)};
+    });
+    suite.run("load_binary", nullptr, [&]()
+    {
+        Matrix ret;
+        ret.load_binary(binary);
+        return Work{file_size(binary), 0, static_cast<double>(nnz)};
+    });
+    suite.run("map_binary", nullptr, [&]()
+    {
+        Matrix ret;
+        ret.load_binary(binary, true);
+        return Work{0, 0, static_cast<double>(nnz)};
+    });
+    suite.run("save", nullptr, [&]()
+    {
+        A.save(text);
+        return Work{file_size(text), 0, static_cast<double>(nnz)};
+    });
+    suite.run("load", nullptr, [&]()
+    {
+        Matrix ret;
+        ret.load(text);
+        return Work{file_size(text), 0, static_cast<double>(nnz)};
+    });
+    std::remove(binary.c_str());
+    std::remove(text.c_str());
+
+    // Graph operations, traversals start from the node of largest degree
+
+    const Graph G{Matrix(A)};
+    BFSResult tree = G.bfs(hub);
+    double reached = 0;
+    for(size_t i=0; i<n; ++i)
+        if (tree.depth[i] >= 0) reached += static_cast<double>(index[i+1] - index[i]);
+
+    suite.run("bfs", nullptr, [&]()
+    {
+        BFSResult ret = G.bfs(hub);
+        return Work{matrix_bytes + static_cast<double>(2 * n * sizeof(int64_t)), 0, reached};
+    });
+
+    if constexpr (!is_pattern<fT>::value)
+    {
+        SSSPResult<fT> paths;
+        suite.run("sssp", nullptr, [&]()
+        {
+            G.sssp(hub, paths);
+            return Work{matrix_bytes + vector_bytes, reached, reached};
+        });
+    }
+    else
+        suite.skip("sssp", "patterns have no weights");
+
+    if constexpr (std::is_floating_point<fT>::value)
+    {
+        suite.run("pagerank", nullptr, [&]()
+        {
+            PageRankResult<fT> ret = G.pagerank();
+            const double sweeps = static_cast<double>(ret.iterations);
+            return Work{sweeps * (matrix_bytes + 2 * vector_bytes), sweeps * 2.0 * static_cast<double>(nnz),
+                        sweeps * static_cast<double>(nnz)};
+        });
+    }
+    else
+        suite.skip("pagerank", "scores need a floating point type");
+
+    suite.run("wcc", nullptr, [&]()
+    {
+        ComponentResult ret = G.weakly_connected_components();
+        return Work{2 * matrix_bytes + vector_bytes, 0, static_cast<double>(2 * nnz)};
+    });
+    suite.run("scc", nullptr, [&]()
+    {
+        ComponentResult ret = G.strongly_connected_components();
+        return Work{2 * matrix_bytes + vector_bytes, 0, static_cast<double>(2 * nnz)};
+    });
+    suite.run("triangles", nullptr, [&]()
+    {
+        TriangleResult ret = G.triangles(false);
+        return Work{3 * matrix_bytes, 0, static_cast<double>(2 * nnz)};
+    });
+    suite.run("kcore", nullptr, [&]()
+    {
+        std::vector<size_t> ret = G.core_numbers();
+        return Work{2 * matrix_bytes + 2 * vector_bytes, 0, static_cast<double>(2 * nnz)};
+    });
+
+    std::unique_ptr<Graph> H;
+    suite.run("in_adjacency", [&]() { H.reset(new Graph(Matrix(A))); }, [&]()
+    {
+        H->in_adjacency();
+        return Work{2 * matrix_bytes, 0, static_cast<double>(nnz)};
+    });
+
+    suite.run("reorder_rcm", nullptr, [&]()
+    {
+        std::vector<size_t> ret = compute_ordering(G.adjacency(), G.in_adjacency(), Ordering::rcm);
+        return Work{2 * matrix_bytes, 0, static_cast<double>(2 * nnz)};
+    });
+
+    suite.run("dynamic_update", [&]()
+    {
+        H.reset(new Graph(Matrix(A)));
+        H->set_dynamic(true);
+    }, [&]()
+    {
+        for(size_t t=1; t<naccess; t+=2) (*H)(access[t].first, access[t].second, static_cast<fT>(1));
+        H->compact();
+        return Work{0, 0, static_cast<double>(naccess / 2)};
+    });
+
+    std::ostringstream matrix;
+    matrix << "{\"nrow\": " << n << ", \"nnz\": " << nnz << ", \"max_row\": " << max_row << "}";
+    if (options.output.empty())
+    {
+        suite.write(std::cout, matrix.str());
+        return;
+    }
+    std::ofstream out(options.output);
+    if (!out) throw std::runtime_error("cannot open " + options.output);
+    suite.write(out, matrix.str());
+}
+
+static Options parse(int argc, char ** argv)
+{
+    Options ret;
+    for(int i=1; i<argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc) throw std::domain_error("missing value of " + arg);
+        const std::string value = argv[++i];
+        if (arg == "--generator") ret.generator = value;
+        else if (arg == "--scale") ret.scale = std::stoul(value);
+        else if (arg == "--degree") ret.degree = std::stoul(value);
+        else if (arg == "--seed") ret.seed = std::stoull(value);
+        else if (arg == "--type") ret.type = value;
+        else if (arg == "--index") ret.index = std::stoul(value);
+        else if (arg == "--repeat") ret.repeat = std::max<size_t>(std::stoul(value), 1);
+        else if (arg == "--ops") ret.ops = split(value);
+        else if (arg == "--spgemm-max-flops") ret.spgemm_max_flops = std::stod(value);
+        else if (arg == "--tmpdir") ret.tmpdir = value;
+        else if (arg == "--output") ret.output = value;
+        else if (arg == "--threads")
+        {
+            for (auto const & count : split(value)) ret.threads.push_back(std::max(std::stoi(count), 1));
+        }
+        else throw std::domain_error("unknown option " + arg);
+    }
+    if (ret.threads.empty())
+    {
+        ret.threads.push_back(1);
+        if (max_threads() > 1) ret.threads.push_back(max_threads());
+    }
+    return ret;
+}
+
+template<typename fT>
+static void run_index(Options const & options)
+{
+    if (options.index == 64) run<fT, uint64_t>(options);
+    else if (options.index == 32) run<fT, uint32_t>(options);
+    else throw std::domain_error("the index width must be 32 or 64");
+}
+
+int main(int argc, char ** argv)
+{
+    try
+    {
+        const Options options = parse(argc, argv);
+        if (options.type == "double") run_index<double>(options);
+        else if (options.type == "float") run_index<float>(options);
+        else if (options.type == "int32") run_index<int32_t>(options);
+        else if (options.type == "bool") run_index<bool>(options);
+        else throw std::domain_error("unknown value type " + options.type);
+    }
+    catch (std::exception const & error)
+    {
+        std::cerr << "sparse_bench: " << error.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
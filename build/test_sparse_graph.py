@@ -2,10 +2,12 @@
 
 import numpy as np
 import math
+import asyncio
 import time
 import pytest
 
-from _sparse import SparseGraph
+from _sparse import SparseGraph, DuplicatePolicy, Ordering, Semiring
+from _sparse import SparseGraphF32, SparseGraphI32Idx32, SparseGraphBoolIdx32
 
 def make_graphs(size, sparse=True):
     gra1 = SparseGraph(size, size)
@@ -41,3 +43,401 @@ def test_basic():
 
     assert gra1 == gra2
     assert gra1 is not gra2
+
+def test_hash_threshold():
+    size = 100
+    gra1, gra2, *_ = make_graphs(size)
+
+    gra1.hash_threshold = 10
+    assert 10 == gra1.hash_threshold
+
+    gra1[3, 5] = 0
+    gra2[3, 5] = 0
+    for i in range(gra1.dim):
+        for j in range(gra1.dim):
+            assert gra1[i, j] == gra2[i, j]
+
+def test_edge_list():
+    size = 10
+    gra1, *_ = make_graphs(size)
+
+    src = [it for it in range(size) for jt in range(size)]
+    dst = [jt for it in range(size) for jt in range(size)]
+    weight = [it * size + jt + 1 for it in range(size) for jt in range(size)]
+    gra2 = SparseGraph(size, src, dst, weight)
+
+    for i in range(gra1.dim):
+        for j in range(gra1.dim):
+            assert gra1[i, j] == gra2[i, j]
+
+    gra3 = SparseGraph(size, [0, 0], [1, 1], [2, 5], DuplicatePolicy.max)
+
+    assert 5 == gra3[0, 1]
+    assert 0 == gra3[1, 0]
+
+def test_load_edge_list():
+    with open('graph.el', 'w') as f:
+        f.write('# source target weight\n')
+        f.write('10 20 1.5\n20,30,2\n30 10\n30 30 4\n')
+
+    gra = SparseGraph()
+    ids = gra.load_edge_list('graph.el', symmetrize=True, drop_self_loops=True, remap_ids=True)
+
+    assert [10, 20, 30] == list(ids)
+    assert 3 == gra.dim
+    assert 1.5 == gra[0, 1]
+    assert 1.5 == gra[1, 0]
+    assert 2 == gra[1, 2]
+    assert 1 == gra[2, 0]
+    assert 0 == gra[2, 2]
+
+def test_load_mtx():
+    with open('graph.mtx', 'w') as f:
+        f.write('%%MatrixMarket matrix coordinate real symmetric\n')
+        f.write('3 3 2\n2 1 0.5\n3 3 2\n')
+
+    gra = SparseGraph()
+    gra.load_mtx('graph.mtx')
+
+    assert 3 == gra.dim
+    assert 0.5 == gra[0, 1]
+    assert 0.5 == gra[1, 0]
+    assert 2 == gra[2, 2]
+
+def test_bfs():
+    size = 10
+    gra = SparseGraph(size)
+    gra.reset()
+    for it in range(size-2):
+        gra[it, it+1] = 1
+    gra[0, 5] = 1
+
+    parent, depth = gra.bfs(0)
+
+    assert 0 == parent[0]
+    # 8 is reached through the shortcut 0 -> 5 -> 6 -> 7 -> 8
+    assert [0, 1, 2, 3, 4, 1, 2, 3, 4, -1] == list(depth)
+    assert 5 == parent[6]
+    assert 7 == parent[8]
+    assert -1 == parent[size-1]
+
+def test_sssp():
+    size = 5
+    gra = SparseGraph(size)
+    gra[0, 1] = 4
+    gra[0, 2] = 1
+    gra[2, 1] = 2
+    gra[1, 3] = 1
+
+    dist, pred = gra.sssp(0)
+
+    assert [0, 3, 1, 4] == list(dist[:4])
+    assert math.isinf(dist[4])
+    assert [-1, 2, 0, 1, -1] == list(pred)
+
+    dist, pred = gra.sssp(0, targets=[2])
+    assert 1 == dist[2]
+
+    dist, pred = gra.sssp(0, delta=1e-3)
+    assert [0, 3, 1, 4] == list(dist[:4])
+
+    with pytest.raises(ValueError):
+        gra.sssp(0, delta=-1)
+
+def test_pagerank():
+    size = 4
+    gra = SparseGraph(size)
+    for it in range(size):
+        gra[it, (it+1) % size] = 1
+
+    rank = gra.pagerank(tolerance=1e-10)
+    assert np.allclose(rank, 0.25)
+
+    gra[0, 1] = 0
+    rank = gra.personalized_pagerank([[1, 0, 0, 0], [0, 0, 0, 1]], tolerance=1e-10)
+    assert (size, 2) == rank.shape
+    assert np.allclose(rank.sum(axis=0), 1)
+    assert rank[0, 0] > rank[1, 0]
+    assert rank[3, 1] > rank[0, 1]
+
+def test_in_edges():
+    size = 5
+    gra = SparseGraph(size)
+    gra[0, 2] = 1
+    gra[1, 2] = 1
+    gra[3, 4] = 1
+
+    assert 2 == gra.in_degree(2)
+    assert [0, 1] == list(gra.in_neighbors(2))
+
+    gra[4, 2] = 1
+    gra[0, 2] = 0
+    assert [1, 4] == list(gra.in_neighbors(2))
+
+    gra.add_node()
+    gra[size, 4] = 1
+    assert [3, size] == list(gra.in_neighbors(4))
+
+    mat = gra.to_sparse_matrix().transpose()
+    assert 1 == mat[2, 4]
+    assert 0 == mat[4, 2]
+
+def test_dynamic():
+    size = 6
+    gra = SparseGraph(size)
+    gra.set_dynamic(min_pending=4, ratio=0)
+    assert gra.dynamic
+
+    for it in range(size-1):
+        gra[it, it+1] = 1
+    gra[2, 3] = 0
+    assert 0 == gra[2, 3]
+    assert 1 == gra[3, 4]
+
+    parent, depth = gra.bfs(0)
+    assert [0, 1, 2, -1, -1, -1] == list(depth)
+    assert 0 == gra.pending_updates
+
+    gra[2, 3] = 2
+    assert 1 == gra.pending_updates
+    gra.compact()
+    assert 0 == gra.pending_updates
+    assert 2 == gra[2, 3]
+
+    gra.set_dynamic(False)
+    assert not gra.dynamic
+
+def test_dynamic_read_lag():
+    size = 6
+    gra = SparseGraph(size)
+    gra.set_dynamic(min_pending=16, ratio=0, read_lag=2)
+    for it in range(size-1):
+        gra[it, it+1] = 1
+    parent, depth = gra.bfs(0)
+    assert [0, 1, 2, 3, 4, 5] == list(depth)
+    assert 0 == gra.pending_updates
+
+    # Kernels may leave out up to read_lag updates, lookups never do
+    gra[0, 1] = 0
+    parent, depth = gra.bfs(0)
+    assert [0, 1, 2, 3, 4, 5] == list(depth)
+    assert 1 == gra.pending_updates
+    assert 0 == gra[0, 1]
+
+    gra.compact()
+    parent, depth = gra.bfs(0)
+    assert [0, -1, -1, -1, -1, -1] == list(depth)
+
+def test_assign():
+    size = 6
+    gra = SparseGraph(size)
+    gra.set_dynamic(min_pending=4, ratio=0)
+    for it in range(size-1):
+        gra[it, it+1] = 1
+
+    other = SparseGraph(2)
+    other.assign(gra)
+    assert size == other.dim
+    assert other.dynamic
+    assert 0 == other.pending_updates
+    assert 1 == other[4, 5]
+
+    gra[4, 5] = 0
+    assert 1 == other[4, 5]
+
+def test_csr_interop():
+    indptr = np.array([0, 1, 2, 2], dtype=np.int64)
+    indices = np.array([1, 2], dtype=np.int64)
+    data = np.array([1.0, 2.0])
+    gra = SparseGraph.from_csr(indptr, indices, data)
+    assert 3 == gra.dim
+    assert 2 == gra[1, 2]
+
+    ret_indptr, ret_indices, ret_data = gra.to_csr()
+    assert np.shares_memory(indptr, ret_indptr)
+    assert np.shares_memory(indices, ret_indices)
+    assert np.shares_memory(data, ret_data)
+
+    with pytest.raises(ValueError):
+        SparseGraph.from_csr(indptr, indices)
+    assert 2 == SparseGraphBoolIdx32.from_csr(indptr, indices).to_csr()[0][-1]
+
+def test_remove_nodes():
+    size = 6
+    gra = SparseGraph(size)
+    for it in range(size-1):
+        gra[it, it+1] = it + 1
+    gra[5, 0] = 6
+
+    mapping = gra.remove_nodes([1, 4, 1])
+
+    assert [0, -1, 1, 2, -1, 3] == list(mapping)
+    assert 4 == gra.dim
+    assert 3 == gra[1, 2]
+    assert 6 == gra[3, 0]
+    assert 0 == gra[0, 1]
+
+    gra.add_nodes(3)
+    assert 7 == gra.dim
+    gra[6, 0] = 1
+    assert 1 == gra[6, 0]
+
+def test_reorder():
+    size = 8
+    gra = SparseGraph(size)
+    order = [0, 5, 2, 7, 1, 6, 3, 4]
+    for it in range(size-1):
+        gra[order[it], order[it+1]] = it + 1
+
+    for ordering in [Ordering.rcm, Ordering.degree, Ordering.community]:
+        reordered = SparseGraph(gra)
+        perm = reordered.reorder(ordering)
+        assert list(range(size)) == sorted(perm)
+        for it in range(size-1):
+            assert it + 1 == reordered[perm[order[it]], perm[order[it+1]]]
+
+    perm = gra.reorder(Ordering.rcm)
+    for it in range(size-1):
+        assert 1 == abs(int(perm[order[it]]) - int(perm[order[it+1]]))
+
+def test_value_index_types():
+    size = 5
+    src = [0, 1, 2, 3]
+    dst = [1, 2, 3, 4]
+    gra = SparseGraph(size, src, dst, [1., 2., 3., 4.])
+    gra_f32 = SparseGraphF32(size, src, dst, [1., 2., 3., 4.])
+    gra_i32 = SparseGraphI32Idx32(size, src, dst, [1, 2, 3, 4])
+    gra_bool = SparseGraphBoolIdx32(size, src, dst, [True] * 4)
+
+    for other in [gra_f32, gra_i32, gra_bool]:
+        assert list(gra.bfs(0)[1]) == list(other.bfs(0)[1])
+    assert 3 == gra_i32[2, 3]
+    assert gra_bool[2, 3]
+    assert not gra_bool[3, 2]
+
+    assert np.float32 == gra_f32.pagerank().dtype
+    np.testing.assert_allclose(gra.pagerank(), gra_f32.pagerank(), rtol=1e-4)
+    assert list(gra.sssp(0)[0]) == list(gra_i32.sssp(0)[0])
+    assert not hasattr(gra_i32, "pagerank")
+    assert not hasattr(gra_bool, "sssp")
+
+def test_pattern_graph():
+    size = 5
+    gra = SparseGraphBoolIdx32(size, [0, 1, 1, 2, 3], [1, 2, 2, 3, 4])
+    assert gra[1, 2]
+    assert not gra[2, 1]
+    assert [0, 1, 2, 3, 4] == list(gra.bfs(0)[1])
+
+    gra[1, 2] = False
+    assert not gra[1, 2]
+    assert [0, 1, -1, -1, -1] == list(gra.bfs(0)[1])
+
+def test_semiring():
+    size = 6
+    gra = SparseGraph(size)
+    for it in range(size-1):
+        gra[it, it+1] = it + 1
+    gra[0, 3] = 20
+
+    dist = [0] + [math.inf] * (size-1)
+    for it in range(size):
+        dist = [min(a, b) for a, b in zip(dist, gra.vxm(dist, Semiring.min_plus))]
+    assert list(gra.sssp(0)[0]) == dist
+
+    # Breadth-first levels, visited nodes are masked out
+    visited = [True] + [False] * (size-1)
+    front = [1] + [0] * (size-1)
+    front = gra.vxm(front, Semiring.or_and, mask=visited, complement=True)
+    assert [0, 1, 0, 1, 0, 0] == front
+
+def test_components():
+    size = 8
+    gra = SparseGraph(size)
+    gra.reset()
+    # 0 -> 1 -> 2 -> 0 is a cycle, 3 -> 4 hangs off it, 5 <-> 6, 7 alone
+    gra[0, 1] = 1
+    gra[1, 2] = 1
+    gra[2, 0] = 1
+    gra[2, 3] = 1
+    gra[3, 4] = 1
+    gra[5, 6] = 1
+    gra[6, 5] = 1
+
+    label, sizes = gra.weakly_connected_components()
+    assert [0, 0, 0, 0, 0, 1, 1, 2] == list(label)
+    assert [5, 2, 1] == list(sizes)
+
+    label, sizes = gra.strongly_connected_components()
+    assert [0, 0, 0, 1, 2, 3, 3, 4] == list(label)
+    assert [3, 1, 1, 2, 1] == list(sizes)
+
+    ret_label, ret_sizes = gra.strongly_connected_components_async().result()
+    assert list(label) == list(ret_label)
+
+def test_triangles():
+    size = 6
+    gra = SparseGraph(size)
+    gra.reset()
+    # Triangles 0-1-2 and 1-2-3, directions, the reverse edge 1 -> 0
+    # and the self loop do not count
+    gra[0, 1] = 1
+    gra[1, 0] = 1
+    gra[1, 2] = 1
+    gra[2, 0] = 1
+    gra[2, 3] = 1
+    gra[3, 1] = 1
+    gra[4, 5] = 1
+    gra[5, 5] = 1
+
+    total, count = gra.triangles()
+    assert 2 == total
+    assert [1, 2, 2, 1, 0, 0] == list(count)
+    total, count = gra.triangles(per_node=False)
+    assert 2 == total and 0 == len(count)
+    assert 2 == gra.triangles_async().result()[0]
+
+    assert [2, 2, 2, 2, 1, 1] == list(gra.core_numbers())
+    assert [2, 2, 2, 2, 1, 1] == list(gra.core_numbers_async().result())
+
+def test_async():
+    size = 10
+    gra = SparseGraph(size)
+    gra.reset()
+    for it in range(size-2):
+        gra[it, it+1] = 1
+    gra[0, 5] = 1
+
+    futures = [gra.bfs_async(0) for it in range(4)]
+    parent, depth = gra.bfs(0)
+    for future in futures:
+        ret_parent, ret_depth = future.result()
+        assert list(depth) == list(ret_depth)
+
+    dist, pred = gra.sssp_async(0).result()
+    assert list(depth[:8]) == list(dist[:8])
+    assert np.allclose(gra.pagerank(), gra.pagerank_async().result())
+    assert gra.mxv([1] * size) == gra.mxv_async([1] * size).result()
+
+    async def wait():
+        return await asyncio.wrap_future(gra.bfs_async(0))
+    assert list(depth) == list(asyncio.run(wait())[1])
+
+    with pytest.raises(IndexError):
+        gra.bfs_async(size).result()
+
+def test_async_updates():
+    size = 200
+    gra = SparseGraph(size)
+    gra.reset()
+    for it in range(size-1):
+        gra[it, it+1] = 1
+    gra.set_dynamic(min_pending=8, ratio=0)
+
+    # Compactions replace the adjacency while the searches still run
+    futures = [gra.bfs_async(0) for it in range(8)]
+    for it in range(size-1):
+        gra[it, (it*7) % size] = 2
+    for future in futures:
+        parent, depth = future.result()
+        assert size == len(depth)
+        assert 0 == depth[0]
@@ -5,7 +5,8 @@ import math
 import time
 import pytest
 
-from _sparse import SparseMatrix
+from _sparse import SparseMatrix, SparseMatrixBuilder, DuplicatePolicy, Semiring, axpby, combine, stats, reset_stats
+from _sparse import Format, SimdLevel, simd_level, detected_simd_level, set_simd_level
 
 def make_matrices(size, sparse=True):
     mat1 = SparseMatrix(size, size)
@@ -86,6 +87,28 @@ def test_load_save():
             assert mat1_load[i, j] == mat2_load[i, j]
             assert 0 == mat3_load[i, j]
 
+def test_load_save_binary():
+    size = 10
+    mat1, mat2, mat3, *_ = make_matrices(size)
+
+    mat1.save_binary('mat1.bin')
+    mat3.save_binary('mat3.bin')
+
+    mat1_load = SparseMatrix()
+    mat1_load.load_binary('mat1.bin')
+    mat1_map = SparseMatrix()
+    mat1_map.load_binary('mat1.bin', mmap=True)
+    mat3_map = SparseMatrix()
+    mat3_map.load_binary('mat3.bin', mmap=True)
+
+    assert mat1 == mat1_load
+    assert mat1 == mat1_map
+    assert mat3 == mat3_map
+
+    mat1_map[0, 0] = 0
+    assert 0 == mat1_map[0, 0]
+    assert mat1_map != mat1_load
+
 def test_expand_shrink_row():
     size = 10
     mat1, mat2, mat3, *_ = make_matrices(size)
@@ -138,3 +161,213 @@ def test_expand_shrink_col():
     assert 0 == mat2[size-1, size-1]
     assert 0 == mat3[size-1, size-1]
 
+
+def test_multiply_vector():
+    size = 10
+    mat1, *_ = make_matrices(size)
+    mat2 = np.arange(1, size*size+1).reshape(size, size)
+    vec = list(range(size))
+
+    ret_sparse = mat1 * vec
+    ret_numpy = np.dot(mat2, vec)
+
+    assert size == len(ret_sparse)
+    for i in range(size):
+        assert ret_sparse[i] == ret_numpy[i]
+
+    block = np.arange(size*3, dtype=np.float64).reshape(size, 3)
+    ret_block = mat1.spmm(block)
+
+    assert (size, 3) == ret_block.shape
+    assert np.array_equal(ret_block, np.dot(mat2, block))
+
+def test_format():
+    size = 50
+    mat = SparseMatrix(size, size)
+    # Tridiagonal, dense 2 x 2 blocks along the diagonal
+    for it in range(size):
+        for jt in range(max(0, it-1), min(size, it+2)):
+            mat[it, jt] = it + jt + 1
+    vec = list(range(size))
+    block = np.arange(size*3, dtype=np.float64).reshape(size, 3)
+    ret = mat * vec
+    ret_block = mat.spmm(block)
+
+    structure = mat.analyze()
+    assert structure["max_row"] == 3
+    assert structure["block"] in (2, 4, 8)
+    assert Format.csr == mat.active_format
+
+    level = simd_level()
+    assert level == detected_simd_level()
+    for fmt in [Format.sell, Format.bcsr, Format.automatic]:
+        mat.format = fmt
+        assert fmt == mat.format
+        for it in range(int(level) + 1):
+            set_simd_level(SimdLevel(it))
+            assert np.allclose(mat * vec, ret)
+            assert np.allclose(mat.spmm(block), ret_block)
+        set_simd_level(level)
+    assert Format.automatic == mat.format
+    assert structure["format"] == mat.active_format
+
+    # Changes drop the converted layout
+    mat.format = Format.sell
+    mat[0, size-1] = 5
+    ret[0] += 5 * (size-1)
+    assert np.allclose(mat * vec, ret)
+
+def test_builder():
+    size = 10
+    mat1, *_ = make_matrices(size)
+
+    builder = SparseMatrixBuilder(size, size, DuplicatePolicy.sum)
+    for it in reversed(range(size)):
+        for jt in reversed(range(size)):
+            builder.add(it, jt, it * size + jt)
+            builder.add(it, jt, 1)
+    mat2 = builder.build()
+
+    assert size*size*2 == len(builder)
+    assert mat1 == mat2
+
+    builder = SparseMatrixBuilder(size, size, DuplicatePolicy.last)
+    builder.add([0, 0, 1], [1, 1, 0], [5, 3, 4])
+    mat3 = builder.build()
+
+    assert 3 == mat3[0, 1]
+    assert 4 == mat3[1, 0]
+    assert 0 == mat3[0, 0]
+
+def test_add_sub():
+    size = 10
+    mat1 = SparseMatrix(size, size)
+    mat2 = SparseMatrix(size, size)
+    for it in range(size):
+        mat1[it, it] = it + 1
+        mat2[it, size-it-1] = it + 1
+
+    ret_add = mat1 + mat2
+    ret_sub = mat1 - mat2
+    ret_axpby = axpby(2, mat1, 3, mat2)
+
+    for i in range(size):
+        for j in range(size):
+            assert ret_add[i, j] == mat1[i, j] + mat2[i, j]
+            assert ret_sub[i, j] == mat1[i, j] - mat2[i, j]
+            assert ret_axpby[i, j] == 2 * mat1[i, j] + 3 * mat2[i, j]
+
+    mat1 += mat2
+    assert mat1 == ret_add
+
+def test_combine():
+    size = 10
+    mat1, mat2, mat3 = make_matrices(size)
+    mat3[0, 1] = 4
+
+    ret = combine([(0.5, mat1), (0.5, mat2), (-1, mat3)])
+    for i in range(size):
+        for j in range(size):
+            assert ret[i, j] == 0.5 * mat1[i, j] + 0.5 * mat2[i, j] - mat3[i, j]
+    assert ret == (mat1 + mat2) * 0.5 - mat3
+    assert 0 == len(combine([(1, mat1), (-1, mat2)]).to_csr()[1])
+
+    with pytest.raises(IndexError):
+        combine([])
+    with pytest.raises(IndexError):
+        combine([(1, mat1), (1, SparseMatrix(size, size+1))])
+
+def test_semiring():
+    size = 30
+    mat1, mat2, mat3, *_ = make_matrices(size)
+    vec = [it for it in range(size)]
+
+    assert mat1 * vec == pytest.approx(mat1.mxv(vec))
+    assert mat1 * mat2 == mat1.mxm(mat2, Semiring.plus_times)
+
+    mat = SparseMatrix(3, 3)
+    mat[0, 1] = 4
+    mat[1, 2] = 1
+    mat[0, 2] = 7
+    dist = [0, math.inf, math.inf]
+    for it in range(2):
+        dist = [min(a, b) for a, b in zip(dist, mat.vxm(dist, Semiring.min_plus))]
+    assert [0, 4, 5] == dist
+
+    assert [1, 1] == mat.mxv([1, 1, 1], Semiring.max_min)[:2]
+    assert [0, 1, 0] == mat.mxv([1, 1, 1], Semiring.or_and, mask=[False, True, False])
+
+    masked = mat.mxm(mat, Semiring.plus_times, mask=mat)
+    assert 4 == masked[0, 2]
+    assert 0 == masked[0, 1]
+    assert 0 == mat.mxm(mat, Semiring.plus_times, mask=mat, complement=True)[0, 2]
+
+    # A path of length zero is stored under min_plus, absent means no path
+    neg = SparseMatrix(2, 2)
+    neg[0, 1] = -1
+    neg[1, 0] = 1
+    paths = neg.mxm(neg, Semiring.min_plus)
+    assert 2 == paths.to_csr()[0][-1]
+    assert 0 == paths[0, 0]
+    assert math.inf == paths[0, 1]
+    assert math.inf == paths.zero
+
+def test_csr_interop():
+    indptr = np.array([0, 2, 3, 3], dtype=np.int64)
+    indices = np.array([0, 2, 1], dtype=np.int64)
+    data = np.array([1.0, 2.0, 3.0])
+    mat = SparseMatrix.from_csr(indptr, indices, data, ncol=3)
+    assert 3 == mat.nrow and 3 == mat.ncol
+    assert 2 == mat[0, 2]
+    assert 3 == mat[1, 1]
+
+    # Canonical arrays are used in place and exported without a copy
+    ret_indptr, ret_indices, ret_data = mat.to_csr()
+    assert [0, 2, 3, 3] == list(ret_indptr)
+    assert [0, 2, 1] == list(ret_indices)
+    assert not ret_data.flags.writeable
+    assert np.shares_memory(indptr, ret_indptr)
+    assert np.shares_memory(indices, ret_indices)
+    assert np.shares_memory(data, ret_data)
+    again_indptr, again_indices, again_data = mat.to_csr()
+    assert np.shares_memory(ret_indptr, again_indptr)
+    assert np.shares_memory(ret_indices, again_indices)
+    assert np.shares_memory(ret_data, again_data)
+
+    # Exported arrays keep their content when the matrix changes
+    mat[2, 0] = 5
+    assert [1, 2, 3] == list(ret_data)
+    assert 5 == mat[2, 0]
+
+    unsorted = SparseMatrix.from_csr(np.array([0, 3]), np.array([2, 0, 2]), np.array([1.0, 4.0, 1.0]))
+    assert 3 == unsorted.ncol
+    assert 4 == unsorted[0, 0]
+    assert 2 == unsorted[0, 2]
+
+    with pytest.raises(IndexError):
+        SparseMatrix.from_csr(indptr, np.array([0, 3, 1]), data, ncol=3)
+    with pytest.raises(ValueError):
+        SparseMatrix.from_csr(indptr, indices, ncol=3)
+
+    sp = pytest.importorskip("scipy.sparse")
+    other = sp.random(20, 30, density=0.2, format="csr", random_state=1)
+    mat = SparseMatrix.from_scipy(other)
+    assert 20 == mat.nrow and 30 == mat.ncol
+    assert 0 == abs(mat.to_scipy() - other).sum()
+
+def test_stats():
+    reset_stats()
+    mat = SparseMatrix(10, 10)
+    mat[1, 2] = 3
+    mat[1, 2] = 4
+    ret = stats()
+    assert "find_index" in ret["ops"]
+    assert "reallocate" in ret["buffers"]
+    if ret["enabled"]:
+        assert 2 == ret["ops"]["set"]["calls"]
+        assert 1 == ret["ops"]["insert"]["calls"]
+    else:
+        assert all(0 == op["calls"] for op in ret["ops"].values())
+
+    reset_stats()
+    assert all(0 == op["calls"] for op in stats()["ops"].values())
@@ -0,0 +1,78 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#ifndef SPARSEATOMIC_H
+#define SPARSEATOMIC_H
+
+/*
+ * Atomic operations on plain array elements
+ * The graph kernels keep their state in ordinary arrays and only use
+ * atomic access where threads actually race, relaxed ordering is enough
+ * since every kernel synchronizes at the end of its parallel regions.
+*/
+
+template<typename T>
+inline T atomic_load(T const & x)
+{
+    T ret;
+    __atomic_load(&x, &ret, __ATOMIC_RELAXED);
+    return ret;
+}
+
+template<typename T>
+inline void atomic_store(T & x, T value)
+{
+    __atomic_store(&x, &value, __ATOMIC_RELAXED);
+}
+
+template<typename T>
+inline bool compare_and_swap(T & x, T old_value, T new_value)
+{
+    return __atomic_compare_exchange(&x, &old_value, &new_value, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+template<typename T>
+inline T fetch_add(T & x, T value)
+{
+    return __atomic_fetch_add(&x, value, __ATOMIC_RELAXED);
+}
+
+template<typename T>
+inline T fetch_or(T & x, T value)
+{
+    return __atomic_fetch_or(&x, value, __ATOMIC_RELAXED);
+}
+
+/*
+ * Lower x to value if value is smaller
+ * @return true if x has been lowered by this call
+*/
+template<typename T>
+inline bool write_min(T & x, T value)
+{
+    T current = atomic_load(x);
+    while (value < current)
+    {
+        if (compare_and_swap(x, current, value)) return true;
+        current = atomic_load(x);
+    }
+    return false;
+}
+
+/*
+ * Raise x to value if value is larger
+ * @return true if x has been raised by this call
+*/
+template<typename T>
+inline bool write_max(T & x, T value)
+{
+    T current = atomic_load(x);
+    while (value > current)
+    {
+        if (compare_and_swap(x, current, value)) return true;
+        current = atomic_load(x);
+    }
+    return false;
+}
+
+#endif
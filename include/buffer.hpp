@@ -0,0 +1,333 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#ifndef SPARSEBUFFER_H
+#define SPARSEBUFFER_H
+
+#define buffer_alignment_ 64
+
+#include <new>
+#include <memory>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+#include "stats.hpp"
+
+/*
+ * Contiguous storage of the sparse containers
+ * The elements either live in an owned allocation aligned to a 64-byte
+ * boundary, or are borrowed from an external read-only region such as a
+ * memory mapped file. Borrowed elements are kept alive by the owner handle
+ * and are copied into an owned allocation before the first modification.
+ * That copy happens in data(), begin() and the members which change the
+ * size, element access never copies, so a mutator writing element by
+ * element takes ownership once through data() beforehand.
+*/
+template<typename T>
+class Buffer {
+
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "buffer elements must be trivially copyable");
+
+public:
+
+    using value_type = T;
+    using iterator = T *;
+    using const_iterator = T const *;
+
+    Buffer() : m_ptr(nullptr), m_size(0), m_capacity(0), m_borrowed(false) {}
+    explicit Buffer(size_t size, T value=T()) : Buffer() { resize(size, value); }
+    Buffer(std::vector<T> const & other) : Buffer() { assign(other.data(), other.size()); }
+    Buffer(Buffer<T> const & other) : Buffer() { *this = other; }
+    Buffer(Buffer<T> && other) noexcept : Buffer() { swap(other); }
+    ~Buffer() = default;
+
+    Buffer & operator= (Buffer<T> const & other);
+    Buffer & operator= (Buffer<T> && other) noexcept { swap(other); return *this; }
+
+    static Buffer borrow(T const * ptr, size_t size, std::shared_ptr<void const> owner);
+    std::shared_ptr<void const> share() const;
+
+    bool operator== (Buffer<T> const & other) const
+    {
+        return m_size == other.m_size && std::equal(begin(), end(), other.begin());
+    }
+    bool operator!= (Buffer<T> const & other) const { return !(*this == other); }
+
+    size_t size() const { return m_size; }
+    size_t capacity() const { return m_capacity; }
+    bool empty() const { return m_size == 0; }
+    bool borrowed() const { return m_borrowed; }
+
+    T const * data() const { return m_ptr; }
+    T * data() { own(); return m_ptr; }
+    const_iterator begin() const { return m_ptr; }
+    const_iterator end() const { return m_ptr + m_size; }
+    iterator begin() { own(); return m_ptr; }
+    iterator end() { own(); return m_ptr + m_size; }
+
+    T const & operator[] (size_t i) const { return m_ptr[i]; }
+    T & operator[] (size_t i) { return m_ptr[i]; }
+    T const & at(size_t i) const { check(i); return m_ptr[i]; }
+    T & at(size_t i) { check(i); return m_ptr[i]; }
+    T const & front() const { return m_ptr[0]; }
+    T const & back() const { return m_ptr[m_size-1]; }
+    T & front() { return m_ptr[0]; }
+    T & back() { return m_ptr[m_size-1]; }
+
+    void assign(T const * ptr, size_t size);
+    void reserve(size_t capacity);
+    void resize(size_t size, T value=T());
+    void clear() { if (m_borrowed) *this = Buffer<T>(); m_size = 0; }
+    void push_back(T value);
+    void pop_back() { own(); --m_size; }
+    iterator insert(const_iterator pos, T value);
+    iterator erase(const_iterator pos) { return erase(pos, pos+1); }
+    iterator erase(const_iterator first, const_iterator last);
+    void swap(Buffer<T> & other) noexcept;
+
+private:
+
+    void own();
+    void reallocate(size_t capacity);
+    void check(size_t i) const
+    {
+        if (i >= m_size) throw std::out_of_range("buffer index out of range");
+    }
+
+    std::shared_ptr<void const> m_owner;
+    T * m_ptr;
+    size_t m_size;
+    size_t m_capacity;
+    // Sharing the elements turns them read-only, also through const access
+    mutable bool m_borrowed;
+
+};
+
+/*
+ * Assignment Operator
+ * Owned elements are copied, borrowed elements share the same owner
+*/
+template<typename T>
+Buffer<T> & Buffer<T>::operator= (Buffer<T> const & other)
+{
+    if (this == &other) return *this;
+    if (other.m_borrowed)
+    {
+        m_owner = other.m_owner;
+        m_ptr = other.m_ptr;
+        m_size = other.m_size;
+        m_capacity = other.m_size;
+        m_borrowed = true;
+    }
+    else
+        assign(other.m_ptr, other.m_size);
+    return *this;
+}
+
+/*
+ * Wrap an external read-only region without copying
+ * @param ptr first element of the region
+ * @param size number of elements in the region
+ * @param owner handle keeping the region alive
+*/
+template<typename T>
+Buffer<T> Buffer<T>::borrow(T const * ptr, size_t size, std::shared_ptr<void const> owner)
+{
+    Buffer<T> ret;
+    ret.m_owner = std::move(owner);
+    ret.m_ptr = const_cast<T *>(ptr);
+    ret.m_size = size;
+    ret.m_capacity = size;
+    ret.m_borrowed = true;
+    return ret;
+}
+
+/*
+ * Owner handle of the elements for handing them out without a copy
+ * The elements turn borrowed, so the buffer copies them before its next
+ * modification and the shared elements never change.
+*/
+template<typename T>
+std::shared_ptr<void const> Buffer<T>::share() const
+{
+    m_borrowed = true;
+    return m_owner;
+}
+
+/*
+ * Replace the content with a copy of the specified elements
+*/
+template<typename T>
+void Buffer<T>::assign(T const * ptr, size_t size)
+{
+    m_size = 0;
+    if (m_borrowed || m_capacity < size) reallocate(size);
+    if (size) std::memcpy(m_ptr, ptr, size * sizeof(T));
+    m_size = size;
+}
+
+template<typename T>
+void Buffer<T>::reserve(size_t capacity)
+{
+    own();
+    if (capacity > m_capacity) reallocate(capacity);
+}
+
+template<typename T>
+void Buffer<T>::resize(size_t size, T value)
+{
+    own();
+    if (size > m_capacity) reallocate(std::max(size, m_capacity * 2));
+    if (size > m_size) std::fill(m_ptr + m_size, m_ptr + size, value);
+    m_size = size;
+}
+
+template<typename T>
+void Buffer<T>::push_back(T value)
+{
+    own();
+    if (m_size == m_capacity) reallocate(std::max<size_t>(m_capacity * 2, 8));
+    m_ptr[m_size++] = value;
+}
+
+template<typename T>
+typename Buffer<T>::iterator Buffer<T>::insert(const_iterator pos, T value)
+{
+    const size_t k = static_cast<size_t>(pos - m_ptr);
+    own();
+    if (m_size == m_capacity) reallocate(std::max<size_t>(m_capacity * 2, 8));
+    std::memmove(m_ptr + k + 1, m_ptr + k, (m_size - k) * sizeof(T));
+    m_ptr[k] = value;
+    ++m_size;
+    return m_ptr + k;
+}
+
+template<typename T>
+typename Buffer<T>::iterator Buffer<T>::erase(const_iterator first, const_iterator last)
+{
+    const size_t k = static_cast<size_t>(first - m_ptr);
+    const size_t l = static_cast<size_t>(last - m_ptr);
+    own();
+    std::memmove(m_ptr + k, m_ptr + l, (m_size - l) * sizeof(T));
+    m_size -= l - k;
+    return m_ptr + k;
+}
+
+template<typename T>
+void Buffer<T>::swap(Buffer<T> & other) noexcept
+{
+    std::swap(m_owner, other.m_owner);
+    std::swap(m_ptr, other.m_ptr);
+    std::swap(m_size, other.m_size);
+    std::swap(m_capacity, other.m_capacity);
+    std::swap(m_borrowed, other.m_borrowed);
+}
+
+/*
+ * Make the elements writable by copying borrowed elements
+*/
+template<typename T>
+void Buffer<T>::own()
+{
+    if (m_borrowed) reallocate(m_size);
+}
+
+/*
+ * Move the elements into a new owned allocation
+*/
+template<typename T>
+void Buffer<T>::reallocate(size_t capacity)
+{
+    std::shared_ptr<void const> owner;
+    T * ptr = nullptr;
+    if (capacity)
+    {
+        SPARSE_STAT_BUFFER(m_borrowed ? StatBuffer::own : m_size ? StatBuffer::reallocate : StatBuffer::allocate,
+                           capacity * sizeof(T));
+        void * raw = ::operator new(capacity * sizeof(T), std::align_val_t(buffer_alignment_));
+        owner.reset(raw, [](void const * p)
+        {
+            ::operator delete(const_cast<void *>(p), std::align_val_t(buffer_alignment_));
+        });
+        ptr = static_cast<T *>(raw);
+    }
+    if (m_size) std::memcpy(ptr, m_ptr, m_size * sizeof(T));
+
+    m_owner.swap(owner);
+    m_ptr = ptr;
+    m_capacity = capacity;
+    m_borrowed = false;
+}
+
+/*
+ * Value storage of pattern-only matrices
+ * Every stored element of a pattern is one, so only the number of elements
+ * is kept and no memory is allocated. There is no element array to point
+ * to, data() is null and the kernels skip the value loads altogether.
+*/
+template<typename T>
+class PatternBuffer {
+
+public:
+
+    using value_type = T;
+    // Positions stand in for iterators, there is nothing to point to
+    using iterator = size_t;
+    using const_iterator = size_t;
+
+    PatternBuffer() : m_size(0) {}
+    explicit PatternBuffer(size_t size, T=T()) : m_size(size) {}
+
+    static PatternBuffer borrow(T const *, size_t size, std::shared_ptr<void const>)
+    {
+        return PatternBuffer(size);
+    }
+    std::shared_ptr<void const> share() const { return nullptr; }
+
+    bool operator== (PatternBuffer<T> const & other) const { return m_size == other.m_size; }
+    bool operator!= (PatternBuffer<T> const & other) const { return m_size != other.m_size; }
+
+    size_t size() const { return m_size; }
+    size_t capacity() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    bool borrowed() const { return false; }
+
+    T const * data() const { return nullptr; }
+    T * data() { return nullptr; }
+    const_iterator begin() const { return 0; }
+    const_iterator end() const { return m_size; }
+    T operator[] (size_t) const { return static_cast<T>(1); }
+    T at(size_t i) const
+    {
+        if (i >= m_size) throw std::out_of_range("buffer index out of range");
+        return static_cast<T>(1);
+    }
+
+    void reserve(size_t) {}
+    void resize(size_t size, T=T()) { m_size = size; }
+    void clear() { m_size = 0; }
+    void push_back(T) { ++m_size; }
+    void pop_back() { --m_size; }
+    iterator insert(const_iterator pos, T) { ++m_size; return pos; }
+    iterator erase(const_iterator pos) { --m_size; return pos; }
+    iterator erase(const_iterator first, const_iterator last) { m_size -= last - first; return first; }
+    void swap(PatternBuffer<T> & other) noexcept { std::swap(m_size, other.m_size); }
+
+private:
+
+    size_t m_size;
+
+};
+
+// Whether matrices of the value type store only their pattern
+template<typename T>
+struct is_pattern : std::is_same<T, bool> {};
+
+// Value storage of a matrix with the specified value type
+template<typename T>
+using ValueBuffer = typename std::conditional<is_pattern<T>::value, PatternBuffer<T>, Buffer<T>>::type;
+
+#endif
@@ -0,0 +1,50 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#ifndef SPARSEBUILDER_H
+#define SPARSEBUILDER_H
+
+#include "sparse.hpp"
+
+/*
+ * Policy used to combine triplets sharing the same row and column
+ * sum  : add all values together
+ * max  : keep the largest value
+ * last : keep the value which was added last
+*/
+enum class DuplicatePolicy { sum, max, last };
+
+template<typename fT, typename IndexT=uint64_t>
+class SparseMatrixBuilder {
+
+public:
+
+    SparseMatrixBuilder(size_t nrow=1, size_t ncol=1, DuplicatePolicy policy=DuplicatePolicy::sum);
+    ~SparseMatrixBuilder() = default;
+
+    void reserve(size_t nnz);
+    void clear();
+
+    void add(size_t nrow, size_t ncol, fT value);
+    void add(std::vector<size_t> const & rows, std::vector<size_t> const & cols,
+             std::vector<fT> const & values);
+
+    SparseMatrix<fT, IndexT> build() const;
+
+    size_t nrow() const { return m_nrow; }
+    size_t ncol() const { return m_ncol; }
+    size_t size() const { return m_rows.size(); }
+    DuplicatePolicy policy() const { return m_policy; }
+
+private:
+
+    size_t m_nrow;
+    size_t m_ncol;
+    DuplicatePolicy m_policy;
+
+    std::vector<size_t> m_rows;
+    std::vector<size_t> m_cols;
+    std::vector<fT> m_values;
+
+};
+
+#endif
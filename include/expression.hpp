@@ -0,0 +1,371 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#ifndef SPARSEEXPRESSION_H
+#define SPARSEEXPRESSION_H
+
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+#include "sparse.hpp"
+
+/*
+ * Lazy matrix arithmetic
+ * The operators +, -, * and / on matrices build a tree of expression
+ * nodes instead of computing every intermediate matrix. The tree is
+ * evaluated when it is assigned to a matrix: sums and scalings flatten
+ * into a list of scaled matrices which are merged in one fused pass, see
+ * combine, so (A + B) * 0.5 - C stores nothing but the result. Only
+ * products are computed on their own.
+ * A tree multiplied with a vector is evaluated right to left, so A * B * x
+ * costs two sparse matrix vector products and never forms A * B, and the
+ * scaled matrices of a sum share a single pass over the rows.
+ * Nodes refer to the matrices by reference. An expression has to be
+ * evaluated while those matrices live, so do not keep one in an auto
+ * variable beyond the statement that creates it.
+*/
+
+// Matrices are held by reference, inner nodes by value
+template<typename E>
+struct expr_operand { using type = E; };
+template<typename fT, typename IndexT>
+struct expr_operand<SparseMatrix<fT, IndexT>> { using type = SparseMatrix<fT, IndexT> const &; };
+
+/*
+ * Flattened expression
+ * terms are the scaled matrices of the sum, matrices and vectors hold the
+ * products computed on the way, which the terms point into
+*/
+template<typename fT, typename IndexT>
+struct ExprTerms
+{
+    std::vector<MatrixTerm<fT, IndexT>> terms;
+    std::deque<SparseMatrix<fT, IndexT>> matrices;
+    std::deque<Buffer<fT>> vectors;
+};
+
+template<typename E>
+SparseMatrix<typename E::value_type, typename E::index_type> evaluate(MatrixExpr<E> const & expr);
+template<typename E>
+Buffer<typename E::value_type> evaluate_vector(MatrixExpr<E> const & expr, typename E::value_type const * x);
+
+template<typename fT, typename IndexT>
+void collect_terms(SparseMatrix<fT, IndexT> const & mat, fT scale, ExprTerms<fT, IndexT> & state)
+{
+    state.terms.push_back({scale, &mat});
+}
+template<typename E, typename fT, typename IndexT>
+void collect_terms(MatrixExpr<E> const & expr, fT scale, ExprTerms<fT, IndexT> & state)
+{
+    expr.derived().collect(scale, state);
+}
+
+template<typename fT, typename IndexT>
+void collect_vectors(SparseMatrix<fT, IndexT> const & mat, fT scale, fT const * x, ExprTerms<fT, IndexT> & state)
+{
+    state.terms.push_back({scale, &mat, x});
+}
+template<typename E, typename fT, typename IndexT>
+void collect_vectors(MatrixExpr<E> const & expr, fT scale, fT const * x, ExprTerms<fT, IndexT> & state)
+{
+    expr.derived().collect_vectors(scale, x, state);
+}
+
+// Operand as a matrix, computed into the state unless it is one already
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> const & materialize(SparseMatrix<fT, IndexT> const & mat, ExprTerms<fT, IndexT> &)
+{
+    return mat;
+}
+template<typename E, typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> const & materialize(MatrixExpr<E> const & expr, ExprTerms<fT, IndexT> & state)
+{
+    state.matrices.push_back(evaluate(expr));
+    return state.matrices.back();
+}
+
+/*
+ * Scaled expression, alpha * expr or expr / alpha
+ * Integer division rounds every element, so it is applied to the computed
+ * operand instead of being folded into the scale of the terms
+*/
+template<typename E>
+class ScaledExpr : public MatrixExpr<ScaledExpr<E>> {
+
+public:
+
+    using value_type = typename E::value_type;
+    using index_type = typename E::index_type;
+
+    ScaledExpr(E const & expr, value_type alpha, bool divide=false)
+        : m_expr(expr), m_alpha(alpha), m_divide(divide) {}
+
+    size_t nrow() const { return m_expr.nrow(); }
+    size_t ncol() const { return m_expr.ncol(); }
+
+    void collect(value_type scale, ExprTerms<value_type, index_type> & state) const
+    {
+        if (!rounded())
+        {
+            collect_terms(m_expr, fold(scale), state);
+            return;
+        }
+        state.terms.push_back({scale, &quotient(state)});
+    }
+    void collect_vectors(value_type scale, value_type const * x, ExprTerms<value_type, index_type> & state) const
+    {
+        if (!rounded())
+        {
+            ::collect_vectors(m_expr, fold(scale), x, state);
+            return;
+        }
+        state.terms.push_back({scale, &quotient(state), x});
+    }
+
+private:
+
+    bool rounded() const
+    {
+        return m_divide && !std::is_floating_point<value_type>::value && !is_pattern<value_type>::value;
+    }
+    value_type fold(value_type scale) const
+    {
+        // Scaling a pattern by false drops it, dividing leaves it as it is
+        if constexpr (is_pattern<value_type>::value)
+            return m_divide ? scale : scale && m_alpha;
+        else if (!m_divide)
+            return scale * m_alpha;
+        else
+            return scale / m_alpha;
+    }
+    SparseMatrix<value_type, index_type> const & quotient(ExprTerms<value_type, index_type> & state) const
+    {
+        state.matrices.push_back(evaluate(m_expr));
+        state.matrices.back() /= m_alpha;
+        return state.matrices.back();
+    }
+
+    typename expr_operand<E>::type m_expr;
+    value_type m_alpha;
+    bool m_divide;
+
+};
+
+/*
+ * Sum of two expressions of the same dimension
+ * Substraction is the sum with the right side scaled by minus one
+*/
+template<typename L, typename R>
+class SumExpr : public MatrixExpr<SumExpr<L, R>> {
+
+public:
+
+    using value_type = typename L::value_type;
+    using index_type = typename L::index_type;
+    static_assert(std::is_same<value_type, typename R::value_type>::value &&
+                  std::is_same<index_type, typename R::index_type>::value,
+                  "both operands need the same value and index type");
+
+    SumExpr(L const & left, R const & right) : m_left(left), m_right(right)
+    {
+        if (m_left.nrow() != m_right.nrow() || m_left.ncol() != m_right.ncol())
+        {
+            throw std::out_of_range(
+                "the dimension of first matrix "
+                "differs from that of second matrix");
+        }
+    }
+
+    size_t nrow() const { return m_left.nrow(); }
+    size_t ncol() const { return m_left.ncol(); }
+
+    void collect(value_type scale, ExprTerms<value_type, index_type> & state) const
+    {
+        collect_terms(m_left, scale, state);
+        collect_terms(m_right, scale, state);
+    }
+    void collect_vectors(value_type scale, value_type const * x, ExprTerms<value_type, index_type> & state) const
+    {
+        ::collect_vectors(m_left, scale, x, state);
+        ::collect_vectors(m_right, scale, x, state);
+    }
+
+private:
+
+    typename expr_operand<L>::type m_left;
+    typename expr_operand<R>::type m_right;
+
+};
+
+/*
+ * Product of two expressions
+ * As a matrix both operands are computed and multiplied. Applied to a
+ * vector the right operand is applied first, so the product itself is
+ * never formed.
+*/
+template<typename L, typename R>
+class ProductExpr : public MatrixExpr<ProductExpr<L, R>> {
+
+public:
+
+    using value_type = typename L::value_type;
+    using index_type = typename L::index_type;
+    static_assert(std::is_same<value_type, typename R::value_type>::value &&
+                  std::is_same<index_type, typename R::index_type>::value,
+                  "both operands need the same value and index type");
+
+    ProductExpr(L const & left, R const & right) : m_left(left), m_right(right)
+    {
+        if (m_left.ncol() != m_right.nrow())
+        {
+            throw std::out_of_range(
+                "the number of first matrix column "
+                "differs from that of second matrix row");
+        }
+    }
+
+    size_t nrow() const { return m_left.nrow(); }
+    size_t ncol() const { return m_right.ncol(); }
+
+    void collect(value_type scale, ExprTerms<value_type, index_type> & state) const
+    {
+        SparseMatrix<value_type, index_type> const & left = materialize(m_left, state);
+        SparseMatrix<value_type, index_type> const & right = materialize(m_right, state);
+        state.matrices.push_back(left.multiply(right));
+        state.terms.push_back({scale, &state.matrices.back()});
+    }
+    void collect_vectors(value_type scale, value_type const * x, ExprTerms<value_type, index_type> & state) const
+    {
+        state.vectors.push_back(evaluate_vector(m_right, x));
+        ::collect_vectors(m_left, scale, state.vectors.back().data(), state);
+    }
+
+private:
+
+    typename expr_operand<L>::type m_left;
+    typename expr_operand<R>::type m_right;
+
+};
+
+/*
+ * Compute an expression into a matrix
+ * A lone product is returned as it is, everything else goes through
+ * one fused sum
+*/
+template<typename E>
+SparseMatrix<typename E::value_type, typename E::index_type> evaluate(MatrixExpr<E> const & expr)
+{
+    using fT = typename E::value_type;
+    ExprTerms<fT, typename E::index_type> state;
+    collect_terms(expr.derived(), static_cast<fT>(1), state);
+    if (state.terms.size() == 1 && state.terms[0].scale == static_cast<fT>(1) &&
+        !state.matrices.empty() && state.terms[0].matrix == &state.matrices.back())
+    {
+        return std::move(state.matrices.back());
+    }
+    return combine(state.terms);
+}
+
+/*
+ * Compute the product of an expression with a dense vector
+ * @param x dense vector of size ncol
+ * @return dense vector of size nrow
+*/
+template<typename E>
+Buffer<typename E::value_type> evaluate_vector(MatrixExpr<E> const & expr, typename E::value_type const * x)
+{
+    using fT = typename E::value_type;
+    ExprTerms<fT, typename E::index_type> state;
+    collect_vectors(expr.derived(), static_cast<fT>(1), x, state);
+    Buffer<fT> ret(expr.derived().nrow(), static_cast<fT>(0));
+    combine_multiply(state.terms, ret.data());
+    return ret;
+}
+
+template<typename L, typename R>
+SumExpr<L, R> operator+ (MatrixExpr<L> const & left, MatrixExpr<R> const & right)
+{
+    return SumExpr<L, R>(left.derived(), right.derived());
+}
+
+template<typename L, typename R>
+SumExpr<L, ScaledExpr<R>> operator- (MatrixExpr<L> const & left, MatrixExpr<R> const & right)
+{
+    using fT = typename R::value_type;
+    return SumExpr<L, ScaledExpr<R>>(left.derived(), ScaledExpr<R>(right.derived(), static_cast<fT>(-1)));
+}
+
+template<typename E>
+ScaledExpr<E> operator* (MatrixExpr<E> const & expr, typename E::value_type alpha)
+{
+    return ScaledExpr<E>(expr.derived(), alpha);
+}
+
+template<typename E>
+ScaledExpr<E> operator* (typename E::value_type alpha, MatrixExpr<E> const & expr)
+{
+    return ScaledExpr<E>(expr.derived(), alpha);
+}
+
+template<typename E>
+ScaledExpr<E> operator/ (MatrixExpr<E> const & expr, typename E::value_type alpha)
+{
+    return ScaledExpr<E>(expr.derived(), alpha, true);
+}
+
+template<typename L, typename R>
+ProductExpr<L, R> operator* (MatrixExpr<L> const & left, MatrixExpr<R> const & right)
+{
+    return ProductExpr<L, R>(left.derived(), right.derived());
+}
+
+/*
+ * Product of an expression with a dense vector, see evaluate_vector
+ * A single matrix uses SparseMatrix::operator* instead
+*/
+template<typename E>
+std::vector<typename E::value_type> operator* (MatrixExpr<E> const & expr,
+                                               std::vector<typename E::value_type> const & x)
+{
+    using fT = typename E::value_type;
+    if (expr.derived().ncol() != x.size())
+    {
+        throw std::out_of_range(
+            "the dimension of first matrix column "
+            "differs from that of vector size");
+    }
+    // std::vector<bool> is bit packed, go through a plain array
+    Buffer<fT> input(x.size());
+    std::copy(x.begin(), x.end(), input.begin());
+    Buffer<fT> ret = evaluate_vector(expr, input.data());
+    return std::vector<fT>(ret.begin(), ret.end());
+}
+
+/**
+ * Expression Constructor
+ * Init Sparse Matrix by evaluating a lazy expression
+**/
+template<typename fT, typename IndexT>
+template<typename E>
+SparseMatrix<fT, IndexT>::SparseMatrix(MatrixExpr<E> const & expr)
+    : SparseMatrix(evaluate(expr))
+{
+
+}
+
+/*
+ * Expression Assignment
+ * The expression is evaluated before the matrix is replaced, so the
+ * matrix may appear in it
+*/
+template<typename fT, typename IndexT>
+template<typename E>
+SparseMatrix<fT, IndexT> & SparseMatrix<fT, IndexT>::operator= (MatrixExpr<E> const & expr)
+{
+    replace_content(evaluate(expr));
+    return *this;
+}
+
+#endif
@@ -0,0 +1,137 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#ifndef SPARSEFORMAT_H
+#define SPARSEFORMAT_H
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "sparse.hpp"
+
+// Rows of a SELL slice, one vector lane each
+#define sell_chunk_ 8
+// Rows sorted by length together, a multiple of the slice height
+#define sell_sigma_ 256
+// Block rows sampled by the analyzer for the block fill
+#define analyze_samples_ 4096
+
+/*
+ * Sliced ELLPACK with a sorting window, SELL-C-sigma
+ * Rows are sorted by length within windows of sigma rows and cut into
+ * slices of C rows. A slice is stored column by column, padded to its
+ * longest row, so element j of all its rows lies contiguous and one
+ * vector instruction handles a whole slice. Sorting keeps the padding
+ * small when row lengths vary. Only for the numeric value types.
+*/
+template<typename fT, typename IndexT>
+class SellMatrix {
+
+public:
+
+    explicit SellMatrix(SparseMatrix<fT, IndexT> const & mat, size_t sigma=sell_sigma_);
+
+    void multiply(const fT * other, fT * ret) const;
+    void multiply(const fT * other, fT * ret, size_t k) const;
+
+    size_t nrow() const { return m_nrow; }
+    size_t ncol() const { return m_ncol; }
+    size_t chunk() const { return sell_chunk_; }
+    size_t sigma() const { return m_sigma; }
+    // Stored elements, padding included
+    size_t stored() const { return m_indices.size(); }
+
+private:
+
+    size_t m_nrow;
+    size_t m_ncol;
+    size_t m_sigma;
+
+    // Offset and width of every slice
+    std::vector<size_t> m_offset;
+    std::vector<size_t> m_width;
+    // Original row of every slot, nrow for the padding rows of the last slice
+    std::vector<size_t> m_row;
+    // Padding repeats column zero with a zero value
+    std::vector<IndexT> m_indices;
+    std::vector<fT> m_data;
+
+};
+
+/*
+ * Block compressed rows, BCSR
+ * The matrix is tiled into square blocks of 2, 4 or 8 and every block
+ * holding an element is stored dense, column by column, under a single
+ * column index. Dense blocks drop most of the index traffic and the
+ * inner loop runs over a fixed block height. Only for the numeric value
+ * types.
+*/
+template<typename fT, typename IndexT>
+class BlockMatrix {
+
+public:
+
+    explicit BlockMatrix(SparseMatrix<fT, IndexT> const & mat, size_t block=4);
+
+    void multiply(const fT * other, fT * ret) const;
+    void multiply(const fT * other, fT * ret, size_t k) const;
+
+    size_t nrow() const { return m_nrow; }
+    size_t ncol() const { return m_ncol; }
+    size_t block() const { return m_block; }
+    size_t blocks() const { return m_indices.size(); }
+
+private:
+
+    size_t m_nrow;
+    size_t m_ncol;
+    size_t m_block;
+
+    // CSR over the block rows, the indices are block columns
+    std::vector<size_t> m_index;
+    std::vector<IndexT> m_indices;
+    std::vector<fT> m_data;
+
+};
+
+/*
+ * Structure of a matrix as seen by the format selection
+ * mean_row   : mean number of elements per row
+ * row_cv     : standard deviation of the row lengths over their mean
+ * max_row    : longest row
+ * sell_fill  : elements over the stored slots of SELL-C-sigma
+ * block      : block size of the densest BCSR tiling
+ * block_fill : elements over the stored slots of that tiling, sampled
+ * format     : format of the smallest estimated traffic, csr unless
+ *              another one saves enough to pay for the conversion
+*/
+struct MatrixStructure
+{
+    double mean_row = 0;
+    double row_cv = 0;
+    size_t max_row = 0;
+    double sell_fill = 1;
+    size_t block = 0;
+    double block_fill = 0;
+    Format format = Format::csr;
+};
+
+template<typename fT, typename IndexT>
+MatrixStructure analyze_structure(SparseMatrix<fT, IndexT> const & mat);
+
+/*
+ * Alternative layout a SparseMatrix multiplies through
+ * Built on first use and dropped whenever the matrix changes
+*/
+template<typename fT, typename IndexT>
+struct FormatPlan
+{
+    Format format = Format::csr;
+    std::unique_ptr<SellMatrix<fT, IndexT>> sell;
+    std::unique_ptr<BlockMatrix<fT, IndexT>> block;
+};
+
+template<typename fT, typename IndexT>
+std::shared_ptr<const FormatPlan<fT, IndexT>> make_format_plan(SparseMatrix<fT, IndexT> const & mat, Format format);
+
+#endif
@@ -0,0 +1,41 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#ifndef SPARSEGENERATOR_H
+#define SPARSEGENERATOR_H
+
+#include <cstdint>
+
+#include "sparse.hpp"
+
+/*
+ * Synthetic matrices for benchmarks
+ * Every random draw comes from a counter based generator keyed by the seed
+ * and the position of the draw, so the same arguments give the same matrix
+ * on any machine and with any number of threads. Floating point weights
+ * are uniform in (0, 1], integer weights in [1, 100], patterns hold true.
+ * Edges drawn more than once are stored once with the largest weight.
+*/
+
+/*
+ * Quadrant probabilities of the recursive matrix model
+ * d = 1 - a - b - c, the defaults are those of the Graph500 generator
+ * scramble : relabel the nodes with a fixed bijection, which spreads the
+ *            hubs over the matrix instead of packing them in the first rows
+*/
+struct RMatOptions
+{
+    double a = 0.57;
+    double b = 0.19;
+    double c = 0.19;
+    bool scramble = true;
+};
+
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> rmat_matrix(size_t scale, size_t edge_factor, uint64_t seed=1,
+                                     RMatOptions const & options=RMatOptions());
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> erdos_renyi_matrix(size_t dim, double degree, uint64_t seed=1);
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> banded_matrix(size_t dim, size_t bandwidth, uint64_t seed=1);
+
+#endif
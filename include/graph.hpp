@@ -3,37 +3,217 @@
 #ifndef SPARSEGRAPH_H
 #define SPARSEGRAPH_H
 
+#include <mutex>
+#include <memory>
+#include <future>
+#include <cstdint>
+#include <unordered_map>
+
 #include "sparse.hpp"
+#include "builder.hpp"
+#include "loader.hpp"
+#include "reorder.hpp"
+
+/*
+ * Breadth-first search tree
+ * parent : parent of every node in the tree, the source is its own parent
+ * depth  : number of edges from the source
+ * Both hold -1 for nodes which cannot be reached
+*/
+struct BFSResult
+{
+    std::vector<int64_t> parent;
+    std::vector<int64_t> depth;
+};
+
+/*
+ * Single source shortest paths
+ * dist : length of the shortest path from the source, infinity for nodes
+ *        which cannot be reached
+ * pred : node before every node on its shortest path, -1 for the source
+ *        and for nodes which cannot be reached
+ * The remaining members are scratch space kept between repeated queries
+*/
+template<typename fT>
+struct SSSPResult
+{
+    std::vector<fT> dist;
+    std::vector<int64_t> pred;
+
+    std::vector<size_t> frontier;
+    std::vector<std::vector<std::vector<size_t>>> bins;
+    std::vector<std::vector<size_t>> overflow;
+};
 
+/*
+ * PageRank scores
+ * rank       : nrow x count block in row-major order, column l holds the
+ *              scores of the l-th personalization vector
+ * count      : number of score vectors
+ * iterations : number of sweeps until every vector converged
+ * error      : largest L1 change of a vector in the last sweep
+*/
 template<typename fT>
+struct PageRankResult
+{
+    std::vector<fT> rank;
+    size_t count = 0;
+    size_t iterations = 0;
+    fT error = 0;
+};
+
+/*
+ * Connected components
+ * label : component of every node, components are numbered from zero in
+ *         the order of their smallest node
+ * size  : number of nodes of every component
+*/
+struct ComponentResult
+{
+    std::vector<size_t> label;
+    std::vector<size_t> size;
+};
+
+/*
+ * Triangles of the graph with edge directions ignored
+ * total : number of triangles
+ * count : number of triangles every node belongs to, empty unless asked for
+*/
+struct TriangleResult
+{
+    uint64_t total = 0;
+    std::vector<uint64_t> count;
+};
+
+/*
+ * Compaction thresholds of the dynamic mode
+ * min_pending : number of buffered edge updates below which the overlay
+ *               is never compacted
+ * ratio       : compact once the buffered updates exceed this fraction
+ *               of the stored edges
+ * background  : merge on a worker thread while updates keep arriving
+ * read_lag    : number of buffered edge updates the graph kernels may
+ *               leave out, so kernels interleaved with updates do not
+ *               compact on every call. Zero keeps every kernel exact.
+*/
+struct CompactionOptions
+{
+    size_t min_pending = 65536;
+    double ratio = 0.05;
+    bool background = true;
+    size_t read_lag = 0;
+};
+
+template<typename fT, typename IndexT=uint64_t>
 class SparseGraph {
 
 public:
 
     SparseGraph(size_t dim=1, bool identity=false);
-    SparseGraph(SparseGraph<fT> const & other);
-    SparseGraph(SparseGraph<fT> && other);
+    SparseGraph(SparseGraph<fT, IndexT> const & other);
+    SparseGraph(SparseGraph<fT, IndexT> && other);
     SparseGraph(std::vector<std::vector<fT>> const & other, size_t dim);
+    SparseGraph(size_t dim, std::vector<size_t> const & src, std::vector<size_t> const & dst,
+                std::vector<fT> const & weight, DuplicatePolicy policy=DuplicatePolicy::sum);
+    SparseGraph(size_t dim, std::vector<size_t> const & src, std::vector<size_t> const & dst);
+    explicit SparseGraph(SparseMatrix<fT, IndexT> && adj);
     ~SparseGraph() = default;
 
     void load(std::string filename);
-    void save(std::string filename);
+    void save(std::string filename) const;
+    void load_binary(std::string filename, bool map=false);
+    void save_binary(std::string filename) const;
+    std::vector<size_t> load_mtx(std::string filename, GraphLoadOptions const & options=GraphLoadOptions());
+    std::vector<size_t> load_edge_list(std::string filename, GraphLoadOptions const & options=GraphLoadOptions());
     void reset(bool identity=false);
 
     fT   operator() (size_t nrow, size_t ncol) const;
     void operator() (size_t nrow, size_t ncol, fT value);
     
-    bool operator== (SparseGraph<fT> const &);
+    bool operator== (SparseGraph<fT, IndexT> const &);
+
+    SparseGraph &  operator= (SparseGraph<fT, IndexT> const & other);
+    SparseGraph &  operator= (SparseGraph<fT, IndexT> && other);
+
+    void set_hash_threshold(size_t threshold);
+    size_t hash_threshold() const { return m_adj_mat.hash_threshold(); }
 
     void add_node();
     void remove_node();
+    void add_nodes(size_t count);
+    std::vector<int64_t> remove_nodes(std::vector<size_t> const & ids);
+    void permute(std::vector<size_t> const & perm);
+    std::vector<size_t> reorder(Ordering ordering);
+
+    void set_dynamic(bool dynamic, CompactionOptions const & options=CompactionOptions());
+    bool dynamic() const { return m_dynamic; }
+    size_t pending_updates() const;
+    void compact();
+
+    const SparseMatrix<fT, IndexT> & adjacency() const;
+    const SparseMatrix<fT, IndexT> & in_adjacency() const;
+    std::shared_ptr<const SparseMatrix<fT, IndexT>> adjacency_snapshot() const;
+    std::shared_ptr<const SparseMatrix<fT, IndexT>> in_adjacency_snapshot() const;
+    size_t in_degree(size_t node) const;
+    std::vector<size_t> in_neighbors(size_t node) const;
 
-    const SparseMatrix<fT> & to_sparse_matrix();
+    BFSResult bfs(size_t source) const;
+    SSSPResult<fT> sssp(size_t source, fT delta=0,
+                        std::vector<size_t> const & targets=std::vector<size_t>()) const;
+    void sssp(size_t source, SSSPResult<fT> & ret, fT delta=0,
+              std::vector<size_t> const & targets=std::vector<size_t>()) const;
+    PageRankResult<fT> pagerank(fT damping=0.85, fT tolerance=1e-6, size_t max_iter=100) const;
+    PageRankResult<fT> personalized_pagerank(std::vector<std::vector<fT>> const & personalization,
+                                             fT damping=0.85, fT tolerance=1e-6,
+                                             size_t max_iter=100) const;
+    ComponentResult weakly_connected_components() const;
+    ComponentResult strongly_connected_components() const;
+    TriangleResult triangles(bool per_node=true) const;
+    std::vector<size_t> core_numbers() const;
+
+    const SparseMatrix<fT, IndexT> & to_sparse_matrix();
     size_t dim() const { return m_adj_mat.nrow(); }
 
 private:
 
-    SparseMatrix<fT> m_adj_mat;
+    // Buffered updates of one row sorted by column, zero removes the edge
+    typedef std::vector<std::pair<size_t, fT>> DeltaRow;
+    typedef std::unordered_map<size_t, DeltaRow> DeltaMap;
+
+    static SparseMatrix<fT, IndexT> merge_overlay(SparseMatrix<fT, IndexT> const & adj, DeltaMap const & delta);
+    void update_overlay(size_t nrow, size_t ncol, fT value);
+    void flush_overlay() const;
+    void flush_for_read() const;
+    void install_compaction() const;
+    void discard_overlay();
+    void invalidate_in_adjacency() const;
+    void replace_adjacency(SparseMatrix<fT, IndexT> && adj) const;
+    void release_pinned() const;
+    void build_in_adjacency() const;
+    std::shared_ptr<const SparseMatrix<fT, IndexT>> kernel_snapshot(bool transposed=false) const;
+    void snapshots(std::shared_ptr<const SparseMatrix<fT, IndexT>> & adj,
+                   std::shared_ptr<const SparseMatrix<fT, IndexT>> & in_adj) const;
+
+    // The overlay is folded in lazily, so const readers may compact it
+    mutable SparseMatrix<fT, IndexT> m_adj_mat;
+
+    // Transposed adjacency for in-edge queries, built on first use
+    mutable SparseMatrix<fT, IndexT> m_in_adj;
+    mutable bool m_in_valid = false;
+    mutable std::mutex m_mutex;
+
+    // Snapshots of the last kernel, reused while the matrices are unchanged
+    mutable std::shared_ptr<const SparseMatrix<fT, IndexT>> m_pinned;
+    mutable std::shared_ptr<const SparseMatrix<fT, IndexT>> m_in_pinned;
+
+    // Dynamic mode, updates land in m_delta while m_frozen is merged
+    // into the adjacency matrix by m_compaction
+    bool m_dynamic = false;
+    CompactionOptions m_options;
+    mutable DeltaMap m_delta;
+    mutable DeltaMap m_frozen;
+    mutable size_t m_pending = 0;
+    mutable std::future<SparseMatrix<fT, IndexT>> m_compaction;
 
 };
 
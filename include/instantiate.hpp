@@ -0,0 +1,32 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#ifndef SPARSEINSTANTIATE_H
+#define SPARSEINSTANTIATE_H
+
+#include <cstdint>
+
+/*
+ * Value and index types the templates are explicitly instantiated for
+ * Every source file defines a macro taking (fT, IndexT) which spells out
+ * its instantiations and passes it to one of these lists.
+*/
+#define SPARSE_INDEX_TYPES(MACRO, fT) \
+    MACRO(fT, uint64_t) \
+    MACRO(fT, uint32_t)
+
+// Weighted value types, used by the algorithms which need arithmetic
+#define SPARSE_NUMERIC_TYPES(MACRO) \
+    SPARSE_INDEX_TYPES(MACRO, double) \
+    SPARSE_INDEX_TYPES(MACRO, float) \
+    SPARSE_INDEX_TYPES(MACRO, int32_t)
+
+// Floating point value types, used by the algorithms which compute scores
+#define SPARSE_FLOAT_TYPES(MACRO) \
+    SPARSE_INDEX_TYPES(MACRO, double) \
+    SPARSE_INDEX_TYPES(MACRO, float)
+
+#define SPARSE_ALL_TYPES(MACRO) \
+    SPARSE_NUMERIC_TYPES(MACRO) \
+    SPARSE_INDEX_TYPES(MACRO, bool)
+
+#endif
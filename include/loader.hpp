@@ -0,0 +1,33 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#ifndef SPARSELOADER_H
+#define SPARSELOADER_H
+
+#include "sparse.hpp"
+#include "builder.hpp"
+
+/*
+ * Options of the graph file parsers
+ * symmetrize      : add the reverse of every edge
+ * drop_self_loops : skip edges whose source and destination are the same
+ * remap_ids       : renumber the vertex ids which occur in the file to
+ *                   0..n-1 in ascending order of the original id
+ * policy          : combine repeated edges, including the reverse edges
+ *                   added by symmetrize
+*/
+struct GraphLoadOptions
+{
+    bool symmetrize = false;
+    bool drop_self_loops = false;
+    bool remap_ids = false;
+    DuplicatePolicy policy = DuplicatePolicy::max;
+};
+
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> read_matrix_market(std::string filename, GraphLoadOptions const & options,
+                                    std::vector<size_t> & ids);
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> read_edge_list(std::string filename, GraphLoadOptions const & options,
+                                std::vector<size_t> & ids);
+
+#endif
@@ -0,0 +1,133 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#ifndef SPARSENEIGHBORS_H
+#define SPARSENEIGHBORS_H
+
+#include <cstddef>
+#include <utility>
+
+#include "simd.hpp"
+
+// Longer list size over shorter one from which on the shorter list gallops
+#define galloping_ratio_ 32
+// Elements of every list compared against each other in one merge step
+#define intersect_block_ 4
+
+/*
+ * Visit the undirected neighbors of node v in ascending order
+ * Out-edges index/indices and in-edges in_index/in_indices are merged,
+ * a neighbor linked both ways is visited once and self loops are skipped.
+*/
+template<typename IndexT, typename Func>
+inline void for_each_neighbor(const size_t * index, const IndexT * indices,
+                              const size_t * in_index, const IndexT * in_indices, size_t v, Func f)
+{
+    size_t i = index[v], j = in_index[v];
+    const size_t out_end = index[v+1], in_end = in_index[v+1];
+    while (i < out_end || j < in_end)
+    {
+        size_t w;
+        if (j == in_end || (i < out_end && indices[i] < in_indices[j]))
+            w = indices[i++];
+        else if (i == out_end || in_indices[j] < indices[i])
+            w = in_indices[j++];
+        else
+        {
+            w = indices[i++];
+            ++j;
+        }
+        if (w != v) f(w);
+    }
+}
+
+/*
+ * First position of the sorted list b at or after pos whose element is not
+ * less than value, found by doubling the step and then bisecting
+*/
+template<typename T>
+inline size_t gallop(const T * b, size_t pos, size_t nb, T value)
+{
+    size_t step = 1, hi = pos;
+    while (hi < nb && b[hi] < value)
+    {
+        pos = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    if (hi > nb) hi = nb;
+    while (pos < hi)
+    {
+        const size_t mid = pos + (hi - pos) / 2;
+        if (b[mid] < value) pos = mid + 1;
+        else hi = mid;
+    }
+    return pos;
+}
+
+/*
+ * Intersection of two strictly increasing lists
+ * Lists of similar length are merged a block at a time: every element of
+ * a block of a is compared with a whole block of b, and the block with
+ * the smaller last element moves on, both without a data dependent branch
+ * when only counting. The compare becomes one vector instruction only
+ * for the instruction set of the caller, so it is inlined into kernels
+ * run through simd_run, which are compiled once per level, see simd.hpp.
+ * When one list is much longer the elements of the shorter one gallop
+ * through it instead.
+ * @param emit called with every common element in ascending order
+ * @return number of common elements
+*/
+template<typename T, typename Emit>
+SPARSE_KERNEL size_t intersect_sorted(const T * a, size_t na, const T * b, size_t nb, Emit emit)
+{
+    if (na > nb)
+    {
+        std::swap(a, b);
+        std::swap(na, nb);
+    }
+    size_t ret = 0;
+    if (na == 0) return ret;
+
+    if (nb / na >= galloping_ratio_)
+    {
+        size_t j = 0;
+        for(size_t i=0; i<na && j<nb; ++i)
+        {
+            j = gallop(b, j, nb, a[i]);
+            if (j < nb && b[j] == a[i])
+            {
+                emit(a[i]);
+                ++ret;
+            }
+        }
+        return ret;
+    }
+
+    size_t i = 0, j = 0;
+    while (i + intersect_block_ <= na && j + intersect_block_ <= nb)
+    {
+        for(size_t p=0; p<intersect_block_; ++p)
+        {
+            const T value = a[i+p];
+            unsigned match = 0;
+            #pragma omp simd reduction(|:match)
+            for(size_t q=0; q<intersect_block_; ++q) match |= (b[j+q] == value);
+            ret += match;
+            if (match) emit(value);
+        }
+        const T last_a = a[i+intersect_block_-1], last_b = b[j+intersect_block_-1];
+        i += (last_a <= last_b) * intersect_block_;
+        j += (last_b <= last_a) * intersect_block_;
+    }
+    while (i < na && j < nb)
+    {
+        const T x = a[i], y = b[j];
+        ret += (x == y);
+        if (x == y) emit(x);
+        i += (x <= y);
+        j += (y <= x);
+    }
+    return ret;
+}
+
+#endif
@@ -0,0 +1,32 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#ifndef SPARSEREORDER_H
+#define SPARSEREORDER_H
+
+#include "sparse.hpp"
+
+/*
+ * Vertex orderings which place neighbors close in memory
+ * rcm       : reverse Cuthill-McKee, keeps the bandwidth small
+ * degree    : descending degree, packs the hubs together
+ * community : label propagation, numbers communities consecutively
+*/
+enum class Ordering { rcm, degree, community };
+
+/*
+ * The orderings look at the undirected pattern, in_adj is the transpose
+ * of adj and may be adj itself when it is symmetric. Edge weights are
+ * ignored. Every function returns the new index of every node.
+*/
+template<typename fT, typename IndexT>
+std::vector<size_t> reverse_cuthill_mckee(SparseMatrix<fT, IndexT> const & adj, SparseMatrix<fT, IndexT> const & in_adj);
+template<typename fT, typename IndexT>
+std::vector<size_t> degree_ordering(SparseMatrix<fT, IndexT> const & adj, SparseMatrix<fT, IndexT> const & in_adj);
+template<typename fT, typename IndexT>
+std::vector<size_t> community_ordering(SparseMatrix<fT, IndexT> const & adj, SparseMatrix<fT, IndexT> const & in_adj,
+                                       size_t iterations=10);
+template<typename fT, typename IndexT>
+std::vector<size_t> compute_ordering(SparseMatrix<fT, IndexT> const & adj, SparseMatrix<fT, IndexT> const & in_adj,
+                                     Ordering ordering);
+
+#endif
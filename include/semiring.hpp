@@ -0,0 +1,526 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#ifndef SPARSESEMIRING_H
+#define SPARSESEMIRING_H
+
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+#include "sparse.hpp"
+#include "graph.hpp"
+#include "stats.hpp"
+
+/*
+ * Semirings of the generalized matrix products
+ * A semiring is a type with value_type and three static functions:
+ *   zero()        identity of add, also the value of an empty sum
+ *   add(a, b)     reduction over the products of a row
+ *   multiply(a, b) product of a matrix element and a vector element
+ * The products are templates over the semiring, so every semiring gets its
+ * own kernel with the operators inlined. User-defined semirings only need
+ * to provide the same members. Their value_type is free for the vector
+ * products, the matrix product returns a SparseMatrix of it and so needs
+ * one of the instantiated value types, double, float, int32_t or bool.
+ * Stored matrix values are converted to value_type, pattern matrices read
+ * as one on every stored element.
+*/
+
+template<typename T>
+struct PlusTimes
+{
+    using value_type = T;
+    static T zero() { return static_cast<T>(0); }
+    static T add(T a, T b) { return a + b; }
+    static T multiply(T a, T b) { return a * b; }
+};
+
+// Shortest paths, an absent path is the largest value of the type
+template<typename T>
+struct MinPlus
+{
+    using value_type = T;
+    static T zero()
+    {
+        return std::numeric_limits<T>::has_infinity ? std::numeric_limits<T>::infinity()
+                                                    : std::numeric_limits<T>::max();
+    }
+    static T add(T a, T b) { return std::min(a, b); }
+    // Keeps an absent path absent instead of overflowing integer types
+    static T multiply(T a, T b) { return (a == zero() || b == zero()) ? zero() : a + b; }
+};
+
+// Widest paths, the capacity of a path is its narrowest edge
+template<typename T>
+struct MaxMin
+{
+    using value_type = T;
+    static T zero() { return std::numeric_limits<T>::lowest(); }
+    static T add(T a, T b) { return std::max(a, b); }
+    static T multiply(T a, T b) { return std::min(a, b); }
+};
+
+// Most reliable paths, the reliability of a path is the product of its edges
+template<typename T>
+struct MaxTimes
+{
+    using value_type = T;
+    static T zero() { return static_cast<T>(0); }
+    static T add(T a, T b) { return std::max(a, b); }
+    static T multiply(T a, T b) { return a * b; }
+};
+
+// Reachability
+template<typename T=bool>
+struct OrAnd
+{
+    using value_type = T;
+    static T zero() { return static_cast<T>(false); }
+    static T add(T a, T b) { return static_cast<T>(a || b); }
+    static T multiply(T a, T b) { return static_cast<T>(a && b); }
+};
+
+/*
+ * Whether absent entries of a product stand for zero() of the semiring
+ * That holds where zero() is the zero of the value type. Semirings whose
+ * zero() is another value, such as min_plus and max_min, specialize this
+ * to false and get their matrix products as a SemiringMatrix.
+*/
+template<typename S>
+struct zero_is_absent : std::true_type {};
+template<typename T>
+struct zero_is_absent<MinPlus<T>> : std::false_type {};
+template<typename T>
+struct zero_is_absent<MaxMin<T>> : std::false_type {};
+
+// Value types SparseMatrix is instantiated for, see instantiate.hpp
+template<typename T>
+struct is_sparse_value : std::integral_constant<bool,
+    std::is_same<T, double>::value || std::is_same<T, float>::value ||
+    std::is_same<T, int32_t>::value || std::is_same<T, bool>::value> {};
+
+// Built-in semirings selectable at runtime, e.g. from Python
+enum class Semiring {plus_times, min_plus, max_min, max_times, or_and};
+
+/*
+ * Call f with an instance of the selected built-in semiring over T
+*/
+template<typename T, typename Func>
+auto with_semiring(Semiring semiring, Func f)
+{
+    switch (semiring)
+    {
+        case Semiring::min_plus:
+            return f(MinPlus<T>());
+        case Semiring::max_min:
+            return f(MaxMin<T>());
+        case Semiring::max_times:
+            return f(MaxTimes<T>());
+        case Semiring::or_and:
+            return f(OrAnd<T>());
+        case Semiring::plus_times:
+        default:
+            return f(PlusTimes<T>());
+    }
+}
+
+/*
+ * Matrix product over a semiring whose zero() is not the zero of the value
+ * type, see zero_is_absent
+ * Absent entries read as zero() of the semiring, while a stored 0 is a
+ * real result such as a path of length zero. The stored entries are not
+ * canonical for a plain SparseMatrix, so they are only handed out as
+ * read-only CSR arrays.
+*/
+template<typename T, typename IndexT=uint64_t>
+class SemiringMatrix {
+
+public:
+
+    using value_type = T;
+    using index_type = IndexT;
+
+    SemiringMatrix(SparseMatrix<T, IndexT> && stored, T zero)
+        : m_stored(std::move(stored)), m_zero(zero) {}
+
+    T operator() (size_t nrow, size_t ncol) const
+    {
+        const size_t j = m_stored.findIndex(nrow, ncol);
+        return j < m_stored.index()[nrow+1] ? m_stored.data()[j] : m_zero;
+    }
+    bool operator== (SemiringMatrix<T, IndexT> const & other) const
+    {
+        return nrow() == other.nrow() && ncol() == other.ncol() && m_zero == other.m_zero &&
+               index() == other.index() && indices() == other.indices() && data() == other.data();
+    }
+    bool operator!= (SemiringMatrix<T, IndexT> const & other) const { return !(*this == other); }
+
+    T zero() const { return m_zero; }
+    size_t nrow() const { return m_stored.nrow(); }
+    size_t ncol() const { return m_stored.ncol(); }
+    size_t nnz() const { return m_stored.nnz(); }
+    const Buffer<size_t> & index() const { return m_stored.index(); }
+    const Buffer<IndexT> & indices() const { return m_stored.indices(); }
+    const ValueBuffer<T> & data() const { return m_stored.data(); }
+    void share(std::shared_ptr<void const> & index, std::shared_ptr<void const> & indices,
+               std::shared_ptr<void const> & data) const
+    {
+        m_stored.share(index, indices, data);
+    }
+
+private:
+
+    SparseMatrix<T, IndexT> m_stored;
+    T m_zero;
+
+};
+
+// Matrix product type of a semiring, see zero_is_absent
+template<typename S, typename IndexT>
+using SemiringProduct = typename std::conditional<zero_is_absent<S>::value,
+                                                  SparseMatrix<typename S::value_type, IndexT>,
+                                                  SemiringMatrix<typename S::value_type, IndexT>>::type;
+
+/*
+ * Check the size of an output mask, an empty mask selects everything
+*/
+inline void validate_mask(std::vector<bool> const & mask, size_t size)
+{
+    if (!mask.empty() && mask.size() != size)
+    {
+        throw std::out_of_range(
+            "the size of mask "
+            "differs from that of output");
+    }
+}
+
+/*
+ * Semiring product of the rows of a matrix with a dense vector
+ * ret[i] = add over the stored a_ij of multiply(a_ij, x_j), or of
+ * multiply(x_j, a_ij) when left is set. Rows outside of the mask keep
+ * their value in ret.
+ * @param mask rows to compute, empty for all rows
+ * @param complement compute the rows whose mask entry is unset instead
+*/
+template<typename S, bool left, typename fT, typename IndexT>
+void semiring_rows(SparseMatrix<fT, IndexT> const & mat, typename S::value_type const * x,
+                   typename S::value_type * ret, std::vector<bool> const & mask, bool complement)
+{
+    using T = typename S::value_type;
+    const size_t * index = mat.index().data();
+    const IndexT * indices = mat.indices().data();
+    ValueBuffer<fT> const & data = mat.data();
+    const bool masked = !mask.empty();
+
+    #pragma omp parallel for schedule(dynamic, 256)
+    for(size_t i=0; i<mat.nrow(); ++i)
+    {
+        if (masked && mask[i] == complement) continue;
+        T sum = S::zero();
+        for(size_t j=index[i]; j<index[i+1]; ++j)
+        {
+            const T value = static_cast<T>(data[j]);
+            sum = S::add(sum, left ? S::multiply(x[indices[j]], value)
+                                   : S::multiply(value, x[indices[j]]));
+        }
+        ret[i] = sum;
+    }
+}
+
+/*
+ * Run a product on plain arrays, std::vector<bool> is bit packed and
+ * cannot be written by several threads, so it goes through a copy
+*/
+template<typename S, bool left, typename fT, typename IndexT>
+void semiring_product(SparseMatrix<fT, IndexT> const & mat, std::vector<typename S::value_type> const & x,
+                      std::vector<typename S::value_type> & ret, std::vector<bool> const & mask, bool complement)
+{
+    SPARSE_STAT_SCOPE(mxv, mat.nnz());
+    using T = typename S::value_type;
+    if (x.size() != mat.ncol())
+    {
+        throw std::out_of_range(
+            "the dimension of matrix "
+            "differs from that of vector size");
+    }
+    validate_mask(mask, mat.nrow());
+    ret.resize(mat.nrow(), S::zero());
+    if constexpr (std::is_same<T, bool>::value)
+    {
+        Buffer<T> input(x.size()), output(ret.size());
+        std::copy(x.begin(), x.end(), input.begin());
+        std::copy(ret.begin(), ret.end(), output.begin());
+        semiring_rows<S, left>(mat, input.data(), output.data(), mask, complement);
+        std::copy(output.begin(), output.end(), ret.begin());
+    }
+    else
+        semiring_rows<S, left>(mat, x.data(), ret.data(), mask, complement);
+}
+
+/*
+ * Matrix vector product over a semiring, ret = mat (+.*) x
+ * @param ret output, resized to the rows of mat with zero() if needed;
+ *            entries outside of the mask keep their value
+ * @param mask output entries to compute, empty for all
+ * @param complement compute the entries whose mask entry is unset instead
+*/
+template<typename S, typename fT, typename IndexT>
+void mxv(std::vector<typename S::value_type> & ret, SparseMatrix<fT, IndexT> const & mat,
+         std::vector<typename S::value_type> const & x,
+         std::vector<bool> const & mask=std::vector<bool>(), bool complement=false)
+{
+    semiring_product<S, false>(mat, x, ret, mask, complement);
+}
+template<typename S, typename fT, typename IndexT>
+std::vector<typename S::value_type> mxv(SparseMatrix<fT, IndexT> const & mat,
+                                        std::vector<typename S::value_type> const & x)
+{
+    std::vector<typename S::value_type> ret;
+    mxv<S>(ret, mat, x);
+    return ret;
+}
+
+/*
+ * Vector matrix product over a semiring, ret = x (+.*) mat
+ * The columns are gathered from the transpose, so a plain matrix is
+ * transposed on every call. Graphs use their cached in-edges instead,
+ * which turns a push over the out-edges into a pull over the in-edges.
+ * @param ret output, resized to the columns of mat with zero() if needed;
+ *            entries outside of the mask keep their value
+ * @param mask output entries to compute, empty for all
+ * @param complement compute the entries whose mask entry is unset instead
+*/
+template<typename S, typename fT, typename IndexT>
+void vxm(std::vector<typename S::value_type> & ret, std::vector<typename S::value_type> const & x,
+         SparseMatrix<fT, IndexT> const & mat,
+         std::vector<bool> const & mask=std::vector<bool>(), bool complement=false)
+{
+    semiring_product<S, true>(mat.transpose(), x, ret, mask, complement);
+}
+template<typename S, typename fT, typename IndexT>
+void vxm(std::vector<typename S::value_type> & ret, std::vector<typename S::value_type> const & x,
+         SparseGraph<fT, IndexT> const & gra,
+         std::vector<bool> const & mask=std::vector<bool>(), bool complement=false)
+{
+    semiring_product<S, true>(*gra.in_adjacency_snapshot(), x, ret, mask, complement);
+}
+template<typename S, typename fT, typename IndexT>
+std::vector<typename S::value_type> vxm(std::vector<typename S::value_type> const & x,
+                                        SparseMatrix<fT, IndexT> const & mat)
+{
+    std::vector<typename S::value_type> ret;
+    vxm<S>(ret, x, mat);
+    return ret;
+}
+template<typename S, typename fT, typename IndexT>
+std::vector<typename S::value_type> vxm(std::vector<typename S::value_type> const & x,
+                                        SparseGraph<fT, IndexT> const & gra)
+{
+    std::vector<typename S::value_type> ret;
+    vxm<S>(ret, x, gra);
+    return ret;
+}
+template<typename S, typename fT, typename IndexT>
+void mxv(std::vector<typename S::value_type> & ret, SparseGraph<fT, IndexT> const & gra,
+         std::vector<typename S::value_type> const & x,
+         std::vector<bool> const & mask=std::vector<bool>(), bool complement=false)
+{
+    semiring_product<S, false>(*gra.adjacency_snapshot(), x, ret, mask, complement);
+}
+template<typename S, typename fT, typename IndexT>
+std::vector<typename S::value_type> mxv(SparseGraph<fT, IndexT> const & gra,
+                                        std::vector<typename S::value_type> const & x)
+{
+    std::vector<typename S::value_type> ret;
+    mxv<S>(ret, gra, x);
+    return ret;
+}
+
+/*
+ * Matrix matrix product over a semiring, ret = mat1 (+.*) mat2
+ * Like the plain product, a symbolic pass counts the distinct columns of
+ * every row with a marker, and a numeric pass accumulates every row in a
+ * dense array and writes it to its preallocated slice. With a mask only
+ * the positions stored in the mask are computed, or only those which are
+ * not when complemented.
+ * Results equal to zero() of the semiring are dropped. Where that is the
+ * zero of the value type, as for plus_times, max_times and or_and, the
+ * result is a canonical SparseMatrix. Otherwise it is a SemiringMatrix,
+ * whose absent entries read as zero() and which keeps stored zeros.
+ * @param mask structural mask of the output, null for none
+*/
+template<typename S, typename fT, typename IndexT, typename mT=fT>
+SemiringProduct<S, IndexT> mxm(SparseMatrix<fT, IndexT> const & mat1,
+                               SparseMatrix<fT, IndexT> const & mat2,
+                               SparseMatrix<mT, IndexT> const * mask=nullptr,
+                               bool complement=false)
+{
+    SPARSE_STAT_SCOPE(mxm, mat1.nnz() + mat2.nnz());
+    using T = typename S::value_type;
+    static_assert(is_sparse_value<T>::value,
+                  "the matrix product needs a value type "
+                  "SparseMatrix is instantiated for");
+    if (mat1.ncol() != mat2.nrow())
+    {
+        throw std::out_of_range(
+            "the number of first matrix column "
+            "differs from that of second matrix row");
+    }
+    if (mask && (mask->nrow() != mat1.nrow() || mask->ncol() != mat2.ncol()))
+    {
+        throw std::out_of_range(
+            "the dimension of mask "
+            "differs from that of output");
+    }
+    const size_t nrow = mat1.nrow(), ncol = mat2.ncol();
+    const size_t unset = static_cast<size_t>(-1);
+    const T zero = S::zero();
+    constexpr bool absent = zero_is_absent<S>::value;
+    if (absent && !(zero == static_cast<T>(0)))
+    {
+        throw std::domain_error(
+            "the semiring zero is not the zero "
+            "of its value type, see zero_is_absent");
+    }
+    const size_t * index1 = mat1.index().data();
+    const IndexT * indices1 = mat1.indices().data();
+    const size_t * index2 = mat2.index().data();
+    const IndexT * indices2 = mat2.indices().data();
+    auto dropped = [zero](T value)
+    {
+        return absent ? !(fabs(value) > eps_) : value == zero;
+    };
+
+    // Mark the columns of row i the mask lets through
+    auto allow_row = [&](size_t i, std::vector<size_t> & allowed)
+    {
+        if (!mask) return;
+        for(size_t j=mask->index()[i]; j<mask->index()[i+1]; ++j)
+            allowed[mask->indices()[j]] = i;
+    };
+
+    // Symbolic pass
+    Buffer<size_t> index(nrow+1, 0);
+    size_t * count = index.data();
+    #pragma omp parallel
+    {
+        std::vector<size_t> marker(ncol, unset), allowed(mask ? ncol : 0, unset);
+
+        #pragma omp for schedule(dynamic, 64)
+        for(size_t i=0; i<nrow; ++i)
+        {
+            allow_row(i, allowed);
+            size_t length = 0;
+            for(size_t j=index1[i]; j<index1[i+1]; ++j)
+            {
+                const size_t k = indices1[j];
+                for(size_t l=index2[k]; l<index2[k+1]; ++l)
+                {
+                    const size_t col = indices2[l];
+                    if (mask && (allowed[col] == i) == complement) continue;
+                    if (marker[col] != i)
+                    {
+                        marker[col] = i;
+                        ++length;
+                    }
+                }
+            }
+            count[i+1] = length;
+        }
+    }
+    for(size_t i=0; i<nrow; ++i) count[i+1] += count[i];
+
+    // Numeric pass
+    // Every row keeps its results at the front of its slice
+    Buffer<IndexT> indices(count[nrow]);
+    ValueBuffer<T> data(count[nrow]);
+    IndexT * out_indices = indices.data();
+    T * out_data = data.data();
+    std::vector<size_t> length(nrow);
+    bool cancelled = false;
+    #pragma omp parallel reduction(||:cancelled)
+    {
+        std::vector<size_t> marker(ncol, unset), allowed(mask ? ncol : 0, unset);
+        std::vector<T> accumulator(ncol);
+
+        #pragma omp for schedule(dynamic, 64)
+        for(size_t i=0; i<nrow; ++i)
+        {
+            allow_row(i, allowed);
+            size_t pos = count[i];
+            for(size_t j=index1[i]; j<index1[i+1]; ++j)
+            {
+                const size_t k = indices1[j];
+                const T value = static_cast<T>(mat1.data()[j]);
+                for(size_t l=index2[k]; l<index2[k+1]; ++l)
+                {
+                    const size_t col = indices2[l];
+                    if (mask && (allowed[col] == i) == complement) continue;
+                    const T product = S::multiply(value, static_cast<T>(mat2.data()[l]));
+                    if (marker[col] != i)
+                    {
+                        marker[col] = i;
+                        accumulator[col] = product;
+                        out_indices[pos++] = static_cast<IndexT>(col);
+                    }
+                    else
+                        accumulator[col] = S::add(accumulator[col], product);
+                }
+            }
+
+            std::sort(out_indices + count[i], out_indices + pos);
+            size_t kept = count[i];
+            for(size_t j=count[i]; j<pos; ++j)
+            {
+                const size_t col = out_indices[j];
+                if (dropped(accumulator[col])) continue;
+                out_indices[kept] = static_cast<IndexT>(col);
+                if constexpr (!is_pattern<T>::value) out_data[kept] = accumulator[col];
+                ++kept;
+            }
+            length[i] = kept - count[i];
+            if (kept != pos) cancelled = true;
+        }
+    }
+
+    // Close the gaps of the dropped results
+    if (cancelled)
+    {
+        size_t pos = 0;
+        size_t start = 0;
+        for(size_t i=0; i<nrow; ++i)
+        {
+            const size_t next = count[i+1];
+            for(size_t j=start; j<start+length[i]; ++j)
+            {
+                out_indices[pos] = out_indices[j];
+                if constexpr (!is_pattern<T>::value) out_data[pos] = out_data[j];
+                ++pos;
+            }
+            start = next;
+            count[i+1] = pos;
+        }
+        indices.resize(pos);
+        data.resize(pos);
+    }
+
+    SparseMatrix<T, IndexT> ret(nrow, ncol, std::move(index), std::move(indices), std::move(data));
+    if constexpr (absent)
+        return ret;
+    else
+        return SemiringMatrix<T, IndexT>(std::move(ret), zero);
+}
+template<typename S, typename fT, typename IndexT, typename mT>
+SemiringProduct<S, IndexT> mxm(SparseMatrix<fT, IndexT> const & mat1,
+                               SparseMatrix<fT, IndexT> const & mat2,
+                               SparseMatrix<mT, IndexT> const & mask,
+                               bool complement=false)
+{
+    return mxm<S>(mat1, mat2, &mask, complement);
+}
+
+#endif
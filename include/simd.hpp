@@ -0,0 +1,103 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#ifndef SPARSESIMD_H
+#define SPARSESIMD_H
+
+#include <cstddef>
+#include <algorithm>
+
+/*
+ * Runtime selection of the vector instruction set
+ * Kernels written with '#pragma omp simd' are compiled once per level
+ * through the target attribute of GCC and Clang, and simd_level() picks
+ * the widest one the CPU supports. The build itself stays portable, no
+ * -march flag is needed. Outside of x86 only the scalar level exists,
+ * which still vectorizes for the baseline of the build.
+*/
+enum class SimdLevel { scalar, avx2, avx512 };
+
+// Widest level the CPU supports, detected once
+SimdLevel detected_simd_level();
+// Level the kernels run with, the detected one unless lowered
+SimdLevel simd_level();
+void set_simd_level(SimdLevel level);
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPARSE_SIMD_DISPATCH
+#define SPARSE_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define SPARSE_TARGET_AVX512 \
+    __attribute__((target("avx512f,avx512vl,avx512bw,avx512dq,avx2,fma,prefer-vector-width=512")))
+#endif
+
+// Kernel body shared by the per level copies, inlined into each of them
+#define SPARSE_KERNEL inline __attribute__((always_inline))
+
+/*
+ * Copies of a kernel call per level
+ * kernel is a function object whose call operator over [begin, end) is
+ * declared SPARSE_KERNEL, it is inlined into every copy and vectorized
+ * for the instruction set of that copy.
+*/
+template<typename Kernel>
+inline void simd_call_scalar(Kernel const & kernel, size_t begin, size_t end)
+{
+    kernel(begin, end);
+}
+
+#ifdef SPARSE_SIMD_DISPATCH
+template<typename Kernel>
+SPARSE_TARGET_AVX2 inline void simd_call_avx2(Kernel const & kernel, size_t begin, size_t end)
+{
+    kernel(begin, end);
+}
+
+template<typename Kernel>
+SPARSE_TARGET_AVX512 inline void simd_call_avx512(Kernel const & kernel, size_t begin, size_t end)
+{
+    kernel(begin, end);
+}
+#endif
+
+template<typename Kernel>
+using SimdCall = void (*)(Kernel const &, size_t, size_t);
+
+/*
+ * Copy of the kernel for the current level, for kernels which split the
+ * work among the threads themselves
+ * @param max_level widest level worth using, for kernels whose vectors
+ *                  are narrower than what the CPU offers
+*/
+template<typename Kernel>
+inline SimdCall<Kernel> simd_select(SimdLevel max_level=SimdLevel::avx512)
+{
+    SimdCall<Kernel> call = &simd_call_scalar<Kernel>;
+#ifdef SPARSE_SIMD_DISPATCH
+    switch (std::min(simd_level(), max_level))
+    {
+        case SimdLevel::avx512: call = &simd_call_avx512<Kernel>; break;
+        case SimdLevel::avx2: call = &simd_call_avx2<Kernel>; break;
+        default: break;
+    }
+#else
+    (void) max_level;
+#endif
+    return call;
+}
+
+/*
+ * Run kernel over [0, count) in batches handed out dynamically to the
+ * threads, with the copy of the current level
+ * @param max_level see simd_select
+*/
+template<typename Kernel>
+inline void simd_run(Kernel const & kernel, size_t count, size_t batch,
+                     SimdLevel max_level=SimdLevel::avx512)
+{
+    const SimdCall<Kernel> call = simd_select<Kernel>(max_level);
+    const size_t nbatch = (count + batch - 1) / batch;
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(size_t i=0; i<nbatch; ++i)
+        call(kernel, i * batch, std::min(count, (i + 1) * batch));
+}
+
+#endif
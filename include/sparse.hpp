@@ -4,73 +4,197 @@
 #define SPARSEMATRIX_H
 
 #define eps_ 1.0e-16
+#define linear_search_ 16
 
 #include <iostream>
 #include <vector>
 #include <string>
+#include <memory>
+#include <cstdint>
+#include <unordered_map>
 
-template<typename fT>
-class SparseMatrix {
+#include "buffer.hpp"
+
+// Base of the lazy matrix expressions, see expression.hpp
+template<typename E>
+struct MatrixExpr
+{
+    E const & derived() const { return static_cast<E const &>(*this); }
+};
+
+/*
+ * Layout the matrix vector products run on, see format.hpp
+ * csr       : the matrix itself
+ * sell      : sliced ELLPACK, for rows of varying length
+ * bcsr      : dense square blocks, for clustered elements
+ * automatic : whichever analyze_structure estimates to be fastest
+*/
+enum class Format { csr, sell, bcsr, automatic };
+
+template<typename fT, typename IndexT>
+struct FormatPlan;
+
+/*
+ * Sparse matrix in CSR layout
+ * fT     : value type, bool keeps only the pattern and stores no values
+ * IndexT : type of the column indices, uint32_t halves the index memory
+ *          when both dimensions stay below 2^32. Row offsets are always
+ *          size_t so that the number of elements is not limited.
+*/
+template<typename fT, typename IndexT=uint64_t>
+class SparseMatrix : public MatrixExpr<SparseMatrix<fT, IndexT>> {
 
 public:
 
+    using value_type = fT;
+    using index_type = IndexT;
+
     SparseMatrix(size_t nrow=1, size_t ncol=1, bool identity=false);
-    SparseMatrix(SparseMatrix<fT> const & other);
-    SparseMatrix(SparseMatrix<fT> && other);
+    SparseMatrix(SparseMatrix<fT, IndexT> const & other);
+    SparseMatrix(SparseMatrix<fT, IndexT> && other);
     SparseMatrix(std::vector<std::vector<fT>> const & other, size_t nrow, size_t ncol);
+    SparseMatrix(size_t nrow, size_t ncol, Buffer<size_t> && index,
+                 Buffer<IndexT> && indices, ValueBuffer<fT> && data);
+    template<typename E>
+    SparseMatrix(MatrixExpr<E> const & expr);
     ~SparseMatrix() = default;
     
     void load(std::string filename);
-    void save(std::string filename);
+    void save(std::string filename) const;
+    void load_binary(std::string filename, bool map=false);
+    void save_binary(std::string filename) const;
     void reset(bool identity=false);
 
     fT   operator() (size_t nrow, size_t ncol) const;
     void operator() (size_t nrow, size_t ncol, fT value);
 
-    template<typename tfT>
-    friend void validate_multiplication(const SparseMatrix<tfT> &mat1, const SparseMatrix<tfT> &mat2);
-    template<typename tfT>
-    friend void same_size(const SparseMatrix<tfT> &mat1, const SparseMatrix<tfT> &mat2);
-
-    bool operator== (SparseMatrix<fT> const &);
-    bool operator!= (SparseMatrix<fT> const &);
-
-    SparseMatrix &  operator= (const SparseMatrix<fT>& other);
-    SparseMatrix &  operator+=(const SparseMatrix<fT>& other);
-    SparseMatrix    operator+ (const SparseMatrix<fT>& other) const;
-    SparseMatrix &  operator-=(const SparseMatrix<fT>& other);
-    SparseMatrix    operator- (const SparseMatrix<fT>& other) const;
+    template<typename tfT, typename tIndexT>
+    friend void validate_multiplication(const SparseMatrix<tfT, tIndexT> &mat1, const SparseMatrix<tfT, tIndexT> &mat2);
+    template<typename tfT, typename tIndexT>
+    friend void same_size(const SparseMatrix<tfT, tIndexT> &mat1, const SparseMatrix<tfT, tIndexT> &mat2);
+    template<typename tfT, typename tIndexT>
+    friend SparseMatrix<tfT, tIndexT> axpby(tfT alpha, const SparseMatrix<tfT, tIndexT> &mat1, tfT beta, const SparseMatrix<tfT, tIndexT> &mat2);
+
+    bool operator== (SparseMatrix<fT, IndexT> const &);
+    bool operator!= (SparseMatrix<fT, IndexT> const &);
+
+    SparseMatrix &  operator= (const SparseMatrix<fT, IndexT>& other);
+    SparseMatrix &  operator= (SparseMatrix<fT, IndexT>&& other);
+    template<typename E>
+    SparseMatrix &  operator= (MatrixExpr<E> const & expr);
+    SparseMatrix &  operator+=(const SparseMatrix<fT, IndexT>& other);
+    SparseMatrix &  operator-=(const SparseMatrix<fT, IndexT>& other);
     SparseMatrix &  operator*=(fT alpha);
-    SparseMatrix    operator* (fT alpha) const;
-    SparseMatrix    operator* (const SparseMatrix<fT>& other) const;
-    std::vector<fT> operator* (const std::vector<fT> other) const;
+    std::vector<fT> operator* (const std::vector<fT> & other) const;
     SparseMatrix &  operator/=(fT alpha);
-    SparseMatrix    operator/ (fT alpha) const;
+
+    SparseMatrix    transpose() const;
+    SparseMatrix    permute(std::vector<size_t> const & perm) const;
+
+    SparseMatrix multiply(const SparseMatrix<fT, IndexT> & other) const;
+    void multiply(const std::vector<fT> & other, std::vector<fT> & ret) const;
+    void multiply(const fT * other, fT * ret) const;
+    void multiply(const fT * other, fT * ret, size_t k) const;
 
     size_t findIndex(size_t nrow, size_t ncol) const;
+    size_t lowerIndex(size_t nrow, size_t ncol) const;
+    void set_hash_threshold(size_t threshold);
+    size_t hash_threshold() const { return m_hash_threshold; }
+    void set_format(Format format);
+    Format format() const { return m_format; }
+    Format active_format() const;
     size_t nrow() const { return m_nrow; }
     size_t ncol() const { return m_ncol; }
-
-    void expand_row();
-    void expand_col();
-    void shrink_row();
-    void shrink_col();
+    size_t nnz() const { return m_indices.size(); }
+
+    const Buffer<size_t> & index() const { return m_index; }
+    const Buffer<IndexT> & indices() const { return m_indices; }
+    const ValueBuffer<fT> & data() const { return m_data; }
+    static constexpr bool pattern() { return is_pattern<fT>::value; }
+
+    // Owner handles of the CSR arrays for exporting them, see Buffer::share
+    void share(std::shared_ptr<void const> & index, std::shared_ptr<void const> & indices,
+               std::shared_ptr<void const> & data) const
+    {
+        index = m_index.share();
+        indices = m_indices.share();
+        data = m_data.share();
+    }
+    bool canonical() const;
+    void canonicalize();
+
+    void expand_row(size_t count=1);
+    void expand_col(size_t count=1);
+    void shrink_row(size_t count=1);
+    void shrink_col(size_t count=1);
 
 
 private:
+
+    // Column hash table of a row, see build_row_hash
+    struct RowHash
+    {
+        std::vector<size_t> slot;
+        unsigned shift;
+    };
+
+    static size_t hash_column(size_t ncol, unsigned shift)
+    {
+        return static_cast<size_t>((static_cast<uint64_t>(ncol) * 0x9E3779B97F4A7C15ull) >> shift);
+    }
+    RowHash build_row_hash(size_t nrow) const;
+    void hash_row(size_t nrow);
+    void rebuild_hash();
+    void replace_content(SparseMatrix<fT, IndexT> && other);
+
+    std::shared_ptr<const FormatPlan<fT, IndexT>> format_plan() const;
+    void drop_format() { m_plan.reset(); }
+
+    static void validate_dimension(size_t nrow, size_t ncol);
+    void sort_rows();
+    void thread_rows(size_t & begin, size_t & end) const;
     
     size_t m_nrow;
     size_t m_ncol;
 
-    std::vector<size_t> m_index;
-    std::vector<size_t> m_indices;
-    std::vector<fT> m_data;
+    Buffer<size_t> m_index;
+    Buffer<IndexT> m_indices;
+    ValueBuffer<fT> m_data;
+
+    size_t m_hash_threshold = 0;
+    std::unordered_map<size_t, RowHash> m_row_hash;
+
+    // Layout of the products, the plan is built on first use and shared
+    // by the copies until one of them changes
+    Format m_format = Format::csr;
+    mutable std::shared_ptr<const FormatPlan<fT, IndexT>> m_plan;
 
 };
 
-template<typename fT>
-void validate_multiplication(const SparseMatrix<fT> &mat1, const SparseMatrix<fT> &mat2);
-template<typename fT>
-void same_size(const SparseMatrix<fT> &mat1, const SparseMatrix<fT> &mat2);
+template<typename fT, typename IndexT>
+void validate_multiplication(const SparseMatrix<fT, IndexT> &mat1, const SparseMatrix<fT, IndexT> &mat2);
+template<typename fT, typename IndexT>
+void same_size(const SparseMatrix<fT, IndexT> &mat1, const SparseMatrix<fT, IndexT> &mat2);
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> axpby(fT alpha, const SparseMatrix<fT, IndexT> &mat1, fT beta, const SparseMatrix<fT, IndexT> &mat2);
+
+/*
+ * Scaled matrix in a fused sum, see combine
+ * vector is the dense operand of the term in combine_multiply
+*/
+template<typename fT, typename IndexT>
+struct MatrixTerm
+{
+    fT scale;
+    SparseMatrix<fT, IndexT> const * matrix;
+    fT const * vector = nullptr;
+};
+
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> combine(std::vector<MatrixTerm<fT, IndexT>> const & terms);
+template<typename fT, typename IndexT>
+void combine_multiply(std::vector<MatrixTerm<fT, IndexT>> const & terms, fT * ret);
+
+#include "expression.hpp"
 
 #endif
@@ -0,0 +1,119 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#ifndef SPARSESTATS_H
+#define SPARSESTATS_H
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <utility>
+
+/*
+ * Operation counters
+ * With SPARSE_STATS defined, cmake -DENABLE_STATS=ON, the library counts
+ * the calls, wall time and touched elements of its operations and the
+ * allocations of its buffers. Every thread writes its own counters, which
+ * stats() adds up on demand. Without SPARSE_STATS the macros below expand
+ * to nothing, so the default build carries no cost, and stats() reports
+ * zeros.
+*/
+
+// Instrumented operations
+#define SPARSE_STAT_OPS(X) \
+    X(find_index) X(get) X(set) X(insert) X(erase) X(copy) \
+    X(load) X(save) X(load_binary) X(save_binary) X(load_edges) X(build) \
+    X(combine) X(combine_multiply) X(scale) X(multiply) X(multiply_vector) \
+    X(multiply_block) X(transpose) X(permute) X(sort_rows) X(canonicalize) \
+    X(resize) X(convert) X(analyze) X(mxv) X(mxm) X(bfs) X(sssp) X(pagerank) \
+    X(wcc) X(scc) X(triangles) X(kcore) X(reorder) X(in_adjacency) \
+    X(update_overlay) X(compaction)
+
+enum class StatOp
+{
+#define SPARSE_STAT_ENUM(name) name,
+    SPARSE_STAT_OPS(SPARSE_STAT_ENUM)
+#undef SPARSE_STAT_ENUM
+    count
+};
+
+/*
+ * Buffer allocations
+ * allocate   : memory for a buffer which held no elements
+ * reallocate : growth of a buffer, its elements are moved over
+ * own        : copy of borrowed elements before their first modification
+*/
+enum class StatBuffer { allocate, reallocate, own, count };
+
+/*
+ * Totals of one operation
+ * nnz counts the stored elements the calls touched, for find_index the
+ * length of the searched rows and for insert and erase the elements
+ * shifted. Operations which are only counted report no time.
+*/
+struct OpStats
+{
+    uint64_t calls = 0;
+    uint64_t nanoseconds = 0;
+    uint64_t nnz = 0;
+};
+
+struct BufferStats
+{
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+};
+
+struct Stats
+{
+    bool enabled = false;
+    std::vector<std::pair<std::string, OpStats>> ops;
+    std::vector<std::pair<std::string, BufferStats>> buffers;
+};
+
+Stats stats();
+void reset_stats();
+
+void stat_record(StatOp op, uint64_t nanoseconds, uint64_t nnz);
+void stat_buffer(StatBuffer kind, uint64_t bytes);
+
+/*
+ * Times the enclosing scope as one call of an operation
+*/
+class StatScope {
+
+public:
+
+    StatScope(StatOp op, uint64_t nnz)
+        : m_op(op), m_nnz(nnz), m_start(std::chrono::steady_clock::now()) {}
+    ~StatScope()
+    {
+        const auto elapsed = std::chrono::steady_clock::now() - m_start;
+        stat_record(m_op, static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()), m_nnz);
+    }
+    StatScope(StatScope const &) = delete;
+    StatScope & operator= (StatScope const &) = delete;
+
+private:
+
+    StatOp m_op;
+    uint64_t m_nnz;
+    std::chrono::steady_clock::time_point m_start;
+
+};
+
+#ifdef SPARSE_STATS
+// Time the rest of the scope, once per function
+#define SPARSE_STAT_SCOPE(op, nnz) StatScope stat_scope_(StatOp::op, static_cast<uint64_t>(nnz))
+// Count a call without timing it, for the cheap and frequent operations
+#define SPARSE_STAT_COUNT(op, nnz) stat_record(StatOp::op, 0, static_cast<uint64_t>(nnz))
+#define SPARSE_STAT_BUFFER(kind, bytes) stat_buffer(kind, static_cast<uint64_t>(bytes))
+#else
+#define SPARSE_STAT_SCOPE(op, nnz) ((void)0)
+#define SPARSE_STAT_COUNT(op, nnz) ((void)0)
+#define SPARSE_STAT_BUFFER(kind, bytes) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,43 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#ifndef SPARSETHREADPOOL_H
+#define SPARSETHREADPOOL_H
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+/*
+ * Fixed set of worker threads running queued jobs in order
+ * Used to run several independent jobs at the same time, each job may
+ * still use OpenMP inside. The destructor finishes the queued jobs and
+ * joins the workers.
+*/
+class ThreadPool {
+
+public:
+
+    explicit ThreadPool(size_t nthread=std::thread::hardware_concurrency());
+    ThreadPool(ThreadPool const &) = delete;
+    ThreadPool & operator= (ThreadPool const &) = delete;
+    ~ThreadPool();
+
+    void submit(std::function<void()> job);
+    size_t size() const { return m_workers.size(); }
+
+private:
+
+    void run();
+
+    std::vector<std::thread> m_workers;
+    std::deque<std::function<void()>> m_jobs;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    bool m_stop = false;
+
+};
+
+#endif
@@ -0,0 +1,184 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#include <cmath>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+
+#include "builder.hpp"
+#include "stats.hpp"
+#include "instantiate.hpp"
+
+/**
+ * Default Constructor
+ * Empty triplet list for a matrix of the specified dimension
+**/
+template<typename fT, typename IndexT>
+SparseMatrixBuilder<fT, IndexT>::SparseMatrixBuilder(size_t nrow, size_t ncol, DuplicatePolicy policy)
+    : m_nrow(nrow), m_ncol(ncol), m_policy(policy)
+{
+
+}
+
+/*
+ * Reserve space for the expected number of triplets
+*/
+template<typename fT, typename IndexT>
+void SparseMatrixBuilder<fT, IndexT>::reserve(size_t nnz)
+{
+    m_rows.reserve(nnz);
+    m_cols.reserve(nnz);
+    m_values.reserve(nnz);
+}
+
+/*
+ * Remove all collected triplets
+*/
+template<typename fT, typename IndexT>
+void SparseMatrixBuilder<fT, IndexT>::clear()
+{
+    m_rows.clear();
+    m_cols.clear();
+    m_values.clear();
+}
+
+/*
+ * Append a single triplet
+ * @param nrow matrix row
+ * @param ncol matrix column
+ * @param value value at the specified matrix row and column
+*/
+template<typename fT, typename IndexT>
+void SparseMatrixBuilder<fT, IndexT>::add(size_t nrow, size_t ncol, fT value)
+{
+    if (nrow >= m_nrow || ncol >= m_ncol)
+    {
+        throw std::out_of_range(
+            "the triplet position is "
+            "outside of the matrix dimension");
+    }
+    m_rows.push_back(nrow);
+    m_cols.push_back(ncol);
+    m_values.push_back(value);
+}
+
+/*
+ * Append a batch of triplets given as three parallel arrays
+*/
+template<typename fT, typename IndexT>
+void SparseMatrixBuilder<fT, IndexT>::add(std::vector<size_t> const & rows, std::vector<size_t> const & cols,
+                                  std::vector<fT> const & values)
+{
+    if (rows.size() != cols.size() || rows.size() != values.size())
+    {
+        throw std::out_of_range(
+            "the triplet arrays "
+            "differ in size");
+    }
+
+    bool valid = true;
+    #pragma omp parallel for reduction(&&:valid)
+    for(size_t i=0; i<rows.size(); ++i)
+        valid = valid && rows[i] < m_nrow && cols[i] < m_ncol;
+    if (!valid)
+    {
+        throw std::out_of_range(
+            "the triplet position is "
+            "outside of the matrix dimension");
+    }
+
+    m_rows.insert(m_rows.end(), rows.begin(), rows.end());
+    m_cols.insert(m_cols.end(), cols.begin(), cols.end());
+    m_values.insert(m_values.end(), values.begin(), values.end());
+}
+
+/*
+ * Emit the collected triplets as a compressed sparse row matrix
+ * Triplets are bucketed by row, every row is then sorted by column and
+ * insertion order, and duplicates are merged with the builder policy.
+ * Entries which end up as zero are not stored.
+*/
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> SparseMatrixBuilder<fT, IndexT>::build() const
+{
+    SPARSE_STAT_SCOPE(build, m_rows.size());
+    const size_t nnz = m_rows.size();
+
+    // Count triplets of every row
+    std::vector<size_t> offset(m_nrow+1, 0);
+    #pragma omp parallel for
+    for(size_t i=0; i<nnz; ++i)
+    {
+        #pragma omp atomic
+        ++offset[m_rows[i]+1];
+    }
+    for(size_t i=0; i<m_nrow; ++i) offset[i+1] += offset[i];
+
+    // Scatter (column, insertion order) pairs into their row bucket
+    std::vector<std::pair<size_t, size_t>> bucket(nnz);
+    {
+        std::vector<size_t> cursor(offset.begin(), offset.end()-1);
+        #pragma omp parallel for
+        for(size_t i=0; i<nnz; ++i)
+        {
+            size_t pos;
+            #pragma omp atomic capture
+            pos = cursor[m_rows[i]]++;
+            bucket[pos] = std::make_pair(m_cols[i], i);
+        }
+    }
+
+    // Sort and merge every row in place, keeping the merged row length
+    Buffer<size_t> index(m_nrow+1, 0);
+    std::vector<fT> merged(nnz);
+    #pragma omp parallel for schedule(dynamic, 256)
+    for(size_t i=0; i<m_nrow; ++i)
+    {
+        std::sort(bucket.begin() + offset[i], bucket.begin() + offset[i+1]);
+
+        size_t pos = offset[i];
+        for(size_t j=offset[i]; j<offset[i+1];)
+        {
+            const size_t col = bucket[j].first;
+            fT value = m_values[bucket[j].second];
+            for(++j; j<offset[i+1] && bucket[j].first == col; ++j)
+            {
+                const fT next = m_values[bucket[j].second];
+                switch (m_policy)
+                {
+                    case DuplicatePolicy::sum:  value += next; break;
+                    case DuplicatePolicy::max:  value = std::max(value, next); break;
+                    case DuplicatePolicy::last: value = next; break;
+                }
+            }
+            if (fabs(value) > eps_)
+            {
+                bucket[pos].first = col;
+                merged[pos] = value;
+                ++pos;
+            }
+        }
+        index[i+1] = pos - offset[i];
+    }
+    for(size_t i=0; i<m_nrow; ++i) index[i+1] += index[i];
+
+    // Compact the merged rows into the final arrays
+    Buffer<IndexT> indices(index[m_nrow]);
+    ValueBuffer<fT> data(index[m_nrow]);
+    #pragma omp parallel for schedule(dynamic, 256)
+    for(size_t i=0; i<m_nrow; ++i)
+    {
+        for(size_t j=index[i], k=offset[i]; j<index[i+1]; ++j, ++k)
+        {
+            indices[j] = bucket[k].first;
+            if constexpr (!is_pattern<fT>::value) data[j] = merged[k];
+        }
+    }
+
+    return SparseMatrix<fT, IndexT>(m_nrow, m_ncol, std::move(index), std::move(indices), std::move(data));
+}
+
+#define INSTANTIATE(fT, IndexT) \
+    template class SparseMatrixBuilder<fT, IndexT>;
+SPARSE_ALL_TYPES(INSTANTIATE)
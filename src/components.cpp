@@ -0,0 +1,341 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#include <limits>
+#include <random>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <unordered_map>
+
+#include "graph.hpp"
+#include "atomic.hpp"
+#include "stats.hpp"
+#include "instantiate.hpp"
+
+#define afforest_rounds_ 2
+#define afforest_samples_ 1024
+
+// Node without a strongly connected component yet
+#define unassigned_ std::numeric_limits<size_t>::max()
+
+/*
+ * Hook the trees of u and v together
+ * The larger root is hung below the smaller one with a compare and swap,
+ * so the root of every tree is its smallest node. A failed swap means
+ * another thread moved the root, the walk restarts from the new parents.
+*/
+static void hook(size_t u, size_t v, size_t * comp)
+{
+    size_t p1 = atomic_load(comp[u]);
+    size_t p2 = atomic_load(comp[v]);
+    while (p1 != p2)
+    {
+        const size_t high = std::max(p1, p2);
+        const size_t low = std::min(p1, p2);
+        const size_t p_high = atomic_load(comp[high]);
+        if (p_high == low) break;
+        if (p_high == high && compare_and_swap(comp[high], high, low)) break;
+        p1 = atomic_load(comp[atomic_load(comp[high])]);
+        p2 = atomic_load(comp[low]);
+    }
+}
+
+/*
+ * Point every node directly at the root of its tree
+*/
+static void compress(size_t n, size_t * comp)
+{
+    #pragma omp parallel for schedule(dynamic, 16384)
+    for(size_t v=0; v<n; ++v)
+    {
+        size_t parent = atomic_load(comp[v]);
+        for (size_t grand = atomic_load(comp[parent]); parent != grand; grand = atomic_load(comp[parent]))
+        {
+            atomic_store(comp[v], grand);
+            parent = grand;
+        }
+    }
+}
+
+/*
+ * Number the components from zero in the order of their smallest node
+ * @param rep representative node of the component of every node
+*/
+static ComponentResult number_components(std::vector<size_t> const & rep)
+{
+    const size_t n = rep.size();
+    ComponentResult ret;
+    ret.label.resize(n);
+    std::vector<size_t> id(n, unassigned_);
+    for(size_t v=0; v<n; ++v)
+    {
+        size_t & c = id[rep[v]];
+        if (c == unassigned_)
+        {
+            c = ret.size.size();
+            ret.size.push_back(0);
+        }
+        ret.label[v] = c;
+        ++ret.size[c];
+    }
+    return ret;
+}
+
+/*
+ * Level-synchronous traversal along the edges of a CSR matrix
+ * visit(v, w) is called for every edge of a frontier node v and returns
+ * true when w joins the next frontier
+*/
+template<typename IndexT, typename Visit>
+static void traverse(const size_t * index, const IndexT * indices, std::vector<size_t> frontier, Visit visit)
+{
+    std::vector<size_t> next;
+    while (!frontier.empty())
+    {
+        next.clear();
+        #pragma omp parallel
+        {
+            std::vector<size_t> local;
+            #pragma omp for schedule(dynamic, 64) nowait
+            for(size_t i=0; i<frontier.size(); ++i)
+            {
+                const size_t v = frontier[i];
+                for(size_t j=index[v]; j<index[v+1]; ++j)
+                    if (visit(v, static_cast<size_t>(indices[j]))) local.push_back(indices[j]);
+            }
+            #pragma omp critical
+            next.insert(next.end(), local.begin(), local.end());
+        }
+        frontier.swap(next);
+    }
+}
+
+/*
+ * Weakly connected components, edge directions are ignored
+ * Afforest: every node first links along a few of its out-edges, which
+ * already joins most of the giant component. Its root is then estimated
+ * by sampling, and only the nodes outside of it link their remaining
+ * edges, so most edges of the graph are never read. Trees are joined by
+ * lock-free hooking and flattened by parallel compression.
+*/
+template<typename fT, typename IndexT>
+ComponentResult SparseGraph<fT, IndexT>::weakly_connected_components() const
+{
+    std::shared_ptr<const SparseMatrix<fT, IndexT>> pinned, in_pinned;
+    snapshots(pinned, in_pinned);
+    const SparseMatrix<fT, IndexT> & adj = *pinned;
+    SPARSE_STAT_SCOPE(wcc, adj.nnz());
+    const SparseMatrix<fT, IndexT> & in_adj = *in_pinned;
+    const size_t n = adj.nrow();
+    const size_t * index = adj.index().data();
+    const IndexT * indices = adj.indices().data();
+    const size_t * in_index = in_adj.index().data();
+    const IndexT * in_indices = in_adj.indices().data();
+
+    std::vector<size_t> rep(n);
+    size_t * comp = rep.data();
+    #pragma omp parallel for schedule(static)
+    for(size_t v=0; v<n; ++v) comp[v] = v;
+
+    for(size_t r=0; r<afforest_rounds_; ++r)
+    {
+        #pragma omp parallel for schedule(dynamic, 16384)
+        for(size_t v=0; v<n; ++v)
+            if (index[v] + r < index[v+1]) hook(v, indices[index[v] + r], comp);
+        compress(n, comp);
+    }
+
+    // Most frequent root among the sampled nodes
+    size_t giant = unassigned_;
+    if (n)
+    {
+        std::mt19937_64 random(n);
+        std::unordered_map<size_t, size_t> count;
+        for(size_t s=0; s<afforest_samples_; ++s) ++count[comp[random() % n]];
+        giant = std::max_element(count.begin(), count.end(),
+                                 [](std::pair<const size_t, size_t> const & a, std::pair<const size_t, size_t> const & b)
+                                 { return a.second < b.second; })->first;
+    }
+
+    // An edge is skipped only when both of its ends are already in the
+    // giant component, the remaining out-edges and all in-edges cover it
+    #pragma omp parallel for schedule(dynamic, 16384)
+    for(size_t v=0; v<n; ++v)
+    {
+        if (atomic_load(comp[v]) == giant) continue;
+        for(size_t j=index[v] + std::min<size_t>(afforest_rounds_, index[v+1] - index[v]); j<index[v+1]; ++j)
+            hook(v, indices[j], comp);
+        for(size_t j=in_index[v]; j<in_index[v+1]; ++j)
+            hook(v, in_indices[j], comp);
+    }
+    compress(n, comp);
+
+    return number_components(rep);
+}
+
+/*
+ * Give every active node which cannot lie on a cycle of active nodes its
+ * own component, and drop it from active
+ * Nodes without an active in- or out-neighbor are peeled off, which may
+ * leave their neighbors without one, until every remaining node has both.
+ * Self loops do not count. Every unassigned node is active.
+ * @param degree scratch space of two counters per node
+*/
+template<typename IndexT>
+static void trim(const size_t * index, const IndexT * indices, const size_t * in_index, const IndexT * in_indices,
+                 std::vector<size_t> & active, size_t * scc, std::vector<size_t> & degree)
+{
+    size_t * out_degree = degree.data();
+    size_t * in_degree = degree.data() + degree.size() / 2;
+
+    std::vector<size_t> frontier, next;
+    #pragma omp parallel
+    {
+        std::vector<size_t> local;
+        #pragma omp for schedule(dynamic, 1024) nowait
+        for(size_t i=0; i<active.size(); ++i)
+        {
+            const size_t v = active[i];
+            size_t out = 0, in = 0;
+            for(size_t j=index[v]; j<index[v+1]; ++j)
+                out += indices[j] != v && scc[indices[j]] == unassigned_;
+            for(size_t j=in_index[v]; j<in_index[v+1]; ++j)
+                in += in_indices[j] != v && scc[in_indices[j]] == unassigned_;
+            out_degree[v] = out;
+            in_degree[v] = in;
+            if (!out || !in) local.push_back(v);
+        }
+        #pragma omp critical
+        frontier.insert(frontier.end(), local.begin(), local.end());
+    }
+    for (size_t v : frontier) scc[v] = v;
+
+    // A peeled node removes itself from the counters of its neighbors
+    auto peel = [&](size_t w, size_t * count, std::vector<size_t> & local)
+    {
+        if (atomic_load(scc[w]) != unassigned_) return;
+        if (fetch_add(count[w], static_cast<size_t>(-1)) == 1 && compare_and_swap(scc[w], unassigned_, w))
+            local.push_back(w);
+    };
+    while (!frontier.empty())
+    {
+        next.clear();
+        #pragma omp parallel
+        {
+            std::vector<size_t> local;
+            #pragma omp for schedule(dynamic, 64) nowait
+            for(size_t i=0; i<frontier.size(); ++i)
+            {
+                const size_t v = frontier[i];
+                for(size_t j=index[v]; j<index[v+1]; ++j)
+                    if (indices[j] != v) peel(indices[j], in_degree, local);
+                for(size_t j=in_index[v]; j<in_index[v+1]; ++j)
+                    if (in_indices[j] != v) peel(in_indices[j], out_degree, local);
+            }
+            #pragma omp critical
+            next.insert(next.end(), local.begin(), local.end());
+        }
+        frontier.swap(next);
+    }
+
+    active.erase(std::remove_if(active.begin(), active.end(),
+                                [&](size_t v) { return scc[v] != unassigned_; }), active.end());
+}
+
+/*
+ * Strongly connected components
+ * Multistep method: trimming first assigns the nodes outside of any
+ * cycle. A forward-backward search from the node of largest degree then
+ * takes out the giant component: the nodes reached backward from it
+ * within the nodes it reaches forward. The rest is split by coloring,
+ * where the largest node id is pushed along the out-edges until it
+ * settles, and every node still carrying its own id collects its
+ * component backward among the nodes of its color. Trimming and
+ * coloring repeat until every node is assigned.
+*/
+template<typename fT, typename IndexT>
+ComponentResult SparseGraph<fT, IndexT>::strongly_connected_components() const
+{
+    std::shared_ptr<const SparseMatrix<fT, IndexT>> pinned, in_pinned;
+    snapshots(pinned, in_pinned);
+    const SparseMatrix<fT, IndexT> & adj = *pinned;
+    SPARSE_STAT_SCOPE(scc, adj.nnz());
+    const SparseMatrix<fT, IndexT> & in_adj = *in_pinned;
+    const size_t n = adj.nrow();
+    const size_t * index = adj.index().data();
+    const IndexT * indices = adj.indices().data();
+    const size_t * in_index = in_adj.index().data();
+    const IndexT * in_indices = in_adj.indices().data();
+
+    // Representative node of the component of every node
+    std::vector<size_t> rep(n, unassigned_);
+    size_t * scc = rep.data();
+    std::vector<size_t> active(n), degree(2 * n);
+    for(size_t v=0; v<n; ++v) active[v] = v;
+
+    trim(index, indices, in_index, in_indices, active, scc, degree);
+
+    if (!active.empty())
+    {
+        size_t pivot = active[0], best = 0;
+        for (size_t v : active)
+        {
+            const size_t weight = (index[v+1] - index[v]) * (in_index[v+1] - in_index[v]);
+            if (weight > best)
+            {
+                best = weight;
+                pivot = v;
+            }
+        }
+
+        std::vector<uint8_t> forward(n, 0);
+        forward[pivot] = 1;
+        traverse(index, indices, {pivot}, [&](size_t, size_t w)
+        {
+            return scc[w] == unassigned_ && atomic_load(forward[w]) == 0 &&
+                   compare_and_swap(forward[w], static_cast<uint8_t>(0), static_cast<uint8_t>(1));
+        });
+        scc[pivot] = pivot;
+        traverse(in_index, in_indices, {pivot}, [&](size_t, size_t u)
+        {
+            return forward[u] && compare_and_swap(scc[u], unassigned_, pivot);
+        });
+        active.erase(std::remove_if(active.begin(), active.end(),
+                                    [&](size_t v) { return scc[v] != unassigned_; }), active.end());
+    }
+
+    std::vector<size_t> color(n);
+    while (!active.empty())
+    {
+        trim(index, indices, in_index, in_indices, active, scc, degree);
+        if (active.empty()) break;
+
+        #pragma omp parallel for schedule(static)
+        for(size_t i=0; i<active.size(); ++i) color[active[i]] = active[i];
+        traverse(index, indices, active, [&](size_t v, size_t w)
+        {
+            return scc[w] == unassigned_ && write_max(color[w], atomic_load(color[v]));
+        });
+
+        std::vector<size_t> roots;
+        for (size_t v : active)
+        {
+            if (color[v] != v) continue;
+            scc[v] = v;
+            roots.push_back(v);
+        }
+        traverse(in_index, in_indices, roots, [&](size_t v, size_t u)
+        {
+            return color[u] == color[v] && compare_and_swap(scc[u], unassigned_, color[v]);
+        });
+        active.erase(std::remove_if(active.begin(), active.end(),
+                                    [&](size_t v) { return scc[v] != unassigned_; }), active.end());
+    }
+
+    return number_components(rep);
+}
+
+#define INSTANTIATE(fT, IndexT) \
+    template ComponentResult SparseGraph<fT, IndexT>::weakly_connected_components() const; \
+    template ComponentResult SparseGraph<fT, IndexT>::strongly_connected_components() const;
+SPARSE_ALL_TYPES(INSTANTIATE)
@@ -0,0 +1,263 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#include <cmath>
+#include <chrono>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+
+#include "graph.hpp"
+#include "stats.hpp"
+#include "instantiate.hpp"
+
+// Multiple of the compaction limit an update waits for a running merge at
+#define pending_backlog_ 2
+
+/*
+ * Switch the dynamic mode on or off
+ * In dynamic mode edge updates are buffered in a per-row overlay instead
+ * of shifting the CSR arrays, and merged back once enough have piled up.
+ * Turning it off merges all buffered updates.
+ * @param dynamic whether edge updates are buffered
+ * @param options compaction thresholds
+*/
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::set_dynamic(bool dynamic, CompactionOptions const & options)
+{
+    if (!dynamic) compact();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_dynamic = dynamic;
+    m_options = options;
+}
+
+/*
+ * Number of buffered edge updates, including those being merged
+*/
+template<typename fT, typename IndexT>
+size_t SparseGraph<fT, IndexT>::pending_updates() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t ret = m_pending;
+    for (auto const & row : m_frozen) ret += row.second.size();
+    return ret;
+}
+
+/*
+ * Merge all buffered edge updates into the adjacency matrix
+*/
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::compact()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    flush_overlay();
+}
+
+/*
+ * Merge the overlay into a copy of the adjacency matrix
+ * Rows without updates are copied as they are, the others are merged with
+ * their sorted updates, where a zero update removes the stored edge.
+ * @param adj adjacency matrix
+ * @param delta buffered updates
+ * @return merged adjacency matrix
+*/
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> SparseGraph<fT, IndexT>::merge_overlay(SparseMatrix<fT, IndexT> const & adj, DeltaMap const & delta)
+{
+    SPARSE_STAT_SCOPE(compaction, adj.nnz());
+    const size_t n = adj.nrow();
+    const size_t * index = adj.index().data();
+    const IndexT * indices = adj.indices().data();
+    // Patterns have no value array, their buffer reads as one
+    ValueBuffer<fT> const & data = adj.data();
+
+    std::vector<DeltaRow const *> pending(n, nullptr);
+    for (auto const & row : delta) pending[row.first] = &row.second;
+
+    // Hand every surviving element of row i in column order to emit
+    auto merge_row = [&](size_t i, auto emit)
+    {
+        size_t j = index[i];
+        const size_t end = index[i+1];
+        for (auto const & update : *pending[i])
+        {
+            for(; j<end && indices[j]<update.first; ++j) emit(indices[j], data[j]);
+            if (j < end && indices[j] == update.first) ++j;
+            if (update.second != 0) emit(update.first, update.second);
+        }
+        for(; j<end; ++j) emit(indices[j], data[j]);
+    };
+
+    Buffer<size_t> ret_index(n+1, 0);
+    size_t * count = ret_index.data();
+    #pragma omp parallel for schedule(dynamic, 256)
+    for(size_t i=0; i<n; ++i)
+    {
+        size_t length = index[i+1] - index[i];
+        if (pending[i])
+        {
+            length = 0;
+            merge_row(i, [&](size_t, fT) { ++length; });
+        }
+        count[i+1] = length;
+    }
+    for(size_t i=0; i<n; ++i) count[i+1] += count[i];
+
+    Buffer<IndexT> ret_indices(count[n]);
+    ValueBuffer<fT> ret_data(count[n]);
+    IndexT * out_indices = ret_indices.data();
+    fT * out_data = ret_data.data();
+    #pragma omp parallel for schedule(dynamic, 256)
+    for(size_t i=0; i<n; ++i)
+    {
+        size_t pos = count[i];
+        if (!pending[i])
+        {
+            std::copy(indices + index[i], indices + index[i+1], out_indices + pos);
+            if constexpr (!is_pattern<fT>::value)
+                std::copy(data.begin() + index[i], data.begin() + index[i+1], out_data + pos);
+            continue;
+        }
+        merge_row(i, [&](size_t col, fT value)
+        {
+            out_indices[pos] = static_cast<IndexT>(col);
+            if constexpr (!is_pattern<fT>::value) out_data[pos] = value;
+            ++pos;
+        });
+    }
+
+    return SparseMatrix<fT, IndexT>(n, adj.ncol(), std::move(ret_index), std::move(ret_indices), std::move(ret_data));
+}
+
+/*
+ * Buffer an edge update in dynamic mode
+ * Costs a search in the updates of the row rather than a shift of the
+ * CSR arrays. A finished background merge is picked up here, and a new one
+ * starts once the updates exceed the compaction thresholds.
+*/
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::update_overlay(size_t nrow, size_t ncol, fT value)
+{
+    SPARSE_STAT_COUNT(update_overlay, 0);
+    if (nrow >= dim() || ncol >= dim())
+    {
+        throw std::out_of_range(
+            "the edge is "
+            "outside of the graph");
+    }
+    if (!(fabs(value) > eps_)) value = 0;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    DeltaRow & row = m_delta[nrow];
+    auto it = std::lower_bound(row.begin(), row.end(), std::make_pair(ncol, static_cast<fT>(0)),
+                               [](std::pair<size_t, fT> const & a, std::pair<size_t, fT> const & b)
+                               { return a.first < b.first; });
+    if (it != row.end() && it->first == ncol)
+    {
+        it->second = value;
+    }
+    else
+    {
+        row.insert(it, std::make_pair(ncol, value));
+        ++m_pending;
+    }
+
+    if (m_compaction.valid() &&
+        m_compaction.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+    {
+        install_compaction();
+    }
+
+    const size_t limit = std::max(m_options.min_pending,
+                                  static_cast<size_t>(m_options.ratio * static_cast<double>(m_adj_mat.nnz())));
+    if (m_pending <= limit) return;
+    if (m_compaction.valid())
+    {
+        // Writers outpacing the merge wait for it rather than letting
+        // the overlay grow without bound
+        if (m_pending <= limit * pending_backlog_) return;
+        install_compaction();
+    }
+
+    if (!m_options.background)
+    {
+        flush_overlay();
+        return;
+    }
+    // New updates go to a fresh overlay while the worker merges this one
+    m_frozen.swap(m_delta);
+    m_pending = 0;
+    m_compaction = std::async(std::launch::async, [this]()
+    {
+        return merge_overlay(m_adj_mat, m_frozen);
+    });
+}
+
+/*
+ * Merge all buffered updates into the adjacency matrix
+ * The caller holds m_mutex
+*/
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::flush_overlay() const
+{
+    install_compaction();
+    if (m_delta.empty()) return;
+    replace_adjacency(merge_overlay(m_adj_mat, m_delta));
+    m_delta.clear();
+    m_pending = 0;
+    invalidate_in_adjacency();
+}
+
+/*
+ * Merge the buffered updates before a kernel reads the adjacency matrix
+ * Up to read_lag updates stay buffered, a running background merge is
+ * still waited for since it is already paid for.
+ * The caller holds m_mutex
+*/
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::flush_for_read() const
+{
+    install_compaction();
+    if (m_pending > m_options.read_lag) flush_overlay();
+}
+
+/*
+ * Wait for the background merge and take over its result
+ * The caller holds m_mutex
+*/
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::install_compaction() const
+{
+    if (!m_compaction.valid()) return;
+    replace_adjacency(m_compaction.get());
+    m_frozen.clear();
+    invalidate_in_adjacency();
+}
+
+/*
+ * Drop all buffered updates before the graph is replaced
+*/
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::discard_overlay()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_compaction.valid()) m_compaction.wait();
+    m_compaction = std::future<SparseMatrix<fT, IndexT>>();
+    m_frozen.clear();
+    m_delta.clear();
+    m_pending = 0;
+    invalidate_in_adjacency();
+}
+
+#define INSTANTIATE(fT, IndexT) \
+    template void SparseGraph<fT, IndexT>::set_dynamic(bool, CompactionOptions const &); \
+    template size_t SparseGraph<fT, IndexT>::pending_updates() const; \
+    template void SparseGraph<fT, IndexT>::compact(); \
+    template SparseMatrix<fT, IndexT> SparseGraph<fT, IndexT>::merge_overlay( \
+        SparseMatrix<fT, IndexT> const &, DeltaMap const &); \
+    template void SparseGraph<fT, IndexT>::update_overlay(size_t, size_t, fT); \
+    template void SparseGraph<fT, IndexT>::flush_overlay() const; \
+    template void SparseGraph<fT, IndexT>::flush_for_read() const; \
+    template void SparseGraph<fT, IndexT>::install_compaction() const; \
+    template void SparseGraph<fT, IndexT>::discard_overlay();
+SPARSE_ALL_TYPES(INSTANTIATE)
@@ -0,0 +1,508 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#include <cmath>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+#include "format.hpp"
+#include "simd.hpp"
+#include "stats.hpp"
+#include "instantiate.hpp"
+
+// Slices and block rows handed to a thread at once
+#define format_batch_ 64
+// Cost of starting a CSR row, in bytes of streamed matrix data
+#define row_overhead_ 16
+// Another format must be estimated below this share of the CSR cost
+#define format_margin_ 0.8
+
+/*
+ * Product of a SELL matrix with a vector over the slices [begin, end)
+ * All rows of a slice are summed lane by lane, padding adds zeros
+*/
+template<typename fT, typename IndexT>
+struct SellProduct
+{
+    const size_t * offset;
+    const size_t * width;
+    const size_t * row;
+    const IndexT * indices;
+    const fT * data;
+    size_t nrow;
+    const fT * other;
+    fT * ret;
+
+    SPARSE_KERNEL void operator() (size_t begin, size_t end) const
+    {
+        for(size_t s=begin; s<end; ++s)
+        {
+            fT sum[sell_chunk_] = {};
+            const IndexT * col = indices + offset[s];
+            const fT * value = data + offset[s];
+            for(size_t j=0; j<width[s]; ++j, col+=sell_chunk_, value+=sell_chunk_)
+            {
+                #pragma omp simd
+                for(size_t l=0; l<sell_chunk_; ++l)
+                    sum[l] += value[l] * other[col[l]];
+            }
+            for(size_t l=0; l<sell_chunk_; ++l)
+                if (row[s*sell_chunk_+l] < nrow) ret[row[s*sell_chunk_+l]] = sum[l];
+        }
+    }
+};
+
+/*
+ * Product of a SELL matrix with a row-major block of k vectors
+*/
+template<typename fT, typename IndexT>
+struct SellBlockProduct
+{
+    const size_t * offset;
+    const size_t * width;
+    const size_t * row;
+    const IndexT * indices;
+    const fT * data;
+    size_t nrow;
+    const fT * other;
+    fT * ret;
+    size_t k;
+
+    SPARSE_KERNEL void operator() (size_t begin, size_t end) const
+    {
+        for(size_t s=begin; s<end; ++s)
+        {
+            const size_t * rows = row + s*sell_chunk_;
+            for(size_t l=0; l<sell_chunk_; ++l)
+                if (rows[l] < nrow) std::fill(ret + rows[l]*k, ret + (rows[l]+1)*k, static_cast<fT>(0.));
+            const IndexT * col = indices + offset[s];
+            const fT * value = data + offset[s];
+            for(size_t j=0; j<width[s]; ++j, col+=sell_chunk_, value+=sell_chunk_)
+            {
+                for(size_t l=0; l<sell_chunk_; ++l)
+                {
+                    if (rows[l] >= nrow) break;
+                    const fT v = value[l];
+                    const fT * other_row = other + col[l]*k;
+                    fT * ret_row = ret + rows[l]*k;
+                    #pragma omp simd
+                    for(size_t t=0; t<k; ++t)
+                        ret_row[t] += v * other_row[t];
+                }
+            }
+        }
+    }
+};
+
+/**
+ * Constructor
+ * Convert from CSR, rows are sorted by descending length per window
+**/
+template<typename fT, typename IndexT>
+SellMatrix<fT, IndexT>::SellMatrix(SparseMatrix<fT, IndexT> const & mat, size_t sigma)
+    : m_nrow(mat.nrow()), m_ncol(mat.ncol()), m_sigma(sigma)
+{
+    SPARSE_STAT_SCOPE(convert, mat.nnz());
+    if (!sigma || sigma % sell_chunk_)
+    {
+        throw std::domain_error(
+            "the sorting window must be a "
+            "multiple of the slice height");
+    }
+    const size_t * index = mat.index().data();
+    const IndexT * indices = mat.indices().data();
+    const fT * data = mat.data().data();
+
+    const size_t nslice = (m_nrow + sell_chunk_ - 1) / sell_chunk_;
+    const size_t nwindow = (m_nrow + m_sigma - 1) / m_sigma;
+    m_row.assign(nslice * sell_chunk_, m_nrow);
+    m_width.assign(nslice, 0);
+    m_offset.assign(nslice + 1, 0);
+
+    #pragma omp parallel for schedule(dynamic, 16)
+    for(size_t w=0; w<nwindow; ++w)
+    {
+        const size_t begin = w * m_sigma, end = std::min(m_nrow, begin + m_sigma);
+        size_t * rows = m_row.data() + begin;
+        for(size_t i=begin; i<end; ++i) rows[i-begin] = i;
+        std::stable_sort(rows, rows + (end - begin), [&](size_t a, size_t b)
+        {
+            return index[a+1] - index[a] > index[b+1] - index[b];
+        });
+        // The first row of every slice is its longest
+        for(size_t i=begin; i<end; i+=sell_chunk_)
+            m_width[i / sell_chunk_] = index[rows[i-begin]+1] - index[rows[i-begin]];
+    }
+    for(size_t s=0; s<nslice; ++s) m_offset[s+1] = m_offset[s] + m_width[s] * sell_chunk_;
+
+    m_indices.assign(m_offset[nslice], 0);
+    m_data.assign(m_offset[nslice], static_cast<fT>(0.));
+    #pragma omp parallel for schedule(dynamic, 256)
+    for(size_t s=0; s<nslice; ++s)
+    {
+        for(size_t l=0; l<sell_chunk_; ++l)
+        {
+            const size_t i = m_row[s*sell_chunk_+l];
+            if (i >= m_nrow) break;
+            for(size_t j=index[i]; j<index[i+1]; ++j)
+            {
+                const size_t pos = m_offset[s] + (j - index[i]) * sell_chunk_ + l;
+                m_indices[pos] = indices[j];
+                m_data[pos] = data[j];
+            }
+        }
+    }
+}
+
+template<typename fT, typename IndexT>
+void SellMatrix<fT, IndexT>::multiply(const fT * other, fT * ret) const
+{
+    const SellProduct<fT, IndexT> kernel{m_offset.data(), m_width.data(), m_row.data(), m_indices.data(),
+                                         m_data.data(), m_nrow, other, ret};
+    simd_run(kernel, m_width.size(), format_batch_);
+}
+
+template<typename fT, typename IndexT>
+void SellMatrix<fT, IndexT>::multiply(const fT * other, fT * ret, size_t k) const
+{
+    const SellBlockProduct<fT, IndexT> kernel{m_offset.data(), m_width.data(), m_row.data(), m_indices.data(),
+                                              m_data.data(), m_nrow, other, ret, k};
+    simd_run(kernel, m_width.size(), format_batch_);
+}
+
+/*
+ * Product of a BCSR matrix of block size B with a vector over the block
+ * rows [begin, end), other is padded to whole blocks
+ * Blocks are stored column by column, every column of a block is one
+ * vector operation over the B rows
+*/
+template<typename fT, typename IndexT, size_t B>
+struct BlockProduct
+{
+    const size_t * index;
+    const IndexT * indices;
+    const fT * data;
+    size_t nrow;
+    const fT * other;
+    fT * ret;
+
+    SPARSE_KERNEL void operator() (size_t begin, size_t end) const
+    {
+        for(size_t r=begin; r<end; ++r)
+        {
+            fT sum[B] = {};
+            for(size_t j=index[r]; j<index[r+1]; ++j)
+            {
+                const fT * block = data + j*B*B;
+                const fT * x = other + static_cast<size_t>(indices[j])*B;
+                for(size_t c=0; c<B; ++c)
+                {
+                    const fT xc = x[c];
+                    #pragma omp simd
+                    for(size_t l=0; l<B; ++l)
+                        sum[l] += block[c*B+l] * xc;
+                }
+            }
+            for(size_t l=0; l<B && r*B+l<nrow; ++l) ret[r*B+l] = sum[l];
+        }
+    }
+};
+
+/*
+ * Product of a BCSR matrix with a row-major block of k vectors, other is
+ * padded to whole blocks
+*/
+template<typename fT, typename IndexT, size_t B>
+struct BlockBlockProduct
+{
+    const size_t * index;
+    const IndexT * indices;
+    const fT * data;
+    size_t nrow;
+    const fT * other;
+    fT * ret;
+    size_t k;
+
+    SPARSE_KERNEL void operator() (size_t begin, size_t end) const
+    {
+        for(size_t r=begin; r<end; ++r)
+        {
+            const size_t rows = std::min(B, nrow - r*B);
+            fT * ret_rows = ret + r*B*k;
+            std::fill(ret_rows, ret_rows + rows*k, static_cast<fT>(0.));
+            for(size_t j=index[r]; j<index[r+1]; ++j)
+            {
+                const fT * block = data + j*B*B;
+                const fT * x = other + static_cast<size_t>(indices[j])*B*k;
+                for(size_t c=0; c<B; ++c)
+                {
+                    for(size_t l=0; l<rows; ++l)
+                    {
+                        const fT v = block[c*B+l];
+                        fT * ret_row = ret_rows + l*k;
+                        const fT * other_row = x + c*k;
+                        #pragma omp simd
+                        for(size_t t=0; t<k; ++t)
+                            ret_row[t] += v * other_row[t];
+                    }
+                }
+            }
+        }
+    }
+};
+
+/*
+ * Distinct block columns of block row r in ascending order
+*/
+template<typename IndexT>
+static void block_columns(const size_t * index, const IndexT * indices, size_t nrow, size_t block,
+                          size_t r, std::vector<IndexT> & ret)
+{
+    ret.clear();
+    for(size_t i=r*block; i<std::min(nrow, (r+1)*block); ++i)
+        for(size_t j=index[i]; j<index[i+1]; ++j) ret.push_back(static_cast<IndexT>(indices[j] / block));
+    std::sort(ret.begin(), ret.end());
+    ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+}
+
+/**
+ * Constructor
+ * Convert from CSR with square blocks of 2, 4 or 8
+**/
+template<typename fT, typename IndexT>
+BlockMatrix<fT, IndexT>::BlockMatrix(SparseMatrix<fT, IndexT> const & mat, size_t block)
+    : m_nrow(mat.nrow()), m_ncol(mat.ncol()), m_block(block)
+{
+    SPARSE_STAT_SCOPE(convert, mat.nnz());
+    if (block != 2 && block != 4 && block != 8)
+        throw std::domain_error("the block size must be 2, 4 or 8");
+    const size_t * index = mat.index().data();
+    const IndexT * indices = mat.indices().data();
+    const fT * data = mat.data().data();
+
+    const size_t nblock_row = (m_nrow + m_block - 1) / m_block;
+    m_index.assign(nblock_row + 1, 0);
+    #pragma omp parallel
+    {
+        std::vector<IndexT> cols;
+        #pragma omp for schedule(dynamic, 256)
+        for(size_t r=0; r<nblock_row; ++r)
+        {
+            block_columns(index, indices, m_nrow, m_block, r, cols);
+            m_index[r+1] = cols.size();
+        }
+    }
+    for(size_t r=0; r<nblock_row; ++r) m_index[r+1] += m_index[r];
+
+    m_indices.resize(m_index[nblock_row]);
+    m_data.assign(m_index[nblock_row] * m_block * m_block, static_cast<fT>(0.));
+    #pragma omp parallel
+    {
+        std::vector<IndexT> cols;
+        #pragma omp for schedule(dynamic, 256)
+        for(size_t r=0; r<nblock_row; ++r)
+        {
+            block_columns(index, indices, m_nrow, m_block, r, cols);
+            std::copy(cols.begin(), cols.end(), m_indices.begin() + m_index[r]);
+            for(size_t i=r*m_block; i<std::min(m_nrow, (r+1)*m_block); ++i)
+            {
+                for(size_t j=index[i]; j<index[i+1]; ++j)
+                {
+                    const size_t c = indices[j];
+                    const size_t pos = m_index[r] + (std::lower_bound(cols.begin(), cols.end(),
+                                       static_cast<IndexT>(c / m_block)) - cols.begin());
+                    m_data[pos*m_block*m_block + (c % m_block)*m_block + (i - r*m_block)] = data[j];
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Input padded with zeros to whole blocks, the last block column may
+ * reach past ncol
+ * @param width values per input row
+*/
+template<typename fT>
+static const fT * pad_input(const fT * other, size_t ncol, size_t block, size_t width, std::vector<fT> & padded)
+{
+    if (ncol % block == 0) return other;
+    padded.assign((ncol + block - ncol % block) * width, static_cast<fT>(0.));
+    std::copy(other, other + ncol*width, padded.begin());
+    return padded.data();
+}
+
+template<typename fT, typename IndexT>
+void BlockMatrix<fT, IndexT>::multiply(const fT * other, fT * ret) const
+{
+    std::vector<fT> padded;
+    other = pad_input(other, m_ncol, m_block, 1, padded);
+    const size_t nblock_row = m_index.size() - 1;
+    switch (m_block)
+    {
+        case 2:
+            simd_run(BlockProduct<fT, IndexT, 2>{m_index.data(), m_indices.data(), m_data.data(), m_nrow, other, ret},
+                     nblock_row, format_batch_);
+            break;
+        case 4:
+            simd_run(BlockProduct<fT, IndexT, 4>{m_index.data(), m_indices.data(), m_data.data(), m_nrow, other, ret},
+                     nblock_row, format_batch_);
+            break;
+        default:
+            simd_run(BlockProduct<fT, IndexT, 8>{m_index.data(), m_indices.data(), m_data.data(), m_nrow, other, ret},
+                     nblock_row, format_batch_);
+    }
+}
+
+template<typename fT, typename IndexT>
+void BlockMatrix<fT, IndexT>::multiply(const fT * other, fT * ret, size_t k) const
+{
+    std::vector<fT> padded;
+    other = pad_input(other, m_ncol, m_block, k, padded);
+    const size_t nblock_row = m_index.size() - 1;
+    switch (m_block)
+    {
+        case 2:
+            simd_run(BlockBlockProduct<fT, IndexT, 2>{m_index.data(), m_indices.data(), m_data.data(), m_nrow,
+                                                      other, ret, k}, nblock_row, format_batch_);
+            break;
+        case 4:
+            simd_run(BlockBlockProduct<fT, IndexT, 4>{m_index.data(), m_indices.data(), m_data.data(), m_nrow,
+                                                      other, ret, k}, nblock_row, format_batch_);
+            break;
+        default:
+            simd_run(BlockBlockProduct<fT, IndexT, 8>{m_index.data(), m_indices.data(), m_data.data(), m_nrow,
+                                                      other, ret, k}, nblock_row, format_batch_);
+    }
+}
+
+/*
+ * Analyze the row lengths and block structure of a matrix
+ * The traffic of every format is estimated in bytes: CSR streams its
+ * elements and pays a fixed cost per row, SELL streams its padded slots,
+ * BCSR whole blocks with one index each. The block fill is taken from
+ * evenly spaced block rows. Pattern matrices always stay in CSR.
+*/
+template<typename fT, typename IndexT>
+MatrixStructure analyze_structure(SparseMatrix<fT, IndexT> const & mat)
+{
+    SPARSE_STAT_SCOPE(analyze, mat.nnz());
+    MatrixStructure ret;
+    const size_t nrow = mat.nrow(), nnz = mat.nnz();
+    if (!nrow || !nnz) return ret;
+    const size_t * index = mat.index().data();
+    const IndexT * indices = mat.indices().data();
+
+    double sum_sq = 0;
+    size_t max_row = 0;
+    #pragma omp parallel for schedule(static) reduction(+:sum_sq) reduction(max:max_row)
+    for(size_t i=0; i<nrow; ++i)
+    {
+        const size_t length = index[i+1] - index[i];
+        sum_sq += static_cast<double>(length) * static_cast<double>(length);
+        max_row = std::max(max_row, length);
+    }
+    ret.mean_row = static_cast<double>(nnz) / static_cast<double>(nrow);
+    ret.row_cv = std::sqrt(std::max(0.0, sum_sq / static_cast<double>(nrow) - ret.mean_row * ret.mean_row)) / ret.mean_row;
+    ret.max_row = max_row;
+
+    // Slots of SELL-C-sigma, the longest row of every slice after sorting
+    const size_t nwindow = (nrow + sell_sigma_ - 1) / sell_sigma_;
+    size_t sell_stored = 0;
+    #pragma omp parallel reduction(+:sell_stored)
+    {
+        std::vector<size_t> length;
+        #pragma omp for schedule(dynamic, 16)
+        for(size_t w=0; w<nwindow; ++w)
+        {
+            const size_t begin = w * sell_sigma_, end = std::min(nrow, begin + sell_sigma_);
+            length.clear();
+            for(size_t i=begin; i<end; ++i) length.push_back(index[i+1] - index[i]);
+            std::sort(length.begin(), length.end(), [](size_t a, size_t b) { return a > b; });
+            for(size_t i=0; i<length.size(); i+=sell_chunk_) sell_stored += length[i] * sell_chunk_;
+        }
+    }
+    ret.sell_fill = static_cast<double>(nnz) / static_cast<double>(sell_stored);
+
+    const double value_bytes = sizeof(fT), index_bytes = sizeof(IndexT);
+    const double csr_cost = static_cast<double>(nnz) * (value_bytes + index_bytes) +
+                            static_cast<double>(nrow) * (sizeof(size_t) + row_overhead_);
+    const double sell_cost = static_cast<double>(sell_stored) * (value_bytes + index_bytes) +
+                             static_cast<double>(nrow) * sizeof(size_t);
+
+    double block_cost = 0;
+    std::vector<IndexT> cols;
+    for (size_t block : {2, 4, 8})
+    {
+        const size_t nblock_row = (nrow + block - 1) / block;
+        const size_t step = std::max<size_t>(1, nblock_row / analyze_samples_);
+        size_t elements = 0, blocks = 0;
+        for(size_t r=0; r<nblock_row; r+=step)
+        {
+            block_columns(index, indices, nrow, block, r, cols);
+            elements += index[std::min(nrow, (r+1)*block)] - index[r*block];
+            blocks += cols.size();
+        }
+        if (!blocks) continue;
+        const double fill = static_cast<double>(elements) / static_cast<double>(blocks * block * block);
+        const double cost = static_cast<double>(nnz) / fill * (value_bytes + index_bytes / (block * block)) +
+                            static_cast<double>(nblock_row) * sizeof(size_t);
+        if (!ret.block || cost < block_cost)
+        {
+            ret.block = block;
+            ret.block_fill = fill;
+            block_cost = cost;
+        }
+    }
+
+    if constexpr (!SparseMatrix<fT, IndexT>::pattern())
+    {
+        double best = csr_cost * format_margin_;
+        if (sell_cost < best)
+        {
+            ret.format = Format::sell;
+            best = sell_cost;
+        }
+        if (ret.block && block_cost < best) ret.format = Format::bcsr;
+    }
+    return ret;
+}
+
+/*
+ * Convert a matrix for its products
+ * bcsr takes the block size the analyzer finds densest, automatic also
+ * its format
+*/
+template<typename fT, typename IndexT>
+std::shared_ptr<const FormatPlan<fT, IndexT>> make_format_plan(SparseMatrix<fT, IndexT> const & mat, Format format)
+{
+    std::shared_ptr<FormatPlan<fT, IndexT>> ret = std::make_shared<FormatPlan<fT, IndexT>>();
+    size_t block = 0;
+    if (format == Format::automatic || format == Format::bcsr)
+    {
+        const MatrixStructure structure = analyze_structure(mat);
+        if (format == Format::automatic) format = structure.format;
+        block = structure.block;
+    }
+    if (format == Format::sell)
+        ret->sell.reset(new SellMatrix<fT, IndexT>(mat));
+    else if (format == Format::bcsr && block)
+        ret->block.reset(new BlockMatrix<fT, IndexT>(mat, block));
+    else
+        format = Format::csr;
+    ret->format = format;
+    return ret;
+}
+
+#define INSTANTIATE(fT, IndexT) \
+    template MatrixStructure analyze_structure(SparseMatrix<fT, IndexT> const &);
+SPARSE_ALL_TYPES(INSTANTIATE)
+#undef INSTANTIATE
+
+#define INSTANTIATE(fT, IndexT) \
+    template class SellMatrix<fT, IndexT>; \
+    template class BlockMatrix<fT, IndexT>; \
+    template std::shared_ptr<const FormatPlan<fT, IndexT>> make_format_plan(SparseMatrix<fT, IndexT> const &, Format);
+SPARSE_NUMERIC_TYPES(INSTANTIATE)
@@ -0,0 +1,213 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <vector>
+#include <stdexcept>
+#include <type_traits>
+
+#include "generator.hpp"
+#include "builder.hpp"
+#include "instantiate.hpp"
+
+/*
+ * SplitMix64 finalizer, a bijection turning a counter into random bits
+*/
+static inline uint64_t mix(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/*
+ * Random bits of the k-th draw of a stream
+*/
+static inline uint64_t draw(uint64_t stream, uint64_t k)
+{
+    return mix(stream ^ mix(k));
+}
+
+// Uniform in [0, 1)
+static inline double uniform(uint64_t bits)
+{
+    return static_cast<double>(bits >> 11) * 0x1.0p-53;
+}
+
+template<typename fT>
+static inline fT weight(uint64_t bits)
+{
+    if constexpr (is_pattern<fT>::value)
+        return true;
+    else if constexpr (std::is_floating_point<fT>::value)
+        return static_cast<fT>(static_cast<double>((bits >> 11) + 1) * 0x1.0p-53);
+    else
+        return static_cast<fT>(1 + bits % 100);
+}
+
+template<typename IndexT>
+static void check_dimension(size_t dim)
+{
+    if (dim == 0 || dim - 1 > std::numeric_limits<IndexT>::max())
+    {
+        throw std::out_of_range(
+            "the generated dimension is empty or "
+            "does not fit in the column index type");
+    }
+}
+
+/*
+ * Assemble the drawn edges, duplicates keep their largest weight
+*/
+template<typename fT, typename IndexT>
+static SparseMatrix<fT, IndexT> assemble(size_t dim, std::vector<size_t> const & rows,
+                                         std::vector<size_t> const & cols, std::vector<fT> const & values)
+{
+    SparseMatrixBuilder<fT, IndexT> builder(dim, dim, DuplicatePolicy::max);
+    builder.add(rows, cols, values);
+    return builder.build();
+}
+
+/*
+ * Recursive matrix (R-MAT) graph
+ * Each edge descends scale levels of the adjacency matrix, picking one of
+ * the four quadrants at every level with probability a, b, c and d. The
+ * result has the skewed degrees and small diameter of web and social
+ * graphs.
+ * @param scale the matrix has 2^scale rows
+ * @param edge_factor number of drawn edges per row
+ * @param seed selects the matrix
+ * @param options quadrant probabilities
+*/
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> rmat_matrix(size_t scale, size_t edge_factor, uint64_t seed, RMatOptions const & options)
+{
+    const double d = 1 - options.a - options.b - options.c;
+    if (options.a < 0 || options.b < 0 || options.c < 0 || d < 0)
+    {
+        throw std::domain_error(
+            "the quadrant probabilities must be "
+            "non-negative and sum to at most one");
+    }
+    if (scale > std::numeric_limits<IndexT>::digits || scale >= 64)
+    {
+        throw std::out_of_range(
+            "the generated dimension does not "
+            "fit in the column index type");
+    }
+    const size_t dim = static_cast<size_t>(1) << scale;
+    check_dimension<IndexT>(dim);
+
+    const size_t mask = dim - 1;
+    const size_t nedge = dim * edge_factor;
+    const uint64_t stream = mix(seed);
+    // Odd multiplier and offset of the relabeling, a bijection modulo dim
+    const size_t multiplier = (mix(stream + 1) | 1) & mask;
+    const size_t offset = mix(stream + 2) & mask;
+    auto relabel = [&](size_t node)
+    {
+        return options.scramble ? (node * multiplier + offset) & mask : node;
+    };
+
+    std::vector<size_t> rows(nedge), cols(nedge);
+    std::vector<fT> values(nedge, static_cast<fT>(1));
+    #pragma omp parallel for schedule(static)
+    for(size_t e=0; e<nedge; ++e)
+    {
+        const uint64_t edge_stream = draw(stream, e);
+        size_t row = 0, col = 0;
+        for(size_t level=0; level<scale; ++level)
+        {
+            const double u = uniform(draw(edge_stream, level));
+            const size_t right = u >= options.a && (u < options.a + options.b || u >= options.a + options.b + options.c);
+            const size_t lower = u >= options.a + options.b;
+            row = (row << 1) | lower;
+            col = (col << 1) | right;
+        }
+        rows[e] = relabel(row);
+        cols[e] = relabel(col);
+        if constexpr (!is_pattern<fT>::value) values[e] = weight<fT>(draw(edge_stream, scale));
+    }
+    return assemble<fT, IndexT>(dim, rows, cols, values);
+}
+
+/*
+ * Erdos-Renyi graph
+ * Every edge picks its two end nodes uniformly at random, which gives
+ * the narrow degree distribution of a uniform random graph.
+ * @param dim number of nodes
+ * @param degree average number of drawn edges per node
+ * @param seed selects the matrix
+*/
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> erdos_renyi_matrix(size_t dim, double degree, uint64_t seed)
+{
+    check_dimension<IndexT>(dim);
+    if (!(degree >= 0))
+    {
+        throw std::domain_error(
+            "the average degree must "
+            "not be negative");
+    }
+
+    const size_t nedge = static_cast<size_t>(std::llround(degree * static_cast<double>(dim)));
+    const uint64_t stream = mix(seed ^ 0x5851f42d4c957f2dULL);
+
+    std::vector<size_t> rows(nedge), cols(nedge);
+    std::vector<fT> values(nedge, static_cast<fT>(1));
+    #pragma omp parallel for schedule(static)
+    for(size_t e=0; e<nedge; ++e)
+    {
+        const uint64_t edge_stream = draw(stream, e);
+        rows[e] = static_cast<size_t>(uniform(draw(edge_stream, 0)) * static_cast<double>(dim));
+        cols[e] = static_cast<size_t>(uniform(draw(edge_stream, 1)) * static_cast<double>(dim));
+        if constexpr (!is_pattern<fT>::value) values[e] = weight<fT>(draw(edge_stream, 2));
+    }
+    return assemble<fT, IndexT>(dim, rows, cols, values);
+}
+
+/*
+ * Banded matrix
+ * Row i holds the columns i - bandwidth to i + bandwidth, the structure of
+ * discretized one dimensional meshes, with a regular access pattern.
+ * @param dim number of rows and columns
+ * @param bandwidth number of stored diagonals on each side of the main one
+ * @param seed selects the weights
+*/
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> banded_matrix(size_t dim, size_t bandwidth, uint64_t seed)
+{
+    check_dimension<IndexT>(dim);
+    bandwidth = std::min(bandwidth, dim - 1);
+    const uint64_t stream = mix(seed ^ 0x2545f4914f6cdd1dULL);
+
+    Buffer<size_t> index(dim+1, 0);
+    size_t * count = index.data();
+    for(size_t i=0; i<dim; ++i)
+        count[i+1] = count[i] + std::min(i + bandwidth, dim - 1) + 1 - (i > bandwidth ? i - bandwidth : 0);
+
+    Buffer<IndexT> indices(count[dim]);
+    ValueBuffer<fT> data(count[dim]);
+    IndexT * out_indices = indices.data();
+    fT * out_data = data.data();
+    #pragma omp parallel for schedule(static)
+    for(size_t i=0; i<dim; ++i)
+    {
+        size_t pos = count[i];
+        const size_t last = std::min(i + bandwidth, dim - 1);
+        for(size_t j=(i > bandwidth ? i - bandwidth : 0); j<=last; ++j, ++pos)
+        {
+            out_indices[pos] = static_cast<IndexT>(j);
+            if constexpr (!is_pattern<fT>::value) out_data[pos] = weight<fT>(draw(stream, pos));
+        }
+    }
+    return SparseMatrix<fT, IndexT>(dim, dim, std::move(index), std::move(indices), std::move(data));
+}
+
+#define INSTANTIATE(fT, IndexT) \
+    template SparseMatrix<fT, IndexT> rmat_matrix(size_t, size_t, uint64_t, RMatOptions const &); \
+    template SparseMatrix<fT, IndexT> erdos_renyi_matrix(size_t, double, uint64_t); \
+    template SparseMatrix<fT, IndexT> banded_matrix(size_t, size_t, uint64_t);
+SPARSE_ALL_TYPES(INSTANTIATE)
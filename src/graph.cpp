@@ -2,14 +2,55 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
 
 #include "graph.hpp"
+#include "stats.hpp"
+#include "instantiate.hpp"
+
+/*
+ * Matrix sharing the arrays and the shape of the original
+ * The arrays turn read-only in the original, which copies them before its
+ * next modification, so the copy stays intact whatever happens to it. The
+ * hash tables and the format plan are left behind, the kernels only scan.
+*/
+template<typename fT, typename IndexT>
+static std::shared_ptr<const SparseMatrix<fT, IndexT>> share_matrix(SparseMatrix<fT, IndexT> const & mat)
+{
+    std::shared_ptr<void const> index, indices, data;
+    mat.share(index, indices, data);
+    // Copies of borrowed buffers share their elements
+    return std::make_shared<const SparseMatrix<fT, IndexT>>(
+        mat.nrow(), mat.ncol(), Buffer<size_t>(mat.index()),
+        Buffer<IndexT>(mat.indices()), ValueBuffer<fT>(mat.data()));
+}
+
+/*
+ * Pin the matrix into the cached snapshot unless it still holds its arrays
+ * Any modification of a shared array moves it to a new allocation while
+ * the snapshot keeps the old one alive, so equal pointers mean unchanged.
+*/
+template<typename fT, typename IndexT>
+static std::shared_ptr<const SparseMatrix<fT, IndexT>> pin_matrix(SparseMatrix<fT, IndexT> const & mat,
+                                                                  std::shared_ptr<const SparseMatrix<fT, IndexT>> & pinned)
+{
+    if (!pinned || pinned->nrow() != mat.nrow() || pinned->ncol() != mat.ncol() ||
+        pinned->nnz() != mat.nnz() || pinned->index().data() != mat.index().data() ||
+        pinned->indices().data() != mat.indices().data() || pinned->data().data() != mat.data().data())
+    {
+        pinned = share_matrix(mat);
+    }
+    return pinned;
+}
 
 /**
  * Default Constructor
 **/
-template<typename fT>
-SparseGraph<fT>::SparseGraph(size_t dim, bool identity)
+template<typename fT, typename IndexT>
+SparseGraph<fT, IndexT>::SparseGraph(size_t dim, bool identity)
     : m_adj_mat(dim, dim, identity)
 {
 
@@ -19,59 +60,213 @@ SparseGraph<fT>::SparseGraph(size_t dim, bool identity)
  * Copy Contructor
  * Setting the data into copied object
 **/
-template<typename fT>
-SparseGraph<fT>::SparseGraph(SparseGraph<fT> const & other)
-    : m_adj_mat(other.m_adj_mat)
+template<typename fT, typename IndexT>
+SparseGraph<fT, IndexT>::SparseGraph(SparseGraph<fT, IndexT> const & other)
+    : SparseGraph()
 {
-
+    *this = other;
 }
 
 /**
  * Move Constructor
- * Swapping data content of two graph
+ * Taking over the data content of the other graph
 **/
-template<typename fT>
-SparseGraph<fT>::SparseGraph(SparseGraph<fT> && other)
-    : m_adj_mat(other.m_adj_mat)
+template<typename fT, typename IndexT>
+SparseGraph<fT, IndexT>::SparseGraph(SparseGraph<fT, IndexT> && other)
+    : SparseGraph()
 {
+    *this = std::move(other);
+}
 
+/*
+ * Assignment Operator
+ * Buffered updates of the other graph are merged before the copy
+*/
+template<typename fT, typename IndexT>
+SparseGraph<fT, IndexT>& SparseGraph<fT, IndexT>::operator=(SparseGraph<fT, IndexT> const & other)
+{
+    if (this == &other) return *this;
+    discard_overlay();
+    std::scoped_lock lock(m_mutex, other.m_mutex);
+    other.flush_overlay();
+    release_pinned();
+    m_adj_mat = other.m_adj_mat;
+    m_in_adj = other.m_in_adj;
+    m_in_valid = other.m_in_valid;
+    m_dynamic = other.m_dynamic;
+    m_options = other.m_options;
+    return *this;
+}
+
+/*
+ * Move Assignment Operator
+ * Taking over the adjacency and the buffered updates of the other graph
+ * once its background merge finished, the other graph is left with a
+ * single node
+*/
+template<typename fT, typename IndexT>
+SparseGraph<fT, IndexT>& SparseGraph<fT, IndexT>::operator=(SparseGraph<fT, IndexT> && other)
+{
+    if (this == &other) return *this;
+    discard_overlay();
+    std::scoped_lock lock(m_mutex, other.m_mutex);
+    other.install_compaction();
+    release_pinned();
+    m_adj_mat = std::move(other.m_adj_mat);
+    m_in_adj = std::move(other.m_in_adj);
+    m_in_valid = other.m_in_valid;
+    m_dynamic = other.m_dynamic;
+    m_options = other.m_options;
+    m_delta.swap(other.m_delta);
+    m_pending = other.m_pending;
+    other.m_adj_mat = SparseMatrix<fT, IndexT>(1, 1);
+    other.m_pending = 0;
+    other.invalidate_in_adjacency();
+    return *this;
 }
 
 /**
  * Copy Constuctor
  * Init Sparse Graph with vector of vector
 **/
-template<typename fT>
-SparseGraph<fT>::SparseGraph(std::vector<std::vector<fT>> const & other, size_t dim)
+template<typename fT, typename IndexT>
+SparseGraph<fT, IndexT>::SparseGraph(std::vector<std::vector<fT>> const & other, size_t dim)
     : m_adj_mat(other, dim, dim)
 {
     
 }
 
+/**
+ * Edge List Constructor
+ * Init Sparse Graph with parallel arrays of source, destination and weight
+ * Repeated edges are combined with the specified policy
+**/
+template<typename fT, typename IndexT>
+SparseGraph<fT, IndexT>::SparseGraph(size_t dim, std::vector<size_t> const & src, std::vector<size_t> const & dst,
+                             std::vector<fT> const & weight, DuplicatePolicy policy)
+    : m_adj_mat(dim, dim)
+{
+    SparseMatrixBuilder<fT, IndexT> builder(dim, dim, policy);
+    builder.add(src, dst, weight);
+    m_adj_mat = builder.build();
+}
+
+/**
+ * Unweighted Edge List Constructor
+ * Init Sparse Graph with parallel arrays of source and destination
+ * Every edge has weight one, repeated edges are stored once
+**/
+template<typename fT, typename IndexT>
+SparseGraph<fT, IndexT>::SparseGraph(size_t dim, std::vector<size_t> const & src, std::vector<size_t> const & dst)
+    : SparseGraph(dim, src, dst, std::vector<fT>(src.size(), static_cast<fT>(1)), DuplicatePolicy::max)
+{
+
+}
+
+/**
+ * Move Constuctor
+ * Init Sparse Graph by taking over a square adjacency matrix
+**/
+template<typename fT, typename IndexT>
+SparseGraph<fT, IndexT>::SparseGraph(SparseMatrix<fT, IndexT> && adj)
+    : m_adj_mat(std::move(adj))
+{
+    if (m_adj_mat.nrow() != m_adj_mat.ncol())
+    {
+        throw std::out_of_range(
+            "the adjacency matrix "
+            "is not square");
+    }
+}
+
 /*
  * Load sparse matrix from text file
 */
-template<typename fT>
-void SparseGraph<fT>::load(std::string filename)
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::load(std::string filename)
 {
+    discard_overlay();
+    std::lock_guard<std::mutex> lock(m_mutex);
     m_adj_mat.load(filename);
 }
 
 /*
  * Save sparse matrix from text file
 */
-template<typename fT>
-void SparseGraph<fT>::save(std::string filename)
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::save(std::string filename) const
+{
+    adjacency_snapshot()->save(filename);
+}
+
+/*
+ * Load sparse matrix from binary file
+ * The adjacency matrix borrows the memory mapped file when map is set
+*/
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::load_binary(std::string filename, bool map)
+{
+    discard_overlay();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_adj_mat.load_binary(filename, map);
+    if (m_adj_mat.nrow() != m_adj_mat.ncol())
+    {
+        replace_adjacency(SparseMatrix<fT, IndexT>(1, 1));
+        throw std::out_of_range(
+            "the loaded adjacency matrix "
+            "is not square");
+    }
+}
+
+/*
+ * Save sparse matrix to binary file
+*/
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::save_binary(std::string filename) const
+{
+    adjacency_snapshot()->save_binary(filename);
+}
+
+/*
+ * Load graph from Matrix Market file
+ * @return original id of every node when options.remap_ids is set,
+ *         empty otherwise
+*/
+template<typename fT, typename IndexT>
+std::vector<size_t> SparseGraph<fT, IndexT>::load_mtx(std::string filename, GraphLoadOptions const & options)
+{
+    std::vector<size_t> ids;
+    SparseMatrix<fT, IndexT> adj = read_matrix_market<fT, IndexT>(filename, options, ids);
+    discard_overlay();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    replace_adjacency(std::move(adj));
+    return ids;
+}
+
+/*
+ * Load graph from edge list file
+ * @return original id of every node when options.remap_ids is set,
+ *         empty otherwise
+*/
+template<typename fT, typename IndexT>
+std::vector<size_t> SparseGraph<fT, IndexT>::load_edge_list(std::string filename, GraphLoadOptions const & options)
 {
-    m_adj_mat.save(filename);
+    std::vector<size_t> ids;
+    SparseMatrix<fT, IndexT> adj = read_edge_list<fT, IndexT>(filename, options, ids);
+    discard_overlay();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    replace_adjacency(std::move(adj));
+    return ids;
 }
 
 /*
  * Reset the content of matrix to initial state
 */
-template<typename fT>
-void SparseGraph<fT>::reset(bool identity)
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::reset(bool identity)
 {
+    discard_overlay();
+    std::lock_guard<std::mutex> lock(m_mutex);
     m_adj_mat.reset(identity);
 }
 
@@ -81,9 +276,24 @@ void SparseGraph<fT>::reset(bool identity)
  * @param ncol graph column
  * @return value at the specified graph row and column
 */
-template<typename fT>
-fT SparseGraph<fT>::operator() (size_t nrow, size_t ncol) const
+template<typename fT, typename IndexT>
+fT SparseGraph<fT, IndexT>::operator() (size_t nrow, size_t ncol) const
 {
+    if (m_dynamic)
+    {
+        // Newest update wins, then the one being compacted
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (DeltaMap const * delta : {&m_delta, &m_frozen})
+        {
+            auto row = delta->find(nrow);
+            if (row == delta->end()) continue;
+            auto it = std::lower_bound(row->second.begin(), row->second.end(),
+                                       std::make_pair(ncol, static_cast<fT>(0)),
+                                       [](std::pair<size_t, fT> const & a, std::pair<size_t, fT> const & b)
+                                       { return a.first < b.first; });
+            if (it != row->second.end() && it->first == ncol) return it->second;
+        }
+    }
     return m_adj_mat(nrow, ncol);
 }
 
@@ -93,49 +303,374 @@ fT SparseGraph<fT>::operator() (size_t nrow, size_t ncol) const
  * @param ncol graph column
  * @return reference to the value at the specified graph row and column
 */
-template<typename fT>
-void SparseGraph<fT>::operator() (size_t nrow, size_t ncol, fT value)
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::operator() (size_t nrow, size_t ncol, fT value)
 {
+    if (m_dynamic)
+    {
+        update_overlay(nrow, ncol, value);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    release_pinned();
     m_adj_mat(nrow, ncol, value);
+    // Patch the in-edges in place rather than rebuilding them
+    if (m_in_valid) m_in_adj(ncol, nrow, value);
 }
 
 /*
  * Equality Comparison
 */
-template<typename fT>
-bool SparseGraph<fT>::operator== (SparseGraph<fT> const & other)
+template<typename fT, typename IndexT>
+bool SparseGraph<fT, IndexT>::operator== (SparseGraph<fT, IndexT> const & other)
 {
-    if (m_adj_mat == other.m_adj_mat) return true;
+    compact();
+    if (m_adj_mat == other.adjacency()) return true;
     return false;
 }
 
+/*
+ * Set the out-degree above which nodes keep a neighbor hash table
+ * Lookups of such nodes no longer depend on their degree
+ * @param threshold minimum out-degree, zero removes all hash tables
+*/
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::set_hash_threshold(size_t threshold)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    flush_overlay();
+    m_adj_mat.set_hash_threshold(threshold);
+}
+
 /*
  * Increase the node count of the graph
 */
-template<typename fT>
-void SparseGraph<fT>::add_node()
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::add_node()
 {
+    // Buffered updates stay valid, only a running merge has to finish
+    std::lock_guard<std::mutex> lock(m_mutex);
+    install_compaction();
+    release_pinned();
     m_adj_mat.expand_row();
     m_adj_mat.expand_col();
+    if (m_in_valid)
+    {
+        m_in_adj.expand_row();
+        m_in_adj.expand_col();
+    }
 }
 
 /*
  * Decrease the node count of the graph
 */
-template<typename fT>
-void SparseGraph<fT>::remove_node()
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::remove_node()
 {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    flush_overlay();
+    invalidate_in_adjacency();
     m_adj_mat.shrink_row();
     m_adj_mat.shrink_col();
 }
 
 /*
- * Return reference to internal adjacency matrix
+ * Append nodes without edges to the graph
+ * The row offsets grow once for all new nodes
+ * @param count number of nodes
+*/
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::add_nodes(size_t count)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    install_compaction();
+    release_pinned();
+    m_adj_mat.expand_row(count);
+    m_adj_mat.expand_col(count);
+    if (m_in_valid)
+    {
+        m_in_adj.expand_row(count);
+        m_in_adj.expand_col(count);
+    }
+}
+
+/*
+ * Remove an arbitrary set of nodes together with their edges
+ * The surviving nodes are renumbered in their original order and the
+ * adjacency matrix is rebuilt in a single pass over the edges.
+ * @param ids nodes to remove, repeated ids are ignored
+ * @return new id of every old node, -1 for removed nodes
+*/
+template<typename fT, typename IndexT>
+std::vector<int64_t> SparseGraph<fT, IndexT>::remove_nodes(std::vector<size_t> const & ids)
+{
+    compact();
+    const size_t n = dim();
+
+    std::vector<int64_t> ret(n, 0);
+    for (size_t id : ids)
+    {
+        if (id >= n)
+        {
+            throw std::out_of_range(
+                "the node is "
+                "outside of the graph");
+        }
+        ret[id] = -1;
+    }
+    int64_t next = 0;
+    for (int64_t & id : ret)
+        if (id == 0) id = next++;
+    const size_t m = static_cast<size_t>(next);
+
+    const size_t * index = m_adj_mat.index().data();
+    const IndexT * indices = m_adj_mat.indices().data();
+    const fT * data = m_adj_mat.data().data();
+    const int64_t * map = ret.data();
+
+    // Renumbering keeps the column order, so rows stay sorted
+    Buffer<size_t> new_index(m+1, 0);
+    size_t * count = new_index.data();
+    #pragma omp parallel for schedule(dynamic, 256)
+    for(size_t i=0; i<n; ++i)
+    {
+        if (map[i] < 0) continue;
+        size_t length = 0;
+        for(size_t j=index[i]; j<index[i+1]; ++j) length += map[indices[j]] >= 0;
+        count[map[i]+1] = length;
+    }
+    for(size_t i=0; i<m; ++i) count[i+1] += count[i];
+
+    Buffer<IndexT> new_indices(count[m]);
+    ValueBuffer<fT> new_data(count[m]);
+    IndexT * out_indices = new_indices.data();
+    fT * out_data = new_data.data();
+    #pragma omp parallel for schedule(dynamic, 256)
+    for(size_t i=0; i<n; ++i)
+    {
+        if (map[i] < 0) continue;
+        size_t pos = count[map[i]];
+        for(size_t j=index[i]; j<index[i+1]; ++j)
+        {
+            if (map[indices[j]] < 0) continue;
+            out_indices[pos] = static_cast<IndexT>(map[indices[j]]);
+            if constexpr (!is_pattern<fT>::value) out_data[pos] = data[j];
+            ++pos;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    invalidate_in_adjacency();
+    replace_adjacency(SparseMatrix<fT, IndexT>(m, m, std::move(new_index), std::move(new_indices), std::move(new_data)));
+    return ret;
+}
+
+/*
+ * Renumber the nodes, node i becomes node perm[i]
+*/
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::permute(std::vector<size_t> const & perm)
+{
+    compact();
+    SparseMatrix<fT, IndexT> permuted = m_adj_mat.permute(perm);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    invalidate_in_adjacency();
+    replace_adjacency(std::move(permuted));
+}
+
+/*
+ * Renumber the nodes for memory locality
+ * @param ordering ordering to compute
+ * @return new index of every node, results computed on the reordered
+ *         graph are mapped back with it
 */
-template<typename fT>
-const SparseMatrix<fT> & SparseGraph<fT>::to_sparse_matrix()
+template<typename fT, typename IndexT>
+std::vector<size_t> SparseGraph<fT, IndexT>::reorder(Ordering ordering)
 {
+    std::vector<size_t> ret = compute_ordering(adjacency(), in_adjacency(), ordering);
+    permute(ret);
+    return ret;
+}
+
+/*
+ * Adjacency matrix with all buffered updates merged in
+ * The reference is valid until the graph changes, a compaction triggered
+ * by an update included, see adjacency_snapshot
+*/
+template<typename fT, typename IndexT>
+const SparseMatrix<fT, IndexT> & SparseGraph<fT, IndexT>::adjacency() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    flush_overlay();
     return m_adj_mat;
 }
 
-template class SparseGraph<double>;
+/*
+ * Transposed adjacency matrix, row v holds the in-edges of node v
+ * Built on first use and kept until the graph is replaced, shrunk or
+ * compacted, direct edge updates and new nodes are patched into it
+*/
+template<typename fT, typename IndexT>
+const SparseMatrix<fT, IndexT> & SparseGraph<fT, IndexT>::in_adjacency() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    flush_overlay();
+    build_in_adjacency();
+    return m_in_adj;
+}
+
+/*
+ * Adjacency matrix pinned for the lifetime of the pointer
+ * Shares the arrays of the graph, so it is taken without a copy and
+ * outlives updates and compactions running at the same time.
+*/
+template<typename fT, typename IndexT>
+std::shared_ptr<const SparseMatrix<fT, IndexT>> SparseGraph<fT, IndexT>::adjacency_snapshot() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    flush_overlay();
+    return share_matrix(m_adj_mat);
+}
+
+/*
+ * Transposed adjacency matrix pinned for the lifetime of the pointer
+*/
+template<typename fT, typename IndexT>
+std::shared_ptr<const SparseMatrix<fT, IndexT>> SparseGraph<fT, IndexT>::in_adjacency_snapshot() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    flush_overlay();
+    build_in_adjacency();
+    return share_matrix(m_in_adj);
+}
+
+/*
+ * Adjacency or transposed adjacency pinned for a graph kernel
+ * Unlike adjacency_snapshot the buffered updates within the read lag of
+ * the dynamic mode are left out, and the snapshot is kept for the next
+ * kernel, so repeated queries on an unchanged graph allocate nothing.
+*/
+template<typename fT, typename IndexT>
+std::shared_ptr<const SparseMatrix<fT, IndexT>> SparseGraph<fT, IndexT>::kernel_snapshot(bool transposed) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    flush_for_read();
+    if (!transposed) return pin_matrix(m_adj_mat, m_pinned);
+    build_in_adjacency();
+    return pin_matrix(m_in_adj, m_in_pinned);
+}
+
+/*
+ * Adjacency and transposed adjacency pinned together for a graph kernel,
+ * so both belong to the same state of the graph
+*/
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::snapshots(std::shared_ptr<const SparseMatrix<fT, IndexT>> & adj,
+                                        std::shared_ptr<const SparseMatrix<fT, IndexT>> & in_adj) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    flush_for_read();
+    build_in_adjacency();
+    adj = pin_matrix(m_adj_mat, m_pinned);
+    in_adj = pin_matrix(m_in_adj, m_in_pinned);
+}
+
+/*
+ * Number of edges ending at the node
+*/
+template<typename fT, typename IndexT>
+size_t SparseGraph<fT, IndexT>::in_degree(size_t node) const
+{
+    if (node >= dim())
+    {
+        throw std::out_of_range(
+            "the node is "
+            "outside of the graph");
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    flush_overlay();
+    build_in_adjacency();
+    const Buffer<size_t> & index = m_in_adj.index();
+    return index[node+1] - index[node];
+}
+
+/*
+ * Source nodes of the edges ending at the node, in ascending order
+*/
+template<typename fT, typename IndexT>
+std::vector<size_t> SparseGraph<fT, IndexT>::in_neighbors(size_t node) const
+{
+    if (node >= dim())
+    {
+        throw std::out_of_range(
+            "the node is "
+            "outside of the graph");
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    flush_overlay();
+    build_in_adjacency();
+    const Buffer<IndexT> & indices = m_in_adj.indices();
+    const Buffer<size_t> & index = m_in_adj.index();
+    return std::vector<size_t>(indices.begin() + index[node], indices.begin() + index[node+1]);
+}
+
+/*
+ * Drop the transposed adjacency, the next in-edge query rebuilds it
+ * The caller holds m_mutex
+*/
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::invalidate_in_adjacency() const
+{
+    m_in_valid = false;
+    m_in_adj = SparseMatrix<fT, IndexT>(1, 1);
+    m_in_pinned.reset();
+}
+
+/*
+ * Drop the snapshots kept for the kernels before the matrices change, so
+ * they do not hold on to the old arrays
+ * The caller holds m_mutex
+*/
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::release_pinned() const
+{
+    m_pinned.reset();
+    m_in_pinned.reset();
+}
+
+/*
+ * Install a new adjacency matrix, keeping the hash threshold of the graph
+*/
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::replace_adjacency(SparseMatrix<fT, IndexT> && adj) const
+{
+    adj.set_hash_threshold(m_adj_mat.hash_threshold());
+    m_adj_mat = std::move(adj);
+    m_pinned.reset();
+}
+
+/*
+ * Build the transposed adjacency unless it is valid
+ * The caller holds m_mutex
+*/
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::build_in_adjacency() const
+{
+    if (m_in_valid) return;
+    SPARSE_STAT_SCOPE(in_adjacency, m_adj_mat.nnz());
+    m_in_adj = m_adj_mat.transpose();
+    m_in_valid = true;
+}
+
+/*
+ * Return reference to internal adjacency matrix
+*/
+template<typename fT, typename IndexT>
+const SparseMatrix<fT, IndexT> & SparseGraph<fT, IndexT>::to_sparse_matrix()
+{
+    return adjacency();
+}
+
+#define INSTANTIATE(fT, IndexT) \
+    template class SparseGraph<fT, IndexT>;
+SPARSE_ALL_TYPES(INSTANTIATE)
@@ -0,0 +1,106 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#include <limits>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include "graph.hpp"
+#include "atomic.hpp"
+#include "stats.hpp"
+#include "neighbors.hpp"
+#include "instantiate.hpp"
+
+/*
+ * Core number of every node, edge directions and self loops ignored
+ * The k-core is what remains after repeatedly removing the nodes of
+ * degree below k, the core number of a node is the largest k whose core
+ * holds it. Peeling goes one bucket at a time: the remaining nodes whose
+ * degree is down to the current level k are removed together, and every
+ * neighbor they pull down to k joins the same bucket. A neighbor is only
+ * decremented while its degree is above k, a decrement racing below k is
+ * undone, so a node enters the bucket exactly once. Levels without any
+ * node are skipped by jumping to the smallest remaining degree.
+*/
+template<typename fT, typename IndexT>
+std::vector<size_t> SparseGraph<fT, IndexT>::core_numbers() const
+{
+    std::shared_ptr<const SparseMatrix<fT, IndexT>> pinned, in_pinned;
+    snapshots(pinned, in_pinned);
+    const SparseMatrix<fT, IndexT> & adj = *pinned;
+    SPARSE_STAT_SCOPE(kcore, adj.nnz());
+    const SparseMatrix<fT, IndexT> & in_adj = *in_pinned;
+    const size_t n = adj.nrow();
+    const size_t * index = adj.index().data();
+    const IndexT * indices = adj.indices().data();
+    const size_t * in_index = in_adj.index().data();
+    const IndexT * in_indices = in_adj.indices().data();
+
+    std::vector<size_t> degree(n), core(n);
+    std::vector<uint8_t> removed(n, 0);
+    std::vector<size_t> remaining(n);
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for(size_t v=0; v<n; ++v)
+    {
+        size_t count = 0;
+        for_each_neighbor(index, indices, in_index, in_indices, v, [&](size_t) { ++count; });
+        degree[v] = count;
+        remaining[v] = v;
+    }
+
+    size_t level = 0;
+    std::vector<size_t> bucket, next;
+    while (!remaining.empty())
+    {
+        size_t lowest = std::numeric_limits<size_t>::max();
+        #pragma omp parallel for schedule(static) reduction(min:lowest)
+        for(size_t i=0; i<remaining.size(); ++i) lowest = std::min(lowest, degree[remaining[i]]);
+        level = std::max(level, lowest);
+
+        bucket.clear();
+        for (size_t v : remaining)
+        {
+            if (degree[v] != level) continue;
+            removed[v] = 1;
+            bucket.push_back(v);
+        }
+
+        while (!bucket.empty())
+        {
+            next.clear();
+            #pragma omp parallel
+            {
+                std::vector<size_t> local;
+                #pragma omp for schedule(dynamic, 64) nowait
+                for(size_t i=0; i<bucket.size(); ++i)
+                {
+                    const size_t v = bucket[i];
+                    core[v] = level;
+                    for_each_neighbor(index, indices, in_index, in_indices, v, [&](size_t w)
+                    {
+                        if (atomic_load(removed[w]) || atomic_load(degree[w]) <= level) return;
+                        const size_t old = fetch_add(degree[w], static_cast<size_t>(-1));
+                        if (old == level + 1)
+                        {
+                            atomic_store(removed[w], static_cast<uint8_t>(1));
+                            local.push_back(w);
+                        }
+                        else if (old <= level) fetch_add(degree[w], static_cast<size_t>(1));
+                    });
+                }
+                #pragma omp critical
+                next.insert(next.end(), local.begin(), local.end());
+            }
+            bucket.swap(next);
+        }
+
+        remaining.erase(std::remove_if(remaining.begin(), remaining.end(),
+                                       [&](size_t v) { return removed[v] != 0; }), remaining.end());
+        ++level;
+    }
+    return core;
+}
+
+#define INSTANTIATE(fT, IndexT) \
+    template std::vector<size_t> SparseGraph<fT, IndexT>::core_numbers() const;
+SPARSE_ALL_TYPES(INSTANTIATE)
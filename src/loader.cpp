@@ -0,0 +1,427 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#include <cmath>
+#include <cctype>
+#include <string>
+#include <limits>
+#include <vector>
+#include <sstream>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "loader.hpp"
+#include "stats.hpp"
+#include "instantiate.hpp"
+
+/*
+ * Read-only memory mapping of a whole file
+*/
+class MappedFile {
+
+public:
+
+    MappedFile(std::string const & filename)
+        : m_addr(nullptr), m_size(0)
+    {
+        const int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("cannot open " + filename);
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            close(fd);
+            throw std::runtime_error("cannot open " + filename);
+        }
+        m_size = static_cast<size_t>(st.st_size);
+        if (m_size)
+        {
+            m_addr = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m_addr == MAP_FAILED)
+            {
+                close(fd);
+                throw std::runtime_error("cannot map " + filename);
+            }
+            madvise(m_addr, m_size, MADV_SEQUENTIAL);
+        }
+        close(fd);
+    }
+    MappedFile(MappedFile const &) = delete;
+    MappedFile & operator= (MappedFile const &) = delete;
+    ~MappedFile() { if (m_addr) munmap(m_addr, m_size); }
+
+    const char * begin() const { return static_cast<const char *>(m_addr); }
+    const char * end() const { return begin() + m_size; }
+
+private:
+
+    void * m_addr;
+    size_t m_size;
+
+};
+
+/*
+ * Edges parsed from one chunk of the file
+*/
+template<typename fT>
+struct EdgeChunk
+{
+    std::vector<size_t> src;
+    std::vector<size_t> dst;
+    std::vector<fT> value;
+    size_t max_id = 0;
+    bool failed = false;
+};
+
+/*
+ * Layout of the edge lines of a file
+ * base    : id of the first vertex, 1 for Matrix Market
+ * pattern : lines carry no value, every edge has weight one
+ * mirror  : add the reverse of every edge, scaled by mirror_sign
+*/
+struct EdgeFormat
+{
+    size_t base = 0;
+    bool pattern = false;
+    bool mirror = false;
+    double mirror_sign = 1.;
+    bool drop_self_loops = false;
+};
+
+static inline bool is_separator(char c)
+{
+    return c == ' ' || c == '\t' || c == ',' || c == '\r';
+}
+
+static inline const char * skip_separator(const char * p, const char * end)
+{
+    while (p < end && is_separator(*p)) ++p;
+    return p;
+}
+
+static inline const char * skip_line(const char * p, const char * end)
+{
+    const void * eol = std::memchr(p, '\n', static_cast<size_t>(end - p));
+    return eol ? static_cast<const char *>(eol) + 1 : end;
+}
+
+/*
+ * Parse an unsigned decimal integer
+ * @return position after the number, nullptr if there is no digit or the
+ *         number does not fit into size_t
+*/
+static inline const char * parse_index(const char * p, const char * end, size_t & value)
+{
+    const char * start = p;
+    size_t ret = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+        const size_t digit = static_cast<size_t>(*p - '0');
+        if (ret > (std::numeric_limits<size_t>::max() - digit) / 10) return nullptr;
+        ret = ret * 10 + digit;
+        ++p;
+    }
+    value = ret;
+    return p == start ? nullptr : p;
+}
+
+/*
+ * Parse a decimal floating point number
+ * Numbers with at most 19 significant digits and a decimal exponent of at
+ * most 22 are converted exactly from their integer mantissa, anything else
+ * falls back to strtod on a copy of the token.
+ * @return position after the number, nullptr if it is not a number
+*/
+static inline const char * parse_value(const char * p, const char * end, double & value)
+{
+    static const double power[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+    const char * start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) negative = *(p++) == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false, exact = true;
+    // Leading zeros are not counted as significant digits
+    for (; p < end && *p >= '0' && *p <= '9'; ++p, any = true)
+    {
+        if (digits < 19)
+        {
+            mantissa = mantissa * 10 + static_cast<uint64_t>(*p - '0');
+            digits += mantissa != 0;
+        }
+        else
+        {
+            ++exponent;
+            exact = false;
+        }
+    }
+    if (p < end && *p == '.')
+    {
+        for (++p; p < end && *p >= '0' && *p <= '9'; ++p, any = true)
+        {
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + static_cast<uint64_t>(*p - '0');
+                digits += mantissa != 0;
+                --exponent;
+            }
+            else
+                exact = false;
+        }
+    }
+    if (!any) return nullptr;
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        const char * q = p + 1;
+        bool exp_negative = false;
+        if (q < end && (*q == '-' || *q == '+')) exp_negative = *(q++) == '-';
+        size_t exp_value;
+        q = parse_index(q, end, exp_value);
+        if (!q) return nullptr;
+        exp_value = std::min<size_t>(exp_value, 100000);
+        exponent += exp_negative ? -static_cast<int>(exp_value) : static_cast<int>(exp_value);
+        p = q;
+    }
+
+    if (exact && mantissa < (static_cast<uint64_t>(1) << 53) && exponent >= -22 && exponent <= 22)
+    {
+        const double m = static_cast<double>(mantissa);
+        value = exponent < 0 ? m / power[-exponent] : m * power[exponent];
+        if (negative) value = -value;
+    }
+    else
+    {
+        const std::string token(start, p);
+        value = std::strtod(token.c_str(), nullptr);
+    }
+    return p;
+}
+
+/*
+ * Parse the edge lines of a chunk, the chunk starts at a line boundary
+*/
+template<typename fT>
+static void parse_chunk(const char * p, const char * end, EdgeFormat const & format, EdgeChunk<fT> & chunk)
+{
+    while (p < end)
+    {
+        p = skip_separator(p, end);
+        if (p == end) break;
+        if (*p == '\n') { ++p; continue; }
+        if (*p == '#' || *p == '%') { p = skip_line(p, end); continue; }
+
+        size_t src, dst;
+        double value = 1.;
+        p = parse_index(p, end, src);
+        if (p) p = parse_index(skip_separator(p, end), end, dst);
+        if (p && !format.pattern)
+        {
+            p = skip_separator(p, end);
+            if (p < end && *p != '\n' && *p != '#' && *p != '%')
+                p = parse_value(p, end, value);
+        }
+        if (!p || src < format.base || dst < format.base)
+        {
+            chunk.failed = true;
+            return;
+        }
+        // Extra columns such as timestamps are ignored
+        p = skip_line(p, end);
+
+        src -= format.base;
+        dst -= format.base;
+        if (format.drop_self_loops && src == dst) continue;
+
+        chunk.src.push_back(src);
+        chunk.dst.push_back(dst);
+        chunk.value.push_back(static_cast<fT>(value));
+        if (format.mirror && src != dst)
+        {
+            chunk.src.push_back(dst);
+            chunk.dst.push_back(src);
+            chunk.value.push_back(static_cast<fT>(format.mirror_sign * value));
+        }
+        chunk.max_id = std::max(chunk.max_id, std::max(src, dst));
+    }
+}
+
+/*
+ * Parse the edge lines of [begin, end) on all threads and build the matrix
+ * The region is cut into chunks at line boundaries, every chunk is parsed
+ * independently and the chunks are concatenated in file order.
+ * @param dim matrix dimension, zero to use the largest vertex id plus one
+*/
+template<typename fT, typename IndexT>
+static SparseMatrix<fT, IndexT> parse_edges(const char * begin, const char * end, EdgeFormat const & format,
+                                            GraphLoadOptions const & options, size_t dim, std::vector<size_t> & ids)
+{
+    SPARSE_STAT_SCOPE(load_edges, 0);
+#ifdef _OPENMP
+    const size_t nthread = static_cast<size_t>(omp_get_max_threads());
+#else
+    const size_t nthread = 1;
+#endif
+    const size_t size = static_cast<size_t>(end - begin);
+    const size_t min_chunk = static_cast<size_t>(1) << 20;
+    const size_t nchunk = std::max<size_t>(1, std::min(nthread * 8, size / min_chunk));
+
+    // Chunk boundaries, moved forward to the start of the next line
+    std::vector<const char *> bound(nchunk+1, end);
+    bound[0] = begin;
+    for(size_t i=1; i<nchunk; ++i)
+    {
+        const char * p = std::max(begin + size / nchunk * i, bound[i-1]);
+        bound[i] = (p == begin || p[-1] == '\n') ? p : skip_line(p, end);
+    }
+
+    std::vector<EdgeChunk<fT>> chunk(nchunk);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(size_t i=0; i<nchunk; ++i)
+        parse_chunk(bound[i], bound[i+1], format, chunk[i]);
+
+    // Concatenate the chunks in file order
+    std::vector<size_t> offset(nchunk+1, 0);
+    size_t max_id = 0;
+    for(size_t i=0; i<nchunk; ++i)
+    {
+        if (chunk[i].failed) throw std::runtime_error("malformed edge line");
+        offset[i+1] = offset[i] + chunk[i].src.size();
+        max_id = std::max(max_id, chunk[i].max_id);
+    }
+    const size_t nnz = offset[nchunk];
+    std::vector<size_t> src(nnz), dst(nnz);
+    std::vector<fT> value(nnz);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(size_t i=0; i<nchunk; ++i)
+    {
+        std::copy(chunk[i].src.begin(), chunk[i].src.end(), src.begin() + offset[i]);
+        std::copy(chunk[i].dst.begin(), chunk[i].dst.end(), dst.begin() + offset[i]);
+        std::copy(chunk[i].value.begin(), chunk[i].value.end(), value.begin() + offset[i]);
+        chunk[i] = EdgeChunk<fT>();
+    }
+
+    // Renumber the vertex ids which occur in the file
+    ids.clear();
+    if (options.remap_ids)
+    {
+        ids.reserve(2*nnz);
+        ids.insert(ids.end(), src.begin(), src.end());
+        ids.insert(ids.end(), dst.begin(), dst.end());
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+        #pragma omp parallel for
+        for(size_t i=0; i<nnz; ++i)
+        {
+            src[i] = static_cast<size_t>(std::lower_bound(ids.begin(), ids.end(), src[i]) - ids.begin());
+            dst[i] = static_cast<size_t>(std::lower_bound(ids.begin(), ids.end(), dst[i]) - ids.begin());
+        }
+        dim = ids.size();
+    }
+    else if (dim == 0)
+        dim = nnz ? max_id + 1 : 0;
+    else if (nnz && max_id >= dim)
+    {
+        throw std::out_of_range(
+            "the edge position is "
+            "outside of the matrix dimension");
+    }
+
+    SparseMatrixBuilder<fT, IndexT> builder(dim, dim, options.policy);
+    builder.add(src, dst, value);
+    return builder.build();
+}
+
+/*
+ * Read a Matrix Market coordinate file
+ * General, symmetric and skew-symmetric real, integer and pattern matrices
+ * are supported, symmetric files are expanded to both triangles.
+ * @param ids original id of every vertex when options.remap_ids is set
+*/
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> read_matrix_market(std::string filename, GraphLoadOptions const & options,
+                                            std::vector<size_t> & ids)
+{
+    MappedFile file(filename);
+    const char * p = file.begin();
+    const char * end = file.end();
+
+    // Banner line
+    const char * eol = skip_line(p, end);
+    std::istringstream banner(std::string(p, eol));
+    std::string tag, object, layout, field, symmetry;
+    banner >> tag >> object >> layout >> field >> symmetry;
+    for (std::string * s : {&object, &layout, &field, &symmetry})
+        std::transform(s->begin(), s->end(), s->begin(), ::tolower);
+    if (tag != "%%MatrixMarket" || object != "matrix")
+        throw std::runtime_error("not a Matrix Market file");
+    if (layout != "coordinate" || field == "complex")
+        throw std::runtime_error("only real, integer and pattern coordinate matrices are supported");
+
+    // Skip comments up to the size line
+    p = eol;
+    while (p < end && (*p == '%' || *p == '\n' || is_separator(*p)))
+        p = (*p == '%' || *p == '\n') ? skip_line(p, end) : skip_separator(p, end);
+    size_t nrow, ncol, nnz;
+    p = parse_index(p, end, nrow);
+    if (p) p = parse_index(skip_separator(p, end), end, ncol);
+    if (p) p = parse_index(skip_separator(p, end), end, nnz);
+    if (!p) throw std::runtime_error("malformed Matrix Market size line");
+    p = skip_line(p, end);
+    if (nrow != ncol && !options.remap_ids)
+    {
+        throw std::out_of_range(
+            "the Matrix Market matrix "
+            "is not square");
+    }
+
+    EdgeFormat format;
+    format.base = 1;
+    format.pattern = field == "pattern";
+    format.mirror = options.symmetrize || symmetry != "general";
+    format.mirror_sign = symmetry == "skew-symmetric" ? -1. : 1.;
+    format.drop_self_loops = options.drop_self_loops;
+
+    return parse_edges<fT, IndexT>(p, end, format, options, nrow, ids);
+}
+
+/*
+ * Read an edge list file
+ * Every line holds a source id, a destination id and an optional weight,
+ * separated by whitespace or commas. Ids start from zero, lines starting
+ * with '#' or '%' are comments and edges without weight get weight one.
+ * @param ids original id of every vertex when options.remap_ids is set
+*/
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> read_edge_list(std::string filename, GraphLoadOptions const & options,
+                                        std::vector<size_t> & ids)
+{
+    MappedFile file(filename);
+
+    EdgeFormat format;
+    format.mirror = options.symmetrize;
+    format.drop_self_loops = options.drop_self_loops;
+
+    return parse_edges<fT, IndexT>(file.begin(), file.end(), format, options, 0, ids);
+}
+
+#define INSTANTIATE(fT, IndexT) \
+    template SparseMatrix<fT, IndexT> read_matrix_market(std::string, GraphLoadOptions const &, \
+                                                         std::vector<size_t> &); \
+    template SparseMatrix<fT, IndexT> read_edge_list(std::string, GraphLoadOptions const &, \
+                                                     std::vector<size_t> &);
+SPARSE_ALL_TYPES(INSTANTIATE)
@@ -7,67 +7,860 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <limits>
+#include <optional>
+#include <variant>
+#include <exception>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
 #include "sparse.hpp"
+#include "format.hpp"
+#include "simd.hpp"
+#include "builder.hpp"
 #include "graph.hpp"
+#include "semiring.hpp"
+#include "thread_pool.hpp"
+#include "stats.hpp"
 
 namespace py = pybind11;
 
-PYBIND11_MODULE(_sparse, m) {
-    using Matrix = SparseMatrix<double>;
-    py::class_<Matrix>(m, "SparseMatrix", py::buffer_protocol())
+// Releases the GIL for the whole native call
+using release_gil = py::call_guard<py::gil_scoped_release>;
+
+/*
+ * Python name of a value and index type combination
+ * double with 64-bit indices keeps the plain name, the others get a
+ * suffix, e.g. SparseGraphF32 or SparseGraphF32Idx32
+*/
+template<typename fT, typename IndexT>
+static std::string class_name(std::string const & base)
+{
+    std::string ret = base;
+    if (std::is_same<fT, float>::value) ret += "F32";
+    if (std::is_same<fT, int32_t>::value) ret += "I32";
+    if (std::is_same<fT, bool>::value) ret += "Bool";
+    if (std::is_same<IndexT, uint32_t>::value) ret += "Idx32";
+    return ret;
+}
+
+/*
+ * Owner handle keeping a Python object alive from C++
+ * The last handle may go away on a thread without the GIL, so the deleter
+ * takes it before dropping the reference
+*/
+static std::shared_ptr<void const> python_owner(py::object obj)
+{
+    return std::shared_ptr<void const>(obj.release().ptr(), [](void const * p)
+    {
+        py::gil_scoped_acquire gil;
+        Py_DECREF(static_cast<PyObject *>(const_cast<void *>(p)));
+    });
+}
+
+/*
+ * Run f with the GIL released, so that other Python threads keep running
+ * during long native calls. f must not touch Python objects.
+*/
+template<typename Func>
+static auto without_gil(Func f)
+{
+    py::gil_scoped_release release;
+    return f();
+}
+
+template<typename T>
+static py::array_t<T> to_array(std::vector<T> const & other)
+{
+    return py::array_t<T>(other.size(), other.data());
+}
+
+// Workers of the *_async calls, created on first use and joined at exit
+static ThreadPool * async_pool = nullptr;
+
+static ThreadPool & worker_pool()
+{
+    if (!async_pool) async_pool = new ThreadPool();
+    return *async_pool;
+}
+
+/*
+ * Python exception for an exception of a job, mapped the same way as
+ * pybind11 maps them for synchronous calls. The caller holds the GIL.
+*/
+static py::object python_exception(std::exception_ptr error)
+{
+    auto make = [](PyObject * type, const char * what)
+    {
+        return py::reinterpret_borrow<py::object>(type)(what);
+    };
+    try
+    {
+        std::rethrow_exception(error);
+    }
+    catch (py::error_already_set & e) { return e.value(); }
+    catch (std::bad_alloc & e) { return make(PyExc_MemoryError, e.what()); }
+    catch (std::out_of_range & e) { return make(PyExc_IndexError, e.what()); }
+    catch (std::domain_error & e) { return make(PyExc_ValueError, e.what()); }
+    catch (std::invalid_argument & e) { return make(PyExc_ValueError, e.what()); }
+    catch (std::length_error & e) { return make(PyExc_ValueError, e.what()); }
+    catch (std::overflow_error & e) { return make(PyExc_OverflowError, e.what()); }
+    catch (std::exception & e) { return make(PyExc_RuntimeError, e.what()); }
+    catch (...) { return make(PyExc_RuntimeError, "unknown error"); }
+}
+
+/*
+ * Run compute on the worker pool and return a concurrent.futures.Future
+ * compute runs without the GIL, its result is handed to convert once the
+ * GIL is taken again. asyncio awaits the future through wrap_future.
+ * @param keep Python objects compute refers to, kept alive until it ends.
+ *             They must not be modified before the future is done.
+*/
+template<typename Func, typename Convert>
+static py::object run_async(py::object keep, Func compute, Convert convert)
+{
+    py::object future = py::module::import("concurrent.futures").attr("Future")();
+    std::shared_ptr<void const> owner = python_owner(keep);
+    std::shared_ptr<void const> handle = python_owner(future);
+    worker_pool().submit([owner, handle, compute, convert]()
+    {
+        py::handle fut(static_cast<PyObject *>(const_cast<void *>(handle.get())));
+        {
+            py::gil_scoped_acquire gil;
+            if (!fut.attr("set_running_or_notify_cancel")().cast<bool>()) return;
+        }
+
+        std::optional<decltype(compute())> ret;
+        std::exception_ptr error;
+        try
+        {
+            ret.emplace(compute());
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        py::gil_scoped_acquire gil;
+        try
+        {
+            if (!error)
+            {
+                fut.attr("set_result")(convert(std::move(*ret)));
+                return;
+            }
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        try
+        {
+            fut.attr("set_exception")(python_exception(error));
+        }
+        catch (py::error_already_set & e)
+        {
+            e.discard_as_unraisable("run_async");
+        }
+    });
+    return future;
+}
+
+/*
+ * Buffer over the elements of a one-dimensional NumPy array
+ * Contiguous arrays of a matching type are borrowed without a copy, where
+ * integers only need a matching width since the signed types SciPy uses
+ * hold the same bits. Other arrays are converted into an owned copy.
+*/
+template<typename T>
+static Buffer<T> array_buffer(py::array arr)
+{
+    if (!arr)
+    {
+        throw std::domain_error(
+            "the CSR arrays must "
+            "be numeric");
+    }
+    if (arr.ndim() != 1)
+    {
+        throw std::out_of_range(
+            "the CSR arrays must be "
+            "one-dimensional");
+    }
+    bool match = arr.dtype().is(py::dtype::of<T>());
+    if (std::is_integral<T>::value && !std::is_same<T, bool>::value)
+    {
+        const char kind = arr.dtype().kind();
+        match = (kind == 'i' || kind == 'u') && arr.itemsize() == static_cast<py::ssize_t>(sizeof(T));
+    }
+    if (match && (arr.flags() & py::array::c_style))
+    {
+        T const * ptr = static_cast<T const *>(arr.data());
+        const size_t size = static_cast<size_t>(arr.size());
+        return Buffer<T>::borrow(ptr, size, python_owner(arr));
+    }
+    auto copy = py::array_t<T, py::array::c_style | py::array::forcecast>::ensure(arr);
+    if (!copy)
+    {
+        throw std::domain_error(
+            "the CSR arrays must "
+            "be numeric");
+    }
+    Buffer<T> ret;
+    ret.assign(copy.data(), static_cast<size_t>(copy.size()));
+    return ret;
+}
+
+/*
+ * Read-only NumPy view of exported elements, see Buffer::share
+ * The view holds the owner handle, so it stays valid after the matrix is
+ * modified or destroyed
+*/
+template<typename T>
+static py::array shared_array(T const * ptr, size_t size, std::shared_ptr<void const> owner)
+{
+    py::capsule base(new std::shared_ptr<void const>(std::move(owner)), [](void * p)
+    {
+        delete static_cast<std::shared_ptr<void const> *>(p);
+    });
+    py::array_t<T> ret(size, ptr, base);
+    ret.attr("setflags")(py::arg("write")=false);
+    return ret;
+}
+
+/*
+ * Sparse matrix over the CSR arrays of NumPy, see array_buffer
+ * The arrays must not be modified while the matrix uses them. Rows which
+ * are unsorted, repeat a column or hold zeros cause a canonical copy.
+ * Bool matrices keep only the pattern and ignore data, the other value
+ * types require it.
+ * @param ncol number of columns, one past the largest column by default
+*/
+template<typename fT, typename IndexT>
+static SparseMatrix<fT, IndexT> matrix_from_csr(py::array indptr, py::array indices, py::object data,
+                                               py::object ncol)
+{
+    Buffer<size_t> index = array_buffer<size_t>(indptr);
+    Buffer<IndexT> columns = array_buffer<IndexT>(indices);
+    if (index.empty())
+    {
+        throw std::out_of_range(
+            "the row offsets need "
+            "at least one element");
+    }
+    size_t cols = 0;
+    if (!ncol.is_none())
+        cols = ncol.cast<size_t>();
+    else if (!columns.empty())
+    {
+        // Read through a const reference, borrowed columns must not be copied
+        const Buffer<IndexT> & view = columns;
+        cols = static_cast<size_t>(*std::max_element(view.begin(), view.end())) + 1;
+    }
+
+    ValueBuffer<fT> values;
+    if constexpr (is_pattern<fT>::value)
+        values = ValueBuffer<fT>(columns.size());
+    else
+    {
+        if (data.is_none())
+        {
+            throw std::invalid_argument(
+                "the values are required "
+                "unless the matrix is bool");
+        }
+        values = array_buffer<fT>(py::array::ensure(data));
+    }
+    SparseMatrix<fT, IndexT> ret(index.size()-1, cols, std::move(index), std::move(columns), std::move(values));
+    without_gil([&]() { ret.canonicalize(); });
+    return ret;
+}
+
+/*
+ * CSR arrays of a matrix as read-only NumPy views without a copy
+ * Offsets and columns come as the signed types SciPy expects. Bool
+ * matrices have no values and get a new array of ones.
+ * @return tuple of (indptr, indices, data)
+*/
+template<typename Mat>
+static py::tuple matrix_to_csr(Mat const & mat)
+{
+    using fT = typename Mat::value_type;
+    using IndexT = typename Mat::index_type;
+    using SignedIndex = typename std::make_signed<IndexT>::type;
+    std::shared_ptr<void const> index, indices, data;
+    mat.share(index, indices, data);
+
+    py::array ret_index = shared_array(reinterpret_cast<int64_t const *>(mat.index().data()),
+                                       mat.index().size(), index);
+    py::array ret_indices;
+    if (mat.ncol() <= static_cast<size_t>(std::numeric_limits<SignedIndex>::max()))
+        ret_indices = shared_array(reinterpret_cast<SignedIndex const *>(mat.indices().data()),
+                                   mat.nnz(), indices);
+    else
+        ret_indices = shared_array(mat.indices().data(), mat.nnz(), indices);
+    py::array ret_data;
+    if constexpr (is_pattern<fT>::value)
+    {
+        py::array_t<bool> ones(mat.nnz());
+        std::fill(ones.mutable_data(), ones.mutable_data() + mat.nnz(), true);
+        ret_data = ones;
+    }
+    else
+        ret_data = shared_array(mat.data().data(), mat.nnz(), data);
+    return py::make_tuple(ret_index, ret_indices, ret_data);
+}
+
+template<typename fT, typename IndexT>
+static SparseMatrix<fT, IndexT> matrix_from_scipy(py::object other)
+{
+    py::object csr = other.attr("tocsr")();
+    py::tuple shape = csr.attr("shape");
+    return matrix_from_csr<fT, IndexT>(py::array(csr.attr("indptr")), py::array(csr.attr("indices")),
+                                       csr.attr("data"), shape[1]);
+}
+
+/*
+ * SciPy csr_matrix over the exported arrays, see matrix_to_csr
+ * The arrays are assigned directly, since the constructor of SciPy may
+ * narrow the index type with a copy
+*/
+template<typename fT, typename IndexT>
+static py::object matrix_to_scipy(SparseMatrix<fT, IndexT> const & mat)
+{
+    py::tuple csr = matrix_to_csr(mat);
+    py::object ret = py::module::import("scipy.sparse").attr("csr_matrix")(
+        py::make_tuple(mat.nrow(), mat.ncol()), py::arg("dtype")=csr[2].attr("dtype"));
+    ret.attr("indptr") = csr[0];
+    ret.attr("indices") = csr[1];
+    ret.attr("data") = csr[2];
+    ret.attr("has_canonical_format") = true;
+    return ret;
+}
+
+template<typename fT, typename IndexT>
+static std::vector<fT> matrix_mxv(SparseMatrix<fT, IndexT> const & mat, std::vector<fT> const & x,
+                                  Semiring semiring, std::vector<bool> const & mask, bool complement)
+{
+    std::vector<fT> ret;
+    with_semiring<fT>(semiring, [&](auto s) {
+        mxv<decltype(s)>(ret, mat, x, mask, complement);
+    });
+    return ret;
+}
+
+// Products under min_plus and max_min come as a SemiringMatrix, see mxm
+template<typename fT, typename IndexT>
+using MatrixProduct = std::variant<SparseMatrix<fT, IndexT>, SemiringMatrix<fT, IndexT>>;
+
+template<typename fT, typename IndexT>
+static MatrixProduct<fT, IndexT> matrix_mxm(SparseMatrix<fT, IndexT> const & mat, SparseMatrix<fT, IndexT> const & other,
+                                            Semiring semiring, SparseMatrix<fT, IndexT> const * mask, bool complement)
+{
+    return with_semiring<fT>(semiring, [&](auto s) {
+        return MatrixProduct<fT, IndexT>(mxm<decltype(s)>(mat, other, mask, complement));
+    });
+}
+
+template<typename fT, typename IndexT>
+static void bind_matrix(py::module & m)
+{
+    using Matrix = SparseMatrix<fT, IndexT>;
+    py::class_<Matrix>(m, class_name<fT, IndexT>("SparseMatrix").c_str())
         .def(py::init<size_t, size_t, bool>(),
             py::arg("nrow")=1, py::arg("ncol")=1, py::arg("identity")=false
         )
         .def(py::init<Matrix&>())
-        .def(py::init<std::vector<std::vector<double>>&, size_t, size_t>())
-        .def("load", &Matrix::load)
-        .def("save", &Matrix::save)
-        .def("reset", &Matrix::reset)
+        .def(py::init<std::vector<std::vector<fT>>&, size_t, size_t>(), release_gil())
+        .def("load", &Matrix::load, release_gil())
+        .def("save", &Matrix::save, release_gil())
+        .def("load_binary", &Matrix::load_binary,
+            py::arg("filename"), py::arg("mmap")=false, release_gil()
+        )
+        .def("save_binary", &Matrix::save_binary, release_gil())
+        .def("reset", &Matrix::reset, release_gil())
         .def_property("nrow", &Matrix::nrow, nullptr)
         .def_property("ncol", &Matrix::ncol, nullptr)
-        .def("__eq__", &Matrix::operator==)
-        .def("__ne__", &Matrix::operator!=)
-        .def("assign", &Matrix::operator=)
-        .def(py::self += py::self)
-        .def(py::self + py::self)
-        .def(py::self -= py::self)
-        .def(py::self - py::self)
-        .def(py::self *= double())
-        .def(py::self * double())
-        .def(py::self * py::self)
-        .def(py::self * std::vector<double>())
-        .def(py::self /= double())
-        .def(py::self / double())
-        .def("__setitem__", [](Matrix &mat, std::pair<size_t, size_t> i, double v) {
+        .def("__eq__", &Matrix::operator==, release_gil())
+        .def("__ne__", &Matrix::operator!=, release_gil())
+        .def("assign", static_cast<Matrix & (Matrix::*)(const Matrix &)>(&Matrix::operator=), release_gil())
+        .def(py::self += py::self, release_gil())
+        .def("__add__", [](Matrix const & mat, Matrix const & other) { return Matrix(mat + other); },
+            release_gil())
+        .def(py::self -= py::self, release_gil())
+        .def("__sub__", [](Matrix const & mat, Matrix const & other) { return Matrix(mat - other); },
+            release_gil())
+        .def(py::self *= fT(), release_gil())
+        .def("__mul__", [](Matrix const & mat, fT alpha) { return Matrix(mat * alpha); }, release_gil())
+        .def("__mul__", [](Matrix const & mat, Matrix const & other) { return mat.multiply(other); },
+            release_gil())
+        .def(py::self * std::vector<fT>(), release_gil())
+        .def(py::self /= fT(), release_gil())
+        .def("__truediv__", [](Matrix const & mat, fT alpha) { return Matrix(mat / alpha); }, release_gil())
+        .def("transpose", &Matrix::transpose, release_gil())
+        .def("permute", &Matrix::permute, release_gil())
+        .def("mxv", &matrix_mxv<fT, IndexT>,
+            py::arg("x"), py::arg("semiring")=Semiring::plus_times,
+            py::arg("mask")=std::vector<bool>(), py::arg("complement")=false, release_gil())
+        .def("mxv_async", [](py::object self, std::vector<fT> const & x, Semiring semiring,
+                             std::vector<bool> const & mask, bool complement) {
+            Matrix & mat = self.cast<Matrix &>();
+            return run_async(self, [&mat, x, semiring, mask, complement]() {
+                return matrix_mxv(mat, x, semiring, mask, complement);
+            }, [](std::vector<fT> && ret) { return py::cast(ret); });
+        }, py::arg("x"), py::arg("semiring")=Semiring::plus_times,
+           py::arg("mask")=std::vector<bool>(), py::arg("complement")=false)
+        .def("vxm", [](Matrix &mat, std::vector<fT> const & x, Semiring semiring,
+                       std::vector<bool> const & mask, bool complement) {
+            std::vector<fT> ret;
+            with_semiring<fT>(semiring, [&](auto s) {
+                vxm<decltype(s)>(ret, x, mat, mask, complement);
+            });
+            return ret;
+        }, py::arg("x"), py::arg("semiring")=Semiring::plus_times,
+           py::arg("mask")=std::vector<bool>(), py::arg("complement")=false, release_gil())
+        .def("mxm", &matrix_mxm<fT, IndexT>,
+            py::arg("other"), py::arg("semiring")=Semiring::plus_times,
+            py::arg("mask")=nullptr, py::arg("complement")=false, release_gil())
+        .def("mxm_async", [](py::object self, py::object other, Semiring semiring, py::object mask,
+                             bool complement) {
+            Matrix & mat = self.cast<Matrix &>();
+            Matrix & mat2 = other.cast<Matrix &>();
+            Matrix * mask_mat = mask.is_none() ? nullptr : &mask.cast<Matrix &>();
+            return run_async(py::make_tuple(self, other, mask), [&mat, &mat2, semiring, mask_mat, complement]() {
+                return matrix_mxm(mat, mat2, semiring, mask_mat, complement);
+            }, [](MatrixProduct<fT, IndexT> && ret) { return py::cast(std::move(ret)); });
+        }, py::arg("other"), py::arg("semiring")=Semiring::plus_times,
+           py::arg("mask")=py::none(), py::arg("complement")=false)
+        .def("spmm", [](Matrix &mat, py::array_t<fT, py::array::c_style | py::array::forcecast> other) {
+            if(other.ndim() != 2 || static_cast<size_t>(other.shape(0)) != mat.ncol())
+                throw std::out_of_range(
+                    "the dimension of matrix column "
+                    "differs from that of block row");
+            const size_t k = static_cast<size_t>(other.shape(1));
+            py::array_t<fT> ret(std::vector<size_t>{mat.nrow(), k});
+            const fT * in = other.data();
+            fT * out = ret.mutable_data();
+            without_gil([&]() { mat.multiply(in, out, k); });
+            return ret;
+        })
+        .def("__setitem__", [](Matrix &mat, std::pair<size_t, size_t> i, fT v) {
             mat(i.first, i.second, v);
         })
         .def("__getitem__", [](Matrix &mat, std::pair<size_t, size_t> i) {
             return mat(i.first, i.second);
         })
-        .def("expand_row", &Matrix::expand_row)
-        .def("expand_col", &Matrix::expand_col)
-        .def("shrink_row", &Matrix::shrink_row)
-        .def("shrink_col", &Matrix::shrink_col);
+        .def_property("hash_threshold", &Matrix::hash_threshold, &Matrix::set_hash_threshold)
+        .def_property("format", &Matrix::format, &Matrix::set_format)
+        .def_property("active_format", [](Matrix const &mat) {
+            return without_gil([&]() { return mat.active_format(); });
+        }, nullptr)
+        .def("analyze", [](Matrix const &mat) {
+            const MatrixStructure structure = without_gil([&]() { return analyze_structure(mat); });
+            py::dict ret;
+            ret["mean_row"] = structure.mean_row;
+            ret["row_cv"] = structure.row_cv;
+            ret["max_row"] = structure.max_row;
+            ret["sell_fill"] = structure.sell_fill;
+            ret["block"] = structure.block;
+            ret["block_fill"] = structure.block_fill;
+            ret["format"] = structure.format;
+            return ret;
+        })
+        .def("expand_row", &Matrix::expand_row, py::arg("count")=1, release_gil())
+        .def("expand_col", &Matrix::expand_col, py::arg("count")=1, release_gil())
+        .def("shrink_row", &Matrix::shrink_row, py::arg("count")=1, release_gil())
+        .def("shrink_col", &Matrix::shrink_col, py::arg("count")=1, release_gil())
+        .def_static("from_csr", &matrix_from_csr<fT, IndexT>,
+            py::arg("indptr"), py::arg("indices"), py::arg("data")=py::none(), py::arg("ncol")=py::none()
+        )
+        .def("to_csr", &matrix_to_csr<Matrix>)
+        .def_static("from_scipy", &matrix_from_scipy<fT, IndexT>)
+        .def("to_scipy", &matrix_to_scipy<fT, IndexT>);
+
+    m.def("axpby", &axpby<fT, IndexT>,
+        py::arg("alpha"), py::arg("mat1"), py::arg("beta"), py::arg("mat2"), release_gil());
+    // Fused sum of scaled matrices, the counterpart of the lazy C++ sums
+    m.def("combine", [](std::vector<std::pair<fT, Matrix const *>> const & terms) {
+        std::vector<MatrixTerm<fT, IndexT>> ret;
+        for (auto const & term : terms)
+        {
+            if (!term.second) throw std::domain_error("every term needs a matrix");
+            ret.push_back({term.first, term.second});
+        }
+        return combine(ret);
+    }, py::arg("terms"), release_gil());
+}
+
+template<typename fT, typename IndexT>
+static void bind_builder(py::module & m)
+{
+    using Builder = SparseMatrixBuilder<fT, IndexT>;
+    py::class_<Builder>(m, class_name<fT, IndexT>("SparseMatrixBuilder").c_str())
+        .def(py::init<size_t, size_t, DuplicatePolicy>(),
+            py::arg("nrow")=1, py::arg("ncol")=1, py::arg("policy")=DuplicatePolicy::sum
+        )
+        .def("reserve", &Builder::reserve)
+        .def("clear", &Builder::clear)
+        .def("add", static_cast<void (Builder::*)(size_t, size_t, fT)>(&Builder::add))
+        .def("add", static_cast<void (Builder::*)(std::vector<size_t> const &, std::vector<size_t> const &,
+                                                  std::vector<fT> const &)>(&Builder::add), release_gil())
+        .def("build", &Builder::build, release_gil())
+        .def_property("nrow", &Builder::nrow, nullptr)
+        .def_property("ncol", &Builder::ncol, nullptr)
+        .def("__len__", &Builder::size);
+}
+
+template<typename fT, typename IndexT>
+static std::vector<fT> graph_mxv(SparseGraph<fT, IndexT> const & gra, std::vector<fT> const & x,
+                                 Semiring semiring, std::vector<bool> const & mask, bool complement)
+{
+    std::vector<fT> ret;
+    with_semiring<fT>(semiring, [&](auto s) {
+        mxv<decltype(s)>(ret, gra, x, mask, complement);
+    });
+    return ret;
+}
+
+static py::tuple bfs_tuple(BFSResult const & ret)
+{
+    return py::make_tuple(to_array(ret.parent), to_array(ret.depth));
+}
+
+template<typename fT>
+static py::tuple sssp_tuple(SSSPResult<fT> const & ret)
+{
+    return py::make_tuple(to_array(ret.dist), to_array(ret.pred));
+}
+
+static py::tuple component_tuple(ComponentResult const & ret)
+{
+    return py::make_tuple(to_array(ret.label), to_array(ret.size));
+}
 
-    using Graph = SparseGraph<double>;
-    py::class_<Graph>(m, "SparseGraph", py::buffer_protocol())
+static py::tuple triangle_tuple(TriangleResult const & ret)
+{
+    return py::make_tuple(ret.total, to_array(ret.count));
+}
+
+template<typename fT>
+static py::array_t<fT> pagerank_array(PageRankResult<fT> const & ret)
+{
+    return to_array(ret.rank);
+}
+
+// One column of scores per personalization
+template<typename fT>
+static py::array_t<fT> personalized_array(PageRankResult<fT> const & ret)
+{
+    const size_t dim = ret.count ? ret.rank.size() / ret.count : 0;
+    return py::array_t<fT>(std::vector<size_t>{dim, ret.count}, ret.rank.data());
+}
+
+/*
+ * Shortest paths need an ordered weight, PageRank a floating point score,
+ * so bool graphs get neither and int32_t graphs get no PageRank
+*/
+template<typename fT, typename IndexT>
+static void bind_graph(py::module & m)
+{
+    using Graph = SparseGraph<fT, IndexT>;
+    py::class_<Graph> cls(m, class_name<fT, IndexT>("SparseGraph").c_str());
+    cls
         .def(py::init<size_t, bool>(),
             py::arg("dim")=1, py::arg("identity")=false
         )
         .def(py::init<Graph&>())
-        .def(py::init<std::vector<std::vector<double>>&, size_t>())
-        .def("load", &Graph::load)
-        .def("save", &Graph::save)
-        .def("reset", &Graph::reset)
-        .def("__eq__", &Graph::operator==)
-        .def("add_node", &Graph::add_node)
-        .def("remove_node", &Graph::remove_node)
-        .def("__setitem__", [](Graph &gra, std::pair<size_t, size_t> i, double v) {
+        .def(py::init<std::vector<std::vector<fT>>&, size_t>(), release_gil())
+        .def(py::init<size_t, std::vector<size_t> const &, std::vector<size_t> const &,
+                      std::vector<fT> const &, DuplicatePolicy>(),
+            py::arg("dim"), py::arg("src"), py::arg("dst"), py::arg("weight"),
+            py::arg("policy")=DuplicatePolicy::sum, release_gil()
+        )
+        .def(py::init<size_t, std::vector<size_t> const &, std::vector<size_t> const &>(),
+            py::arg("dim"), py::arg("src"), py::arg("dst"), release_gil()
+        )
+        .def("load", &Graph::load, release_gil())
+        .def("save", &Graph::save, release_gil())
+        .def("load_binary", &Graph::load_binary,
+            py::arg("filename"), py::arg("mmap")=false, release_gil()
+        )
+        .def("save_binary", &Graph::save_binary, release_gil())
+        .def("load_mtx", [](Graph &gra, std::string filename, bool symmetrize, bool drop_self_loops,
+                            bool remap_ids, DuplicatePolicy policy) {
+            GraphLoadOptions options;
+            options.symmetrize = symmetrize;
+            options.drop_self_loops = drop_self_loops;
+            options.remap_ids = remap_ids;
+            options.policy = policy;
+            return to_array(without_gil([&]() { return gra.load_mtx(filename, options); }));
+        }, py::arg("filename"), py::arg("symmetrize")=false, py::arg("drop_self_loops")=false,
+           py::arg("remap_ids")=false, py::arg("policy")=DuplicatePolicy::max)
+        .def("load_edge_list", [](Graph &gra, std::string filename, bool symmetrize, bool drop_self_loops,
+                                  bool remap_ids, DuplicatePolicy policy) {
+            GraphLoadOptions options;
+            options.symmetrize = symmetrize;
+            options.drop_self_loops = drop_self_loops;
+            options.remap_ids = remap_ids;
+            options.policy = policy;
+            return to_array(without_gil([&]() { return gra.load_edge_list(filename, options); }));
+        }, py::arg("filename"), py::arg("symmetrize")=false, py::arg("drop_self_loops")=false,
+           py::arg("remap_ids")=false, py::arg("policy")=DuplicatePolicy::max)
+        .def("reset", &Graph::reset, release_gil())
+        .def("__eq__", &Graph::operator==, release_gil())
+        .def("assign", static_cast<Graph & (Graph::*)(const Graph &)>(&Graph::operator=), release_gil())
+        .def("add_node", &Graph::add_node, release_gil())
+        .def("remove_node", &Graph::remove_node, release_gil())
+        .def("add_nodes", &Graph::add_nodes, release_gil())
+        .def("permute", &Graph::permute, release_gil())
+        .def("reorder", [](Graph &gra, Ordering ordering) {
+            return to_array(without_gil([&]() { return gra.reorder(ordering); }));
+        })
+        .def("remove_nodes", [](Graph &gra, std::vector<size_t> const & ids) {
+            return to_array(without_gil([&]() { return gra.remove_nodes(ids); }));
+        })
+        .def("set_dynamic", [](Graph &gra, bool dynamic, size_t min_pending, double ratio, bool background,
+                               size_t read_lag) {
+            CompactionOptions options;
+            options.min_pending = min_pending;
+            options.ratio = ratio;
+            options.background = background;
+            options.read_lag = read_lag;
+            gra.set_dynamic(dynamic, options);
+        }, py::arg("dynamic")=true, py::arg("min_pending")=65536, py::arg("ratio")=0.05,
+           py::arg("background")=true, py::arg("read_lag")=0, release_gil())
+        .def_property("dynamic", &Graph::dynamic, nullptr)
+        .def_property("pending_updates", &Graph::pending_updates, nullptr)
+        .def("compact", &Graph::compact, release_gil())
+        .def("in_degree", &Graph::in_degree, release_gil())
+        .def("in_neighbors", [](Graph &gra, size_t node) {
+            return to_array(without_gil([&]() { return gra.in_neighbors(node); }));
+        })
+        .def("__setitem__", [](Graph &gra, std::pair<size_t, size_t> i, fT v) {
             gra(i.first, i.second, v);
         })
         .def("__getitem__", [](Graph &gra, std::pair<size_t, size_t> i) {
             return gra(i.first, i.second);
         })
-        .def("to_sparse_matrix", &Graph::to_sparse_matrix)
+        .def_property("hash_threshold", &Graph::hash_threshold, &Graph::set_hash_threshold)
+        .def("bfs", [](Graph &gra, size_t source) {
+            return bfs_tuple(without_gil([&]() { return gra.bfs(source); }));
+        }, py::arg("source"))
+        .def("bfs_async", [](py::object self, size_t source) {
+            Graph & gra = self.cast<Graph &>();
+            return run_async(self, [&gra, source]() { return gra.bfs(source); }, &bfs_tuple);
+        }, py::arg("source"))
+        .def("weakly_connected_components", [](Graph &gra) {
+            return component_tuple(without_gil([&]() { return gra.weakly_connected_components(); }));
+        })
+        .def("weakly_connected_components_async", [](py::object self) {
+            Graph & gra = self.cast<Graph &>();
+            return run_async(self, [&gra]() { return gra.weakly_connected_components(); }, &component_tuple);
+        })
+        .def("strongly_connected_components", [](Graph &gra) {
+            return component_tuple(without_gil([&]() { return gra.strongly_connected_components(); }));
+        })
+        .def("strongly_connected_components_async", [](py::object self) {
+            Graph & gra = self.cast<Graph &>();
+            return run_async(self, [&gra]() { return gra.strongly_connected_components(); }, &component_tuple);
+        })
+        .def("triangles", [](Graph &gra, bool per_node) {
+            return triangle_tuple(without_gil([&]() { return gra.triangles(per_node); }));
+        }, py::arg("per_node")=true)
+        .def("triangles_async", [](py::object self, bool per_node) {
+            Graph & gra = self.cast<Graph &>();
+            return run_async(self, [&gra, per_node]() { return gra.triangles(per_node); }, &triangle_tuple);
+        }, py::arg("per_node")=true)
+        .def("core_numbers", [](Graph &gra) {
+            return to_array(without_gil([&]() { return gra.core_numbers(); }));
+        })
+        .def("core_numbers_async", [](py::object self) {
+            Graph & gra = self.cast<Graph &>();
+            return run_async(self, [&gra]() { return gra.core_numbers(); },
+                             [](std::vector<size_t> const & ret) { return to_array(ret); });
+        })
+        .def("mxv", &graph_mxv<fT, IndexT>,
+            py::arg("x"), py::arg("semiring")=Semiring::plus_times,
+            py::arg("mask")=std::vector<bool>(), py::arg("complement")=false, release_gil())
+        .def("mxv_async", [](py::object self, std::vector<fT> const & x, Semiring semiring,
+                             std::vector<bool> const & mask, bool complement) {
+            Graph & gra = self.cast<Graph &>();
+            return run_async(self, [&gra, x, semiring, mask, complement]() {
+                return graph_mxv(gra, x, semiring, mask, complement);
+            }, [](std::vector<fT> && ret) { return py::cast(ret); });
+        }, py::arg("x"), py::arg("semiring")=Semiring::plus_times,
+           py::arg("mask")=std::vector<bool>(), py::arg("complement")=false)
+        .def("vxm", [](Graph &gra, std::vector<fT> const & x, Semiring semiring,
+                       std::vector<bool> const & mask, bool complement) {
+            std::vector<fT> ret;
+            with_semiring<fT>(semiring, [&](auto s) {
+                vxm<decltype(s)>(ret, x, gra, mask, complement);
+            });
+            return ret;
+        }, py::arg("x"), py::arg("semiring")=Semiring::plus_times,
+           py::arg("mask")=std::vector<bool>(), py::arg("complement")=false, release_gil())
+        .def("to_sparse_matrix", &Graph::to_sparse_matrix, release_gil())
+        .def_static("from_csr", [](py::array indptr, py::array indices, py::object data) {
+            const size_t dim = indptr.size() ? static_cast<size_t>(indptr.size()) - 1 : 0;
+            return Graph(matrix_from_csr<fT, IndexT>(indptr, indices, data, py::int_(dim)));
+        }, py::arg("indptr"), py::arg("indices"), py::arg("data")=py::none())
+        .def("to_csr", [](Graph &gra) {
+            return matrix_to_csr(*gra.adjacency_snapshot());
+        })
+        .def_static("from_scipy", [](py::object other) {
+            return Graph(matrix_from_scipy<fT, IndexT>(other));
+        })
+        .def("to_scipy", [](Graph &gra) {
+            return matrix_to_scipy(*gra.adjacency_snapshot());
+        })
         .def_property("dim", &Graph::dim, nullptr);
-}
\ No newline at end of file
+
+    if constexpr (!std::is_same<fT, bool>::value)
+    {
+        cls.def("sssp", [](Graph &gra, size_t source, fT delta, std::vector<size_t> const & targets) {
+            return sssp_tuple(without_gil([&]() { return gra.sssp(source, delta, targets); }));
+        }, py::arg("source"), py::arg("delta")=fT(), py::arg("targets")=std::vector<size_t>())
+        .def("sssp_async", [](py::object self, size_t source, fT delta, std::vector<size_t> const & targets) {
+            Graph & gra = self.cast<Graph &>();
+            return run_async(self, [&gra, source, delta, targets]() {
+                return gra.sssp(source, delta, targets);
+            }, &sssp_tuple<fT>);
+        }, py::arg("source"), py::arg("delta")=fT(), py::arg("targets")=std::vector<size_t>());
+    }
+
+    if constexpr (std::is_floating_point<fT>::value)
+    {
+        cls.def("pagerank", [](Graph &gra, fT damping, fT tolerance, size_t max_iter) {
+            return pagerank_array(without_gil([&]() { return gra.pagerank(damping, tolerance, max_iter); }));
+        }, py::arg("damping")=0.85, py::arg("tolerance")=1e-6, py::arg("max_iter")=100)
+        .def("pagerank_async", [](py::object self, fT damping, fT tolerance, size_t max_iter) {
+            Graph & gra = self.cast<Graph &>();
+            return run_async(self, [&gra, damping, tolerance, max_iter]() {
+                return gra.pagerank(damping, tolerance, max_iter);
+            }, &pagerank_array<fT>);
+        }, py::arg("damping")=0.85, py::arg("tolerance")=1e-6, py::arg("max_iter")=100)
+        .def("personalized_pagerank", [](Graph &gra, std::vector<std::vector<fT>> const & personalization,
+                                         fT damping, fT tolerance, size_t max_iter) {
+            return personalized_array(without_gil([&]() {
+                return gra.personalized_pagerank(personalization, damping, tolerance, max_iter);
+            }));
+        }, py::arg("personalization"), py::arg("damping")=0.85, py::arg("tolerance")=1e-6,
+           py::arg("max_iter")=100)
+        .def("personalized_pagerank_async", [](py::object self, std::vector<std::vector<fT>> const & personalization,
+                                               fT damping, fT tolerance, size_t max_iter) {
+            Graph & gra = self.cast<Graph &>();
+            return run_async(self, [&gra, personalization, damping, tolerance, max_iter]() {
+                return gra.personalized_pagerank(personalization, damping, tolerance, max_iter);
+            }, &personalized_array<fT>);
+        }, py::arg("personalization"), py::arg("damping")=0.85, py::arg("tolerance")=1e-6,
+           py::arg("max_iter")=100);
+    }
+}
+
+/*
+ * Read-only result of a matrix product under min_plus or max_min
+*/
+template<typename fT, typename IndexT>
+static void bind_semiring_matrix(py::module & m)
+{
+    using Product = SemiringMatrix<fT, IndexT>;
+    py::class_<Product>(m, class_name<fT, IndexT>("SemiringMatrix").c_str())
+        .def_property("nrow", &Product::nrow, nullptr)
+        .def_property("ncol", &Product::ncol, nullptr)
+        .def_property("nnz", &Product::nnz, nullptr)
+        .def_property("zero", &Product::zero, nullptr)
+        .def("__eq__", &Product::operator==, release_gil())
+        .def("__ne__", &Product::operator!=, release_gil())
+        .def("__getitem__", [](Product const &mat, std::pair<size_t, size_t> i) {
+            return mat(i.first, i.second);
+        })
+        .def("to_csr", &matrix_to_csr<Product>);
+}
+
+template<typename fT, typename IndexT>
+static void bind_all(py::module & m)
+{
+    bind_matrix<fT, IndexT>(m);
+    bind_semiring_matrix<fT, IndexT>(m);
+    bind_builder<fT, IndexT>(m);
+    bind_graph<fT, IndexT>(m);
+}
+
+PYBIND11_MODULE(_sparse, m) {
+    py::enum_<DuplicatePolicy>(m, "DuplicatePolicy")
+        .value("sum", DuplicatePolicy::sum)
+        .value("max", DuplicatePolicy::max)
+        .value("last", DuplicatePolicy::last);
+
+    py::enum_<Semiring>(m, "Semiring")
+        .value("plus_times", Semiring::plus_times)
+        .value("min_plus", Semiring::min_plus)
+        .value("max_min", Semiring::max_min)
+        .value("max_times", Semiring::max_times)
+        .value("or_and", Semiring::or_and);
+
+    py::enum_<Ordering>(m, "Ordering")
+        .value("rcm", Ordering::rcm)
+        .value("degree", Ordering::degree)
+        .value("community", Ordering::community);
+
+    py::enum_<Format>(m, "Format")
+        .value("csr", Format::csr)
+        .value("sell", Format::sell)
+        .value("bcsr", Format::bcsr)
+        .value("automatic", Format::automatic);
+
+    py::enum_<SimdLevel>(m, "SimdLevel")
+        .value("scalar", SimdLevel::scalar)
+        .value("avx2", SimdLevel::avx2)
+        .value("avx512", SimdLevel::avx512);
+
+    m.def("simd_level", &simd_level);
+    m.def("detected_simd_level", &detected_simd_level);
+    m.def("set_simd_level", &set_simd_level);
+
+    // Operation counters, all zero unless built with ENABLE_STATS
+    m.def("stats", []() {
+        Stats totals = stats();
+        py::dict ops, buffers;
+        for (auto const & op : totals.ops)
+        {
+            py::dict entry;
+            entry["calls"] = op.second.calls;
+            entry["time"] = static_cast<double>(op.second.nanoseconds) * 1e-9;
+            entry["nnz"] = op.second.nnz;
+            ops[py::str(op.first)] = entry;
+        }
+        for (auto const & buffer : totals.buffers)
+        {
+            py::dict entry;
+            entry["count"] = buffer.second.count;
+            entry["bytes"] = buffer.second.bytes;
+            buffers[py::str(buffer.first)] = entry;
+        }
+        py::dict ret;
+        ret["enabled"] = totals.enabled;
+        ret["ops"] = ops;
+        ret["buffers"] = buffers;
+        return ret;
+    });
+    m.def("reset_stats", &reset_stats);
+
+    // Finish the queued jobs while the interpreter is still alive
+    py::module::import("atexit").attr("register")(py::cpp_function([]() {
+        py::gil_scoped_release release;
+        delete async_pool;
+        async_pool = nullptr;
+    }));
+
+    bind_all<double, uint64_t>(m);
+    bind_all<float, uint64_t>(m);
+    bind_all<int32_t, uint64_t>(m);
+    bind_all<bool, uint64_t>(m);
+    bind_all<double, uint32_t>(m);
+    bind_all<float, uint32_t>(m);
+    bind_all<int32_t, uint32_t>(m);
+    bind_all<bool, uint32_t>(m);
+}
@@ -0,0 +1,194 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include "graph.hpp"
+#include "stats.hpp"
+#include "instantiate.hpp"
+
+/*
+ * Power iteration shared by plain and personalized PageRank
+ * Every sweep first scatters the score of each node into its share per
+ * out-edge, then every node pulls the shares over its in-edges. A node is
+ * only written by the thread which owns it, so no atomics are needed. The
+ * score of dangling nodes goes back to the teleport distribution.
+ * @param adj adjacency matrix, edge weights are ignored
+ * @param in_adj transposed adjacency matrix
+ * @param teleport nrow x ret.count block in row-major order, every column
+ *                 sums to one
+ * @param ret result holding the count, filled with the scores
+*/
+template<typename fT, typename IndexT>
+static void pagerank_sweep(SparseMatrix<fT, IndexT> const & adj, SparseMatrix<fT, IndexT> const & in_adj,
+                           std::vector<fT> const & teleport,
+                           fT damping, fT tolerance, size_t max_iter, PageRankResult<fT> & ret)
+{
+    SPARSE_STAT_SCOPE(pagerank, adj.nnz());
+    const size_t n = adj.nrow();
+    const size_t k = ret.count;
+    const size_t * index = adj.index().data();
+
+    const size_t * in_index = in_adj.index().data();
+    const IndexT * in_indices = in_adj.indices().data();
+
+    // Share of a node sent over each out-edge, zero for dangling nodes
+    std::vector<fT> inv_degree(n);
+    #pragma omp parallel for
+    for(size_t u=0; u<n; ++u)
+    {
+        const size_t degree = index[u+1] - index[u];
+        inv_degree[u] = degree ? static_cast<fT>(1) / static_cast<fT>(degree) : static_cast<fT>(0);
+    }
+
+    ret.rank = teleport;
+    ret.iterations = 0;
+    ret.error = 0;
+    if (k == 0) return;
+
+    std::vector<fT> contrib(n * k), dangling(k), base(k), error(k);
+    fT * rank = ret.rank.data();
+    fT * share = contrib.data();
+    const fT * tele = teleport.data();
+
+    while (ret.iterations < max_iter)
+    {
+        fT * dangling_sum = dangling.data();
+        std::fill(dangling.begin(), dangling.end(), static_cast<fT>(0));
+        #pragma omp parallel for reduction(+:dangling_sum[:k])
+        for(size_t u=0; u<n; ++u)
+        {
+            const fT * score = rank + u*k;
+            if (inv_degree[u] == 0)
+                for(size_t l=0; l<k; ++l) dangling_sum[l] += score[l];
+            else
+                for(size_t l=0; l<k; ++l) share[u*k+l] = score[l] * inv_degree[u];
+        }
+        for(size_t l=0; l<k; ++l)
+            base[l] = static_cast<fT>(1) - damping + damping * dangling[l];
+
+        fT * error_sum = error.data();
+        std::fill(error.begin(), error.end(), static_cast<fT>(0));
+        #pragma omp parallel reduction(+:error_sum[:k])
+        {
+            // Partial sums of the node under work, one block per thread
+            std::vector<fT> sum(k);
+            #pragma omp for schedule(dynamic, 256)
+            for(size_t v=0; v<n; ++v)
+            {
+                std::fill(sum.begin(), sum.end(), static_cast<fT>(0));
+                for(size_t j=in_index[v]; j<in_index[v+1]; ++j)
+                {
+                    const fT * other = share + in_indices[j]*k;
+                    #pragma omp simd
+                    for(size_t l=0; l<k; ++l) sum[l] += other[l];
+                }
+                for(size_t l=0; l<k; ++l)
+                {
+                    const fT next = tele[v*k+l] * base[l] + damping * sum[l];
+                    error_sum[l] += std::fabs(next - rank[v*k+l]);
+                    rank[v*k+l] = next;
+                }
+            }
+        }
+
+        ++ret.iterations;
+        ret.error = *std::max_element(error.begin(), error.end());
+        if (ret.error < tolerance) break;
+    }
+}
+
+static void validate_damping(double damping)
+{
+    if (!(damping >= 0 && damping <= 1))
+    {
+        throw std::domain_error(
+            "the damping factor must "
+            "be between zero and one");
+    }
+}
+
+/*
+ * PageRank with uniform teleport
+ * @param damping probability of following an out-edge
+ * @param tolerance stop once the L1 change of a sweep falls below it
+ * @param max_iter upper bound on the number of sweeps
+*/
+template<typename fT, typename IndexT>
+PageRankResult<fT> SparseGraph<fT, IndexT>::pagerank(fT damping, fT tolerance, size_t max_iter) const
+{
+    validate_damping(damping);
+    const size_t n = dim();
+
+    PageRankResult<fT> ret;
+    ret.count = 1;
+    std::vector<fT> teleport(n, static_cast<fT>(1) / static_cast<fT>(n));
+    std::shared_ptr<const SparseMatrix<fT, IndexT>> pinned, in_pinned;
+    snapshots(pinned, in_pinned);
+    pagerank_sweep(*pinned, *in_pinned, teleport, damping, tolerance, max_iter, ret);
+    return ret;
+}
+
+/*
+ * Personalized PageRank for several teleport vectors in one batched sweep
+ * Every in-edge is read once per sweep for all vectors together.
+ * @param personalization teleport weights of every node, one vector per
+ *                        score vector, scaled to sum to one
+ * @param damping probability of following an out-edge
+ * @param tolerance stop once the L1 change of every vector falls below it
+ * @param max_iter upper bound on the number of sweeps
+*/
+template<typename fT, typename IndexT>
+PageRankResult<fT> SparseGraph<fT, IndexT>::personalized_pagerank(std::vector<std::vector<fT>> const & personalization,
+                                                          fT damping, fT tolerance, size_t max_iter) const
+{
+    validate_damping(damping);
+    const size_t n = dim();
+    const size_t k = personalization.size();
+
+    // Transpose into a row-major block
+    std::vector<fT> teleport(n * k);
+    for(size_t l=0; l<k; ++l)
+    {
+        std::vector<fT> const & weight = personalization[l];
+        if (weight.size() != n)
+        {
+            throw std::out_of_range(
+                "the size of personalization vector "
+                "differs from that of graph dimension");
+        }
+        fT total = 0;
+        for (fT w : weight)
+        {
+            if (w < 0)
+            {
+                throw std::domain_error(
+                    "personalization weights "
+                    "must not be negative");
+            }
+            total += w;
+        }
+        if (total <= 0)
+        {
+            throw std::domain_error(
+                "personalization vector "
+                "has no positive weight");
+        }
+        for(size_t v=0; v<n; ++v) teleport[v*k+l] = weight[v] / total;
+    }
+
+    PageRankResult<fT> ret;
+    ret.count = k;
+    std::shared_ptr<const SparseMatrix<fT, IndexT>> pinned, in_pinned;
+    snapshots(pinned, in_pinned);
+    pagerank_sweep(*pinned, *in_pinned, teleport, damping, tolerance, max_iter, ret);
+    return ret;
+}
+
+#define INSTANTIATE(fT, IndexT) \
+    template PageRankResult<fT> SparseGraph<fT, IndexT>::pagerank(fT, fT, size_t) const; \
+    template PageRankResult<fT> SparseGraph<fT, IndexT>::personalized_pagerank( \
+        std::vector<std::vector<fT>> const &, fT, fT, size_t) const;
+SPARSE_FLOAT_TYPES(INSTANTIATE)
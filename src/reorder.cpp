@@ -0,0 +1,266 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
+
+#include "reorder.hpp"
+#include "atomic.hpp"
+#include "stats.hpp"
+#include "instantiate.hpp"
+
+/*
+ * Call f for every neighbor of u in the undirected pattern
+ * Out-edges come from adj, in-edges from in_adj unless both are the same
+*/
+template<typename fT, typename IndexT, typename Func>
+static inline void for_each_neighbor(SparseMatrix<fT, IndexT> const & adj, SparseMatrix<fT, IndexT> const & in_adj,
+                                     size_t u, Func f)
+{
+    const size_t * index = adj.index().data();
+    const IndexT * indices = adj.indices().data();
+    for(size_t j=index[u]; j<index[u+1]; ++j) f(indices[j]);
+    if (&adj == &in_adj) return;
+    index = in_adj.index().data();
+    indices = in_adj.indices().data();
+    for(size_t j=index[u]; j<index[u+1]; ++j) f(indices[j]);
+}
+
+template<typename fT, typename IndexT>
+static std::vector<size_t> undirected_degree(SparseMatrix<fT, IndexT> const & adj, SparseMatrix<fT, IndexT> const & in_adj)
+{
+    if (adj.nrow() != adj.ncol() || in_adj.nrow() != adj.nrow() || in_adj.ncol() != adj.ncol())
+    {
+        throw std::out_of_range(
+            "the orderings need a square matrix "
+            "and its transpose");
+    }
+    const size_t n = adj.nrow();
+    const size_t * index = adj.index().data();
+    const size_t * in_index = in_adj.index().data();
+    const bool symmetric = &adj == &in_adj;
+
+    std::vector<size_t> ret(n);
+    #pragma omp parallel for
+    for(size_t u=0; u<n; ++u)
+        ret[u] = index[u+1] - index[u] + (symmetric ? 0 : in_index[u+1] - in_index[u]);
+    return ret;
+}
+
+/*
+ * Reverse Cuthill-McKee ordering
+ * Every component starts from a pseudo-peripheral node, found by repeated
+ * breadth-first searches from the lowest degree node of the last level.
+ * Nodes are numbered in breadth-first order with the neighbors of a node
+ * in ascending degree, and the numbering is reversed at the end.
+*/
+template<typename fT, typename IndexT>
+std::vector<size_t> reverse_cuthill_mckee(SparseMatrix<fT, IndexT> const & adj, SparseMatrix<fT, IndexT> const & in_adj)
+{
+    const std::vector<size_t> degree = undirected_degree(adj, in_adj);
+    const size_t n = degree.size();
+    auto lower_degree = [&](size_t a, size_t b) { return degree[a] < degree[b]; };
+
+    // Components start at their lowest degree node
+    std::vector<size_t> by_degree(n);
+    std::iota(by_degree.begin(), by_degree.end(), 0);
+    std::stable_sort(by_degree.begin(), by_degree.end(), lower_degree);
+
+    // Searches for the peripheral node mark with a stamp instead of clearing
+    std::vector<size_t> stamp(n, 0);
+    size_t search = 0;
+    std::vector<size_t> queue;
+    queue.reserve(n);
+    auto last_level = [&](size_t root, size_t & levels) -> size_t
+    {
+        ++search;
+        queue.clear();
+        queue.push_back(root);
+        stamp[root] = search;
+        size_t begin = 0;
+        levels = 0;
+        size_t ret = root;
+        while (begin < queue.size())
+        {
+            const size_t end = queue.size();
+            ret = *std::min_element(queue.begin() + begin, queue.begin() + end, lower_degree);
+            for(size_t i=begin; i<end; ++i)
+            {
+                for_each_neighbor(adj, in_adj, queue[i], [&](size_t v)
+                {
+                    if (stamp[v] == search) return;
+                    stamp[v] = search;
+                    queue.push_back(v);
+                });
+            }
+            begin = end;
+            ++levels;
+        }
+        return ret;
+    };
+
+    std::vector<char> visited(n, 0);
+    std::vector<size_t> order, next;
+    order.reserve(n);
+    for (size_t root : by_degree)
+    {
+        if (visited[root]) continue;
+
+        size_t start = root, levels = 0;
+        size_t candidate = last_level(start, levels);
+        for(size_t it=0; it<5; ++it)
+        {
+            size_t candidate_levels = 0;
+            const size_t further = last_level(candidate, candidate_levels);
+            if (candidate_levels <= levels) break;
+            start = candidate;
+            levels = candidate_levels;
+            candidate = further;
+        }
+
+        // Cuthill-McKee numbering of the component
+        size_t head = order.size();
+        order.push_back(start);
+        visited[start] = 1;
+        for(; head<order.size(); ++head)
+        {
+            next.clear();
+            for_each_neighbor(adj, in_adj, order[head], [&](size_t v)
+            {
+                if (visited[v]) return;
+                visited[v] = 1;
+                next.push_back(v);
+            });
+            std::stable_sort(next.begin(), next.end(), lower_degree);
+            order.insert(order.end(), next.begin(), next.end());
+        }
+    }
+
+    std::vector<size_t> ret(n);
+    #pragma omp parallel for
+    for(size_t k=0; k<n; ++k) ret[order[k]] = n - 1 - k;
+    return ret;
+}
+
+/*
+ * Descending degree ordering
+ * Nodes of equal degree keep their relative order
+*/
+template<typename fT, typename IndexT>
+std::vector<size_t> degree_ordering(SparseMatrix<fT, IndexT> const & adj, SparseMatrix<fT, IndexT> const & in_adj)
+{
+    const std::vector<size_t> degree = undirected_degree(adj, in_adj);
+    const size_t n = degree.size();
+
+    std::vector<size_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+        [&](size_t a, size_t b) { return degree[a] > degree[b]; });
+
+    std::vector<size_t> ret(n);
+    #pragma omp parallel for
+    for(size_t k=0; k<n; ++k) ret[order[k]] = k;
+    return ret;
+}
+
+/*
+ * Community ordering by label propagation
+ * Every node starts in its own community and repeatedly joins the most
+ * frequent community among its neighbors, keeping its own on ties.
+ * Labels are updated in place by all threads, which converges faster than
+ * synchronous rounds. Communities are then numbered consecutively, nodes
+ * inside a community keep their relative order.
+ * @param iterations upper bound on the number of rounds
+*/
+template<typename fT, typename IndexT>
+std::vector<size_t> community_ordering(SparseMatrix<fT, IndexT> const & adj, SparseMatrix<fT, IndexT> const & in_adj,
+                                       size_t iterations)
+{
+    const std::vector<size_t> degree = undirected_degree(adj, in_adj);
+    const size_t n = degree.size();
+
+    std::vector<size_t> label(n);
+    std::iota(label.begin(), label.end(), 0);
+    size_t * labels = label.data();
+
+    for(size_t it=0; it<iterations; ++it)
+    {
+        size_t changed = 0;
+        #pragma omp parallel reduction(+:changed)
+        {
+            std::vector<size_t> seen;
+            #pragma omp for schedule(dynamic, 256)
+            for(size_t u=0; u<n; ++u)
+            {
+                seen.clear();
+                for_each_neighbor(adj, in_adj, u, [&](size_t v)
+                {
+                    if (v != u) seen.push_back(atomic_load(labels[v]));
+                });
+                if (seen.empty()) continue;
+                std::sort(seen.begin(), seen.end());
+
+                const size_t current = atomic_load(labels[u]);
+                size_t best = current, best_count = 0, current_count = 0;
+                for(size_t i=0, j=0; i<seen.size(); i=j)
+                {
+                    for(j=i; j<seen.size() && seen[j]==seen[i]; ++j);
+                    if (seen[i] == current) current_count = j - i;
+                    if (j - i > best_count)
+                    {
+                        best = seen[i];
+                        best_count = j - i;
+                    }
+                }
+                if (current_count < best_count)
+                {
+                    atomic_store(labels[u], best);
+                    ++changed;
+                }
+            }
+        }
+        if (!changed) break;
+    }
+
+    std::vector<size_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+        [&](size_t a, size_t b) { return label[a] < label[b]; });
+
+    std::vector<size_t> ret(n);
+    #pragma omp parallel for
+    for(size_t k=0; k<n; ++k) ret[order[k]] = k;
+    return ret;
+}
+
+/*
+ * Compute the specified ordering
+*/
+template<typename fT, typename IndexT>
+std::vector<size_t> compute_ordering(SparseMatrix<fT, IndexT> const & adj, SparseMatrix<fT, IndexT> const & in_adj,
+                                     Ordering ordering)
+{
+    SPARSE_STAT_SCOPE(reorder, adj.nnz());
+    switch (ordering)
+    {
+        case Ordering::rcm:
+            return reverse_cuthill_mckee(adj, in_adj);
+        case Ordering::degree:
+            return degree_ordering(adj, in_adj);
+        case Ordering::community:
+        default:
+            return community_ordering(adj, in_adj);
+    }
+}
+
+#define INSTANTIATE(fT, IndexT) \
+    template std::vector<size_t> reverse_cuthill_mckee(SparseMatrix<fT, IndexT> const &, \
+                                                       SparseMatrix<fT, IndexT> const &); \
+    template std::vector<size_t> degree_ordering(SparseMatrix<fT, IndexT> const &, \
+                                                 SparseMatrix<fT, IndexT> const &); \
+    template std::vector<size_t> community_ordering(SparseMatrix<fT, IndexT> const &, \
+                                                    SparseMatrix<fT, IndexT> const &, size_t); \
+    template std::vector<size_t> compute_ordering(SparseMatrix<fT, IndexT> const &, \
+                                                  SparseMatrix<fT, IndexT> const &, Ordering);
+SPARSE_ALL_TYPES(INSTANTIATE)
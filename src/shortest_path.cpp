@@ -0,0 +1,322 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#include <limits>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "graph.hpp"
+#include "atomic.hpp"
+#include "stats.hpp"
+#include "instantiate.hpp"
+
+// Most buckets held at once, farther nodes wait in an overflow bucket
+#define sssp_window_ 1024
+
+/*
+ * Single source shortest paths
+ * Allocates a new result, see the overload below
+*/
+template<typename fT, typename IndexT>
+SSSPResult<fT> SparseGraph<fT, IndexT>::sssp(size_t source, fT delta, std::vector<size_t> const & targets) const
+{
+    SSSPResult<fT> ret;
+    sssp(source, ret, delta, targets);
+    return ret;
+}
+
+/*
+ * Single source shortest paths with delta-stepping
+ * Nodes are kept in buckets of width delta by tentative distance. The
+ * lowest non-empty bucket is relaxed by all threads in parallel, each
+ * thread collecting improved nodes in its own buckets, until no bucket is
+ * left. Only a window of sssp_window_ buckets is held, nodes beyond it
+ * wait in an overflow bucket which refills the next window once the
+ * current one runs empty. Edge weights must not be negative.
+ * @param source node to start from
+ * @param ret result to fill, its arrays and scratch space are reused
+ * @param delta bucket width, zero picks the largest edge weight divided
+ *              by the average out-degree, at least one
+ * @param targets stop once the distance of all these nodes is final,
+ *                nodes farther away than every target are then reported
+ *                as unreached
+*/
+template<typename fT, typename IndexT>
+void SparseGraph<fT, IndexT>::sssp(size_t source, SSSPResult<fT> & ret, fT delta,
+                           std::vector<size_t> const & targets) const
+{
+    const size_t n = dim();
+    if (source >= n)
+    {
+        throw std::out_of_range(
+            "the source node is "
+            "outside of the graph");
+    }
+    for (size_t t : targets)
+    {
+        if (t >= n)
+        {
+            throw std::out_of_range(
+                "the target node is "
+                "outside of the graph");
+        }
+    }
+
+    const std::shared_ptr<const SparseMatrix<fT, IndexT>> pinned = kernel_snapshot();
+    const SparseMatrix<fT, IndexT> & adj = *pinned;
+    SPARSE_STAT_SCOPE(sssp, adj.nnz());
+    const size_t * index = adj.index().data();
+    const IndexT * indices = adj.indices().data();
+    const fT * data = adj.data().data();
+    const size_t nnz = adj.nnz();
+    const fT infinity = std::numeric_limits<fT>::has_infinity ?
+        std::numeric_limits<fT>::infinity() : std::numeric_limits<fT>::max();
+    const size_t max_bin = std::numeric_limits<size_t>::max() / 2;
+
+    if (!(delta >= 0))
+    {
+        throw std::domain_error(
+            "the bucket width of shortest "
+            "paths must not be negative");
+    }
+
+    if (delta == 0)
+    {
+        fT max_weight = 0;
+        #pragma omp parallel for reduction(max:max_weight)
+        for(size_t j=0; j<nnz; ++j) max_weight = std::max(max_weight, data[j]);
+        const fT degree = std::max(static_cast<fT>(1), static_cast<fT>(nnz) / static_cast<fT>(n));
+        delta = max_weight / degree;
+    }
+    // Integer widths truncate to zero for light edges
+    if (!(delta > 0)) delta = static_cast<fT>(1);
+
+    const size_t window = sssp_window_;
+    auto bucket = [delta](fT value) -> size_t
+    {
+        const fT ret = value / delta;
+        return ret < static_cast<fT>(max_bin - 1) ? static_cast<size_t>(ret) : max_bin - 1;
+    };
+
+    ret.dist.assign(n, infinity);
+    ret.pred.assign(n, -1);
+    ret.frontier.resize(std::max<size_t>(nnz, 1));
+#ifdef _OPENMP
+    const size_t nthread = static_cast<size_t>(omp_get_max_threads());
+#else
+    const size_t nthread = 1;
+#endif
+    ret.bins.resize(std::max<size_t>(ret.bins.size(), nthread));
+    ret.overflow.resize(std::max<size_t>(ret.overflow.size(), nthread));
+    for (auto & local : ret.bins)
+    {
+        local.resize(window);
+        for (auto & bin : local) bin.clear();
+    }
+    for (auto & local : ret.overflow) local.clear();
+
+    fT * dist = ret.dist.data();
+    dist[source] = 0;
+    ret.frontier[0] = source;
+
+    // Slots of the current and next iteration, swapped every iteration
+    size_t bin_index[2] = {0, max_bin};
+    size_t frontier_tail[2] = {1, 0};
+    // First bucket of the window and lowest bucket of the overflow
+    size_t base = 0;
+    size_t low = max_bin;
+    bool refill = false;
+    bool negative = false;
+
+    #pragma omp parallel reduction(||:negative)
+    {
+#ifdef _OPENMP
+        const size_t thread = static_cast<size_t>(omp_get_thread_num());
+#else
+        const size_t thread = 0;
+#endif
+        std::vector<std::vector<size_t>> & local_bins = ret.bins[thread];
+        std::vector<size_t> & local_overflow = ret.overflow[thread];
+        // Relax the out-edges of u into the local buckets
+        auto relax = [&](size_t u)
+        {
+            const fT from = atomic_load(dist[u]);
+            for(size_t j=index[u]; j<index[u+1]; ++j)
+            {
+                if (data[j] < 0) { negative = true; continue; }
+                const size_t v = indices[j];
+                const fT next = from + data[j];
+                if (write_min(dist[v], next))
+                {
+                    const size_t bin = bucket(next);
+                    if (bin - base < window) local_bins[bin % window].push_back(v);
+                    else local_overflow.push_back(v);
+                }
+            }
+        };
+
+        size_t iter = 0;
+        while (bin_index[iter&1] != max_bin)
+        {
+            size_t & curr_bin = bin_index[iter&1];
+            size_t & next_bin = bin_index[(iter+1)&1];
+            size_t & curr_tail = frontier_tail[iter&1];
+            size_t & next_tail = frontier_tail[(iter+1)&1];
+            const size_t curr = curr_bin;
+
+            // Nodes which were improved into a lower bucket are skipped
+            #pragma omp for nowait schedule(dynamic, 64)
+            for(size_t i=0; i<curr_tail; ++i)
+            {
+                const size_t u = ret.frontier[i];
+                if (bucket(atomic_load(dist[u])) >= curr) relax(u);
+            }
+
+            for(size_t i=curr; i<base+window; ++i)
+            {
+                if (!local_bins[i % window].empty())
+                {
+                    #pragma omp critical
+                    next_bin = std::min(next_bin, i);
+                    break;
+                }
+            }
+
+            #pragma omp barrier
+            #pragma omp single
+            {
+                curr_bin = max_bin;
+                curr_tail = 0;
+                bool settled = false;
+                // Distances below the next bucket are final
+                if (!targets.empty() && next_bin != max_bin)
+                {
+                    settled = true;
+                    for (size_t t : targets) settled = settled && bucket(dist[t]) < next_bin;
+                    if (settled) next_bin = max_bin;
+                }
+                refill = next_bin == max_bin && !settled;
+                low = max_bin;
+            }
+
+            // The window ran empty, the next one starts at the lowest
+            // overflow bucket, nodes settled meanwhile are dropped
+            if (refill)
+            {
+                const size_t end = base + window;
+                size_t local_low = max_bin;
+                for (size_t v : local_overflow)
+                {
+                    const size_t bin = bucket(atomic_load(dist[v]));
+                    if (bin >= end) local_low = std::min(local_low, bin);
+                }
+                #pragma omp critical
+                low = std::min(low, local_low);
+                #pragma omp barrier
+
+                size_t keep = 0;
+                for (size_t v : local_overflow)
+                {
+                    const size_t bin = bucket(atomic_load(dist[v]));
+                    if (bin < end) continue;
+                    if (bin - low < window) local_bins[bin % window].push_back(v);
+                    else local_overflow[keep++] = v;
+                }
+                local_overflow.resize(keep);
+                #pragma omp barrier
+                #pragma omp single
+                {
+                    base = low;
+                    next_bin = low;
+                }
+            }
+
+            // Claim a range of the next frontier, grow it if needed
+            size_t start = 0;
+            const bool has_next = next_bin != max_bin;
+            std::vector<size_t> & next_local = local_bins[has_next ? next_bin % window : 0];
+            if (has_next) start = fetch_add(next_tail, next_local.size());
+            #pragma omp barrier
+            #pragma omp single
+            if (next_tail > ret.frontier.size()) ret.frontier.resize(next_tail);
+
+            if (has_next)
+            {
+                std::copy(next_local.begin(), next_local.end(), ret.frontier.begin() + start);
+                next_local.clear();
+            }
+            ++iter;
+            #pragma omp barrier
+        }
+    }
+
+    if (negative)
+    {
+        throw std::domain_error(
+            "shortest paths need "
+            "non-negative edge weights");
+    }
+
+    // Nodes which were not settled before an early exit are unreached
+    if (!targets.empty())
+    {
+        fT bound = 0;
+        for (size_t t : targets) bound = std::max(bound, dist[t]);
+        #pragma omp parallel for
+        for(size_t v=0; v<n; ++v)
+            if (dist[v] > bound) dist[v] = infinity;
+    }
+
+    // Any in-edge which is tight with respect to the final distances and
+    // comes from a closer node is a valid predecessor
+    int64_t * pred = ret.pred.data();
+    bool ties = false;
+    #pragma omp parallel for schedule(dynamic, 256) reduction(||:ties)
+    for(size_t u=0; u<n; ++u)
+    {
+        if (dist[u] == infinity) continue;
+        for(size_t j=index[u]; j<index[u+1]; ++j)
+        {
+            const size_t v = indices[j];
+            if (v == source || dist[u] + data[j] != dist[v]) continue;
+            if (dist[u] < dist[v])
+                compare_and_swap(pred[v], static_cast<int64_t>(-1), static_cast<int64_t>(u));
+            else
+                ties = true;
+        }
+    }
+
+    // Rounding can make light edges tight between nodes of equal distance,
+    // these only pass on a path from nodes which already have one, so the
+    // predecessors never form a cycle
+    while (ties)
+    {
+        ties = false;
+        #pragma omp parallel for schedule(dynamic, 256) reduction(||:ties)
+        for(size_t u=0; u<n; ++u)
+        {
+            if (dist[u] == infinity || (u != source && atomic_load(pred[u]) < 0)) continue;
+            for(size_t j=index[u]; j<index[u+1]; ++j)
+            {
+                const size_t v = indices[j];
+                if (v == source || dist[u] != dist[v] || dist[u] + data[j] != dist[v]) continue;
+                if (atomic_load(pred[v]) < 0 &&
+                    compare_and_swap(pred[v], static_cast<int64_t>(-1), static_cast<int64_t>(u)))
+                {
+                    ties = true;
+                }
+            }
+        }
+    }
+}
+
+#define INSTANTIATE(fT, IndexT) \
+    template SSSPResult<fT> SparseGraph<fT, IndexT>::sssp(size_t, fT, std::vector<size_t> const &) const; \
+    template void SparseGraph<fT, IndexT>::sssp(size_t, SSSPResult<fT> &, fT, \
+                                                std::vector<size_t> const &) const;
+SPARSE_NUMERIC_TYPES(INSTANTIATE)
@@ -0,0 +1,51 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#include <atomic>
+#include <stdexcept>
+
+#include "simd.hpp"
+
+static SimdLevel detect()
+{
+#ifdef SPARSE_SIMD_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") &&
+        __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq"))
+        return SimdLevel::avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return SimdLevel::avx2;
+#endif
+    return SimdLevel::scalar;
+}
+
+static std::atomic<SimdLevel> & current_level()
+{
+    static std::atomic<SimdLevel> ret(detected_simd_level());
+    return ret;
+}
+
+SimdLevel detected_simd_level()
+{
+    static const SimdLevel ret = detect();
+    return ret;
+}
+
+SimdLevel simd_level()
+{
+    return current_level().load(std::memory_order_relaxed);
+}
+
+/*
+ * Lower the level of the kernels, for comparing them
+ * A level above the detected one cannot run on this CPU
+*/
+void set_simd_level(SimdLevel level)
+{
+    if (static_cast<int>(level) > static_cast<int>(detected_simd_level()))
+    {
+        throw std::domain_error(
+            "the CPU does not support "
+            "the requested instruction set");
+    }
+    current_level().store(level, std::memory_order_relaxed);
+}
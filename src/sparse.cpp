@@ -6,18 +6,105 @@
 #include <string>
 #include <sstream>
 #include <iterator>
+#include <utility>
 #include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <limits>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "sparse.hpp"
+#include "format.hpp"
+#include "simd.hpp"
+#include "stats.hpp"
+#include "instantiate.hpp"
+
+/*
+ * Product of the CSR rows [begin, end) with a vector
+ * Run through simd_select like the products of the other layouts
+*/
+template<typename fT, typename IndexT>
+struct CsrProduct
+{
+    const size_t * index;
+    const IndexT * indices;
+    const fT * data;
+    const fT * other;
+    fT * ret;
+
+    SPARSE_KERNEL void operator() (size_t begin, size_t end) const
+    {
+        for(size_t i=begin; i<end; ++i)
+        {
+            if constexpr (is_pattern<fT>::value)
+            {
+                // A pattern row is set once any of its columns is set
+                fT sum = false;
+                for(size_t j=index[i]; j<index[i+1] && !sum; ++j) sum = other[indices[j]];
+                ret[i] = sum;
+                continue;
+            }
+            fT sum = static_cast<fT>(0.);
+            #pragma omp simd reduction(+:sum)
+            for(size_t j=index[i]; j<index[i+1]; ++j)
+                sum += data[j] * other[indices[j]];
+            ret[i] = sum;
+        }
+    }
+};
+
+/*
+ * Product of the CSR rows [begin, end) with a row-major block of k vectors
+ * Every index and value load is shared by all k vectors
+*/
+template<typename fT, typename IndexT>
+struct CsrBlockProduct
+{
+    const size_t * index;
+    const IndexT * indices;
+    const fT * data;
+    const fT * other;
+    fT * ret;
+    size_t k;
+
+    SPARSE_KERNEL void operator() (size_t begin, size_t end) const
+    {
+        for(size_t i=begin; i<end; ++i)
+        {
+            fT * row = ret + i*k;
+            std::fill(row, row + k, static_cast<fT>(0.));
+            for(size_t j=index[i]; j<index[i+1]; ++j)
+            {
+                const fT value = is_pattern<fT>::value ? static_cast<fT>(1) : data[j];
+                const fT * other_row = other + indices[j]*k;
+                #pragma omp simd
+                for(size_t l=0; l<k; ++l)
+                    row[l] += value * other_row[l];
+            }
+        }
+    }
+};
 
 /**
  * Default Constructor
  * Setting the data into identity matrix with specified dimension
 **/
-template<typename fT>
-SparseMatrix<fT>::SparseMatrix(size_t nrow, size_t ncol, bool identity)
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT>::SparseMatrix(size_t nrow, size_t ncol, bool identity)
     : m_nrow(nrow), m_ncol(ncol)
 {
+    validate_dimension(m_nrow, m_ncol);
     reset(identity);
 }
 
@@ -25,77 +112,113 @@ SparseMatrix<fT>::SparseMatrix(size_t nrow, size_t ncol, bool identity)
  * Copy Contructor
  * Setting the data into copied object
 **/
-template<typename fT>
-SparseMatrix<fT>::SparseMatrix(SparseMatrix<fT> const & other)
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT>::SparseMatrix(SparseMatrix<fT, IndexT> const & other)
     : m_nrow(other.m_nrow), m_ncol(other.m_ncol),
-      m_index(other.m_index.size()),
-      m_indices(other.m_indices.size()),
-      m_data(other.m_data.size())
+      m_index(other.m_index),
+      m_indices(other.m_indices),
+      m_data(other.m_data),
+      m_hash_threshold(other.m_hash_threshold),
+      m_row_hash(other.m_row_hash),
+      m_format(other.m_format),
+      m_plan(std::atomic_load(&other.m_plan))
 {
-    m_index = other.m_index;
-    m_indices = other.m_indices;
-    m_data = other.m_data;
+    SPARSE_STAT_COUNT(copy, other.nnz());
 }
 
 /**
  * Move Constructor
  * Swapping data content of two matrix
 **/
-template<typename fT>
-SparseMatrix<fT>::SparseMatrix(SparseMatrix<fT> && other)
-    : m_nrow(other.m_nrow), m_ncol(other.m_ncol),
-      m_index(other.m_index.size()),
-      m_indices(other.m_indices.size()),
-      m_data(other.m_data.size())
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT>::SparseMatrix(SparseMatrix<fT, IndexT> && other)
+    : m_nrow(other.m_nrow), m_ncol(other.m_ncol)
 {
     other.m_index.swap(m_index);
     other.m_indices.swap(m_indices);
     other.m_data.swap(m_data);
+    std::swap(m_hash_threshold, other.m_hash_threshold);
+    other.m_row_hash.swap(m_row_hash);
+    std::swap(m_format, other.m_format);
+    m_plan.swap(other.m_plan);
 }
 
 /**
  * Copy Constuctor
  * Init Sparse Matrix with vector of vector
 **/
-template<typename fT>
-SparseMatrix<fT>::SparseMatrix(std::vector<std::vector<fT>> const & other, size_t nrow, size_t ncol)
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT>::SparseMatrix(std::vector<std::vector<fT>> const & other, size_t nrow, size_t ncol)
     : m_nrow(nrow), m_ncol(ncol)
 {
-    // Create the matrix with zero value at all location
-    reset(false);
+    validate_dimension(m_nrow, m_ncol);
+    m_index.reserve(m_nrow+1);
+    m_index.push_back(static_cast<size_t>(0));
 
+    // Scan every row once and append the non-zero elements in column order
     for(size_t i=0; i<m_nrow; ++i)
     {
         for(size_t j=0; j<m_ncol; ++j)
         {
-            // Set the value using the () operator
-            (*this)(i, j, other[i][j]);
+            if (fabs(other[i][j]) > eps_)
+            {
+                m_indices.push_back(j);
+                m_data.push_back(other[i][j]);
+            }
         }
+        m_index.push_back(m_indices.size());
+    }
+}
+
+/**
+ * Move Constuctor
+ * Init Sparse Matrix by taking over already built CSR arrays
+**/
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT>::SparseMatrix(size_t nrow, size_t ncol, Buffer<size_t> && index,
+                                       Buffer<IndexT> && indices, ValueBuffer<fT> && data)
+    : m_nrow(nrow), m_ncol(ncol),
+      m_index(std::move(index)),
+      m_indices(std::move(indices)),
+      m_data(std::move(data))
+{
+    validate_dimension(m_nrow, m_ncol);
+    // Read through a const reference, borrowed offsets must not be copied
+    const Buffer<size_t> & offsets = m_index;
+    if (offsets.size() != m_nrow+1 || m_indices.size() != m_data.size() ||
+        offsets.front() != 0 || offsets.back() != m_indices.size())
+    {
+        throw std::out_of_range(
+            "the CSR arrays do not "
+            "match the matrix dimension");
     }
 }
 
 /*
  * Load sparse matrix from text file
 */
-template<typename fT>
-void SparseMatrix<fT>::load(std::string filename)
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::load(std::string filename)
 {
+    SPARSE_STAT_SCOPE(load, 0);
     std::ifstream infile(filename);
 
     std::string temp_line;
+    size_t temp_index;
     fT temp_value;
 
     {
         std::getline(infile, temp_line);
         std::istringstream iss(temp_line);
-        while(iss >> temp_value) m_nrow = temp_value;
+        while(iss >> temp_index) m_nrow = temp_index;
     }
 
     {
         std::getline(infile, temp_line);
         std::istringstream iss(temp_line);
-        while(iss >> temp_value) m_ncol = temp_value;
+        while(iss >> temp_index) m_ncol = temp_index;
     }
+    validate_dimension(m_nrow, m_ncol);
 
     m_index.clear();
     m_indices.clear();
@@ -107,13 +230,13 @@ void SparseMatrix<fT>::load(std::string filename)
     {
         std::getline(infile, temp_line);
         std::istringstream iss(temp_line);
-        while(iss >> temp_value) m_index.push_back(temp_value);
+        while(iss >> temp_index) m_index.push_back(temp_index);
     }
 
     {
         std::getline(infile, temp_line);
         std::istringstream iss(temp_line);
-        while(iss >> temp_value) m_indices.push_back(temp_value);
+        while(iss >> temp_index) m_indices.push_back(temp_index);
     }
 
     {
@@ -121,41 +244,273 @@ void SparseMatrix<fT>::load(std::string filename)
         std::istringstream iss(temp_line);
         while(iss >> temp_value) m_data.push_back(temp_value);
     }
+
+    // Files written by older versions may hold unsorted rows
+    sort_rows();
+    rebuild_hash();
+    drop_format();
 }
 
 /*
  * Save sparse matrix from text file
 */
-template<typename fT>
-void SparseMatrix<fT>::save(std::string filename)
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::save(std::string filename) const
 {
+    SPARSE_STAT_SCOPE(save, nnz());
     std::ofstream outfile(filename);
 
-    outfile << m_nrow << std::endl;
-    outfile << m_ncol << std::endl;
+    outfile << m_nrow << '\n';
+    outfile << m_ncol << '\n';
     for(auto i = m_index.begin(); i != m_index.end(); ++i)
     {
         outfile << *i << " ";
     }
-    outfile << std::endl;
+    outfile << '\n';
     for(auto i = m_indices.begin(); i != m_indices.end(); ++i)
     {
         outfile << *i << " ";
     }
-    outfile << std::endl;
-    for(auto i = m_data.begin(); i != m_data.end(); ++i)
+    outfile << '\n';
+    // Patterns write their implicit ones to stay readable as weighted matrices
+    for(size_t j=0; j<m_data.size(); ++j)
     {
-        outfile << *i << " ";
+        outfile << m_data[j] << " ";
     }
-    outfile << std::endl;
+    outfile << '\n';
 }
 
+/*
+ * Header of the binary sparse matrix file
+ * The m_index, m_indices and m_data sections follow the header, each
+ * section starts at a 64-byte aligned offset from the start of the file
+*/
+struct BinaryHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t index_width;
+    uint32_t value_type;
+    uint64_t nrow;
+    uint64_t ncol;
+    uint64_t nnz;
+    uint64_t index_offset;
+    uint64_t indices_offset;
+    uint64_t data_offset;
+};
+
+static const char binary_magic_[8] = {'S', 'P', 'G', 'L', 'C', 'S', 'R', '\0'};
+static const uint32_t binary_version_ = 1;
+static const uint32_t binary_byte_order_ = 0x01020304;
 
 /*
- * Reset the content of matrix to initial state
+ * Code of the value type stored in the binary file
 */
 template<typename fT>
-void SparseMatrix<fT>::reset(bool identity)
+static uint32_t binary_value_type()
+{
+    if (std::is_same<fT, double>::value) return 1;
+    if (std::is_same<fT, float>::value) return 2;
+    if (std::is_same<fT, int32_t>::value) return 3;
+    if (std::is_same<fT, bool>::value) return 4;
+    return 0;
+}
+
+/*
+ * Bytes per element of the data section, patterns store no values
+*/
+template<typename fT>
+static uint64_t binary_value_size()
+{
+    return is_pattern<fT>::value ? 0 : sizeof(fT);
+}
+
+static uint64_t binary_align(uint64_t offset)
+{
+    return (offset + buffer_alignment_ - 1) / buffer_alignment_ * buffer_alignment_;
+}
+
+/*
+ * Whether count elements of width bytes starting at offset lie inside
+ * the file, without overflowing on hostile headers
+*/
+static bool binary_fits(uint64_t offset, uint64_t count, uint64_t width, uint64_t file_size)
+{
+    if (offset > file_size) return false;
+    return !width || count <= (file_size - offset) / width;
+}
+
+/*
+ * Check a binary header against the matrix type and the file size
+*/
+template<typename fT, typename IndexT>
+static void binary_validate(const BinaryHeader & header, uint64_t file_size)
+{
+    if (std::memcmp(header.magic, binary_magic_, sizeof(binary_magic_)) != 0 ||
+        header.version != binary_version_ ||
+        header.byte_order != binary_byte_order_)
+    {
+        throw std::runtime_error("not a binary sparse matrix file");
+    }
+    if (header.index_width != sizeof(IndexT) ||
+        header.value_type != binary_value_type<fT>())
+    {
+        throw std::runtime_error(
+            "the binary file index or value type "
+            "differs from that of the matrix");
+    }
+    if (header.index_offset % buffer_alignment_ ||
+        header.indices_offset % buffer_alignment_ ||
+        header.data_offset % buffer_alignment_ ||
+        header.nrow == std::numeric_limits<uint64_t>::max() ||
+        !binary_fits(header.index_offset, header.nrow+1, sizeof(size_t), file_size) ||
+        !binary_fits(header.indices_offset, header.nnz, sizeof(IndexT), file_size) ||
+        !binary_fits(header.data_offset, header.nnz, binary_value_size<fT>(), file_size))
+    {
+        throw std::runtime_error("the binary file is truncated");
+    }
+}
+
+/*
+ * Take over the arrays of a binary file once their content is checked
+ * Row offsets must start at zero, never decrease and end at nnz, and
+ * every column must lie inside the matrix, otherwise a corrupt file
+ * would lead to reads out of bounds
+*/
+template<typename fT, typename IndexT>
+static SparseMatrix<fT, IndexT> binary_matrix(const BinaryHeader & header, Buffer<size_t> && index,
+                                              Buffer<IndexT> && indices, ValueBuffer<fT> && data)
+{
+    try
+    {
+        SparseMatrix<fT, IndexT> ret(header.nrow, header.ncol, std::move(index), std::move(indices), std::move(data));
+        if (!ret.canonical()) ret.canonicalize();
+        return ret;
+    }
+    catch (std::out_of_range const &)
+    {
+        throw std::runtime_error("the binary file is corrupt");
+    }
+}
+
+/*
+ * Load sparse matrix from binary file
+ * @param filename path of the file written by save_binary
+ * @param map borrow the memory mapped file instead of reading a copy,
+ *            the arrays are copied only once the matrix is modified
+*/
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::load_binary(std::string filename, bool map)
+{
+    SPARSE_STAT_SCOPE(load_binary, 0);
+    BinaryHeader header;
+
+    if (!map)
+    {
+        std::ifstream infile(filename, std::ios::binary | std::ios::ate);
+        if (!infile) throw std::runtime_error("cannot open " + filename);
+        const uint64_t file_size = static_cast<uint64_t>(infile.tellg());
+        infile.seekg(0);
+        if (!infile.read(reinterpret_cast<char *>(&header), sizeof(header)))
+            throw std::runtime_error("not a binary sparse matrix file");
+        binary_validate<fT, IndexT>(header, file_size);
+
+        Buffer<size_t> index(header.nrow+1);
+        Buffer<IndexT> indices(header.nnz);
+        ValueBuffer<fT> data(header.nnz);
+        infile.seekg(header.index_offset);
+        infile.read(reinterpret_cast<char *>(index.data()), index.size() * sizeof(size_t));
+        infile.seekg(header.indices_offset);
+        infile.read(reinterpret_cast<char *>(indices.data()), indices.size() * sizeof(IndexT));
+        if constexpr (!pattern())
+        {
+            infile.seekg(header.data_offset);
+            infile.read(reinterpret_cast<char *>(data.data()), data.size() * sizeof(fT));
+        }
+        if (!infile) throw std::runtime_error("the binary file is truncated");
+
+        replace_content(binary_matrix<fT, IndexT>(header, std::move(index), std::move(indices), std::move(data)));
+        return;
+    }
+
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("cannot open " + filename);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(header))
+    {
+        close(fd);
+        throw std::runtime_error("not a binary sparse matrix file");
+    }
+    const size_t file_size = static_cast<size_t>(st.st_size);
+    void * addr = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) throw std::runtime_error("cannot map " + filename);
+
+    // The mapping is released once no buffer borrows from it anymore
+    std::shared_ptr<void const> owner(addr, [file_size](void const * p)
+    {
+        munmap(const_cast<void *>(p), file_size);
+    });
+    const char * base = static_cast<const char *>(addr);
+    std::memcpy(&header, base, sizeof(header));
+    binary_validate<fT, IndexT>(header, file_size);
+
+    replace_content(binary_matrix<fT, IndexT>(header,
+        Buffer<size_t>::borrow(reinterpret_cast<const size_t *>(base + header.index_offset),
+                               header.nrow+1, owner),
+        Buffer<IndexT>::borrow(reinterpret_cast<const IndexT *>(base + header.indices_offset),
+                               header.nnz, owner),
+        ValueBuffer<fT>::borrow(reinterpret_cast<const fT *>(base + header.data_offset),
+                                header.nnz, owner)));
+}
+
+/*
+ * Save sparse matrix to binary file
+*/
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::save_binary(std::string filename) const
+{
+    SPARSE_STAT_SCOPE(save_binary, nnz());
+    BinaryHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, binary_magic_, sizeof(binary_magic_));
+    header.version = binary_version_;
+    header.byte_order = binary_byte_order_;
+    header.index_width = sizeof(IndexT);
+    header.value_type = binary_value_type<fT>();
+    header.nrow = m_nrow;
+    header.ncol = m_ncol;
+    header.nnz = m_indices.size();
+    header.index_offset = binary_align(sizeof(header));
+    header.indices_offset = binary_align(header.index_offset + m_index.size() * sizeof(size_t));
+    header.data_offset = binary_align(header.indices_offset + m_indices.size() * sizeof(IndexT));
+
+    std::ofstream outfile(filename, std::ios::binary | std::ios::trunc);
+    if (!outfile) throw std::runtime_error("cannot open " + filename);
+
+    const char padding[buffer_alignment_] = {};
+    uint64_t offset = 0;
+    // Write a section after padding up to its aligned offset
+    auto write = [&](uint64_t start, const void * ptr, uint64_t bytes)
+    {
+        outfile.write(padding, static_cast<std::streamsize>(start - offset));
+        outfile.write(static_cast<const char *>(ptr), static_cast<std::streamsize>(bytes));
+        offset = start + bytes;
+    };
+    write(0, &header, sizeof(header));
+    write(header.index_offset, m_index.data(), m_index.size() * sizeof(size_t));
+    write(header.indices_offset, m_indices.data(), m_indices.size() * sizeof(IndexT));
+    write(header.data_offset, m_data.data(), m_data.size() * binary_value_size<fT>());
+
+    if (!outfile) throw std::runtime_error("cannot write " + filename);
+}
+
+/*
+ * Reset the content of matrix to initial state
+*/
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::reset(bool identity)
 {
     m_index.clear();
     m_indices.clear();
@@ -178,6 +533,9 @@ void SparseMatrix<fT>::reset(bool identity)
     else
         for(size_t i=0; i<=m_nrow; ++i)
             m_index.push_back(static_cast<size_t>(0));
+
+    rebuild_hash();
+    drop_format();
 }
 
 /*
@@ -186,9 +544,10 @@ void SparseMatrix<fT>::reset(bool identity)
  * @param ncol matrix column
  * @return value at the specified matrix row and column
 */
-template<typename fT>
-fT SparseMatrix<fT>::operator() (size_t nrow, size_t ncol) const
+template<typename fT, typename IndexT>
+fT SparseMatrix<fT, IndexT>::operator() (size_t nrow, size_t ncol) const
 {
+    SPARSE_STAT_COUNT(get, 0);
     const size_t j = findIndex(nrow, ncol);
     if (j < m_index.at(nrow+1))
         return m_data.at(j);
@@ -202,9 +561,10 @@ fT SparseMatrix<fT>::operator() (size_t nrow, size_t ncol) const
  * @param ncol matrix column
  * @return reference to the value at the specified matrix row and column
 */
-template<typename fT>
-void SparseMatrix<fT>::operator() (size_t nrow, size_t ncol, fT value)
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::operator() (size_t nrow, size_t ncol, fT value)
 {
+    SPARSE_STAT_COUNT(set, 0);
     const size_t j = findIndex(nrow, ncol);
     // If the location is found to be non-zero
     if(j < m_index.at(nrow+1))
@@ -212,12 +572,14 @@ void SparseMatrix<fT>::operator() (size_t nrow, size_t ncol, fT value)
         // If the data value is non-zero
         if (fabs(value) > eps_)
         {
-            m_data.at(j) = value;
+            if constexpr (!pattern()) m_data.data()[j] = value;
         }
         // If the data value is zero, then remove the existing entry
         else
         {
-            for(size_t i=nrow+1; i<=this->nrow(); ++i) --m_index.at(i);
+            SPARSE_STAT_COUNT(erase, nnz() - j);
+            size_t * index = m_index.data();
+            for(size_t i=nrow+1; i<=this->nrow(); ++i) --index[i];
             m_indices.erase(m_indices.begin() + j);
             m_data.erase(m_data.begin() + j);
         }
@@ -227,19 +589,29 @@ void SparseMatrix<fT>::operator() (size_t nrow, size_t ncol, fT value)
     {
         if (fabs(value) > eps_)
         {
-            for(size_t i=nrow+1; i<=this->nrow(); ++i) ++m_index.at(i);
-            m_indices.insert(m_indices.begin() + m_index.at(nrow + 1) - 1, ncol);
-            m_data.insert(m_data.begin() + m_index.at(nrow + 1) - 1, value);
+            // Insert at the position which keeps the row sorted by column
+            const size_t k = lowerIndex(nrow, ncol);
+            SPARSE_STAT_COUNT(insert, nnz() - k);
+            size_t * index = m_index.data();
+            for(size_t i=nrow+1; i<=this->nrow(); ++i) ++index[i];
+            m_indices.insert(m_indices.begin() + k, ncol);
+            m_data.insert(m_data.begin() + k, value);
         }
+        else
+            return;
     }
+
+    // Offsets inside the modified row have moved
+    if (m_hash_threshold) hash_row(nrow);
+    drop_format();
 }
 
 /*
  * Validate Multiplication
  * Calculate if the multiplication can be done
 */
-template<typename fT>
-void validate_multiplication(const SparseMatrix<fT> &mat1, const SparseMatrix<fT> &mat2)
+template<typename fT, typename IndexT>
+void validate_multiplication(const SparseMatrix<fT, IndexT> &mat1, const SparseMatrix<fT, IndexT> &mat2)
 {
     if (mat1.m_ncol != mat2.m_nrow)
     {
@@ -253,8 +625,8 @@ void validate_multiplication(const SparseMatrix<fT> &mat1, const SparseMatrix<fT
  * Check matrix size similarity
  * Calculate if the matrix size is the same
 */
-template<typename fT>
-void same_size(const SparseMatrix<fT> &mat1, const SparseMatrix<fT> &mat2)
+template<typename fT, typename IndexT>
+void same_size(const SparseMatrix<fT, IndexT> &mat1, const SparseMatrix<fT, IndexT> &mat2)
 {
     if (mat1.m_nrow != mat2.m_nrow || mat1.m_ncol != mat2.m_ncol)
     {
@@ -267,8 +639,8 @@ void same_size(const SparseMatrix<fT> &mat1, const SparseMatrix<fT> &mat2)
 /*
  * Equality Comparison
 */
-template<typename fT>
-bool SparseMatrix<fT>::operator== (SparseMatrix<fT> const & other)
+template<typename fT, typename IndexT>
+bool SparseMatrix<fT, IndexT>::operator== (SparseMatrix<fT, IndexT> const & other)
 {
     if (this == &other) return true;
     if (m_nrow != other.m_nrow || m_ncol != other.m_ncol) return false;
@@ -277,19 +649,21 @@ bool SparseMatrix<fT>::operator== (SparseMatrix<fT> const & other)
     if (m_data != other.m_data) return false;
     return true;
 }
-template<typename fT>
-bool SparseMatrix<fT>::operator!= (SparseMatrix<fT> const & other)
+template<typename fT, typename IndexT>
+bool SparseMatrix<fT, IndexT>::operator!= (SparseMatrix<fT, IndexT> const & other)
 {
     return !(*this == other);
 }
 
 /*
  * Assignment Operator
- * Creating deep copy object of the original
+ * Creating deep copy object of the original, along with its hash
+ * threshold and format like the copy constructor
 */
-template<typename fT>
-SparseMatrix<fT>& SparseMatrix<fT>::operator=(const SparseMatrix<fT>& other)
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT>& SparseMatrix<fT, IndexT>::operator=(const SparseMatrix<fT, IndexT>& other)
 {
+    SPARSE_STAT_SCOPE(copy, other.nnz());
     if (this != &other)
     {
         m_nrow = other.m_nrow;
@@ -297,226 +671,1121 @@ SparseMatrix<fT>& SparseMatrix<fT>::operator=(const SparseMatrix<fT>& other)
         m_index = other.m_index;
         m_indices = other.m_indices;
         m_data = other.m_data;
+        m_hash_threshold = other.m_hash_threshold;
+        m_row_hash = other.m_row_hash;
+        m_format = other.m_format;
+        m_plan = std::atomic_load(&other.m_plan);
+    }
+    return *this;
+}
+
+/*
+ * Move Assignment Operator
+ * Swapping data content and settings of two matrix
+*/
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT>& SparseMatrix<fT, IndexT>::operator=(SparseMatrix<fT, IndexT>&& other)
+{
+    if (this != &other)
+    {
+        std::swap(m_nrow, other.m_nrow);
+        std::swap(m_ncol, other.m_ncol);
+        m_index.swap(other.m_index);
+        m_indices.swap(other.m_indices);
+        m_data.swap(other.m_data);
+        std::swap(m_hash_threshold, other.m_hash_threshold);
+        m_row_hash.swap(other.m_row_hash);
+        std::swap(m_format, other.m_format);
+        m_plan.swap(other.m_plan);
     }
     return *this;
 }
 
+/*
+ * Take over the content of the other matrix
+ * Unlike the assignment the hash threshold and format of this matrix are
+ * kept, for the operations which compute a new content in place
+*/
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::replace_content(SparseMatrix<fT, IndexT> && other)
+{
+    m_nrow = other.m_nrow;
+    m_ncol = other.m_ncol;
+    m_index.swap(other.m_index);
+    m_indices.swap(other.m_indices);
+    m_data.swap(other.m_data);
+    rebuild_hash();
+    drop_format();
+}
+
 /*
  * Addition Operator
- * Return results of matrix addition
+ * Add other in place, see expression.hpp for the lazy operators
 */
-template<typename fT>
-SparseMatrix<fT>& SparseMatrix<fT>::operator+=(const SparseMatrix<fT>& other)
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT>& SparseMatrix<fT, IndexT>::operator+=(const SparseMatrix<fT, IndexT>& other)
 {
-    // Check dimension
-    same_size(*this, other);
+    replace_content(axpby(static_cast<fT>(1.), *this, static_cast<fT>(1.), other));
+    return *this;
+}
 
-    // Add new value where other matrix is not zero
-    for(size_t i=0; i<other.m_nrow; ++i)
-        for (size_t j=m_index.at(i); j<m_index.at(i+1); ++j)
-        {
-            // Use mutator function to update added value
-            if( fabs(m_data.at(j)) > eps_)
-                (*this)( i, j, (*this)(i, j) + other(i, j));
-        }
+/*
+ * Substraction Operator
+ * Substract other in place, see expression.hpp for the lazy operators
+*/
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT>& SparseMatrix<fT, IndexT>::operator-=(const SparseMatrix<fT, IndexT>& other)
+{
+    replace_content(axpby(static_cast<fT>(1.), *this, static_cast<fT>(-1.), other));
     return *this;
 }
-template<typename fT>
-SparseMatrix<fT> SparseMatrix<fT>::operator+(const SparseMatrix<fT>& other) const
+
+/*
+ * Scaled Addition
+ * Return alpha * mat1 + beta * mat2 computed in a single pass
+*/
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> axpby(fT alpha, const SparseMatrix<fT, IndexT> &mat1, fT beta, const SparseMatrix<fT, IndexT> &mat2)
 {
-    // New matrix to be returned
-    // Initialized with called class
-    SparseMatrix<fT> ret(*this);
-    ret += other;
+    same_size(mat1, mat2);
+    return combine<fT, IndexT>({{alpha, &mat1}, {beta, &mat2}});
+}
+
+// Stored elements of all terms of a sum
+template<typename fT, typename IndexT>
+static size_t terms_nnz(std::vector<MatrixTerm<fT, IndexT>> const & terms)
+{
+    size_t ret = 0;
+    for (auto const & term : terms) ret += term.matrix->nnz();
     return ret;
 }
 
 /*
- * Substraction Operator
- * Return results of matrix substraction
+ * Fused sum of scaled matrices
+ * Rows of all terms are merged with one pointer per term over their
+ * sorted columns, so the result holds the union of their sparsity
+ * patterns and no partial sum is ever stored. A counting pass sizes the
+ * rows, a second pass writes them in place.
+ * Patterns keep every column of a term whose scale is not zero.
+ * @param terms scaled matrices of the same dimension
 */
-template<typename fT>
-SparseMatrix<fT>& SparseMatrix<fT>::operator-=(const SparseMatrix<fT>& other)
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> combine(std::vector<MatrixTerm<fT, IndexT>> const & terms)
 {
-    // Check dimension
-    same_size(*this, other);
+    SPARSE_STAT_SCOPE(combine, terms_nnz(terms));
+    if (terms.empty())
+    {
+        throw std::out_of_range(
+            "a sum needs at least "
+            "one matrix");
+    }
+    const size_t nrow = terms[0].matrix->nrow(), ncol = terms[0].matrix->ncol();
+    for (auto const & term : terms) same_size(*terms[0].matrix, *term.matrix);
+    const size_t nterm = terms.size();
 
-    // Add new value where other matrix is not zero
-    for(size_t i=0; i<other.m_nrow; ++i)
-        for (size_t j=m_index.at(i); j<m_index.at(i+1); ++j)
+    // Merge a single row, calling emit for every non-zero result
+    auto merge = [&](size_t i, std::vector<size_t> & pos, auto emit)
+    {
+        for(size_t t=0; t<nterm; ++t) pos[t] = terms[t].matrix->index()[i];
+        for (;;)
         {
-            // Use mutator function to update substracted value
-            if( fabs(m_data.at(j)) > eps_)
-                (*this)( i, j, (*this)(i, j) - other(i, j));
+            size_t col = std::numeric_limits<size_t>::max();
+            for(size_t t=0; t<nterm; ++t)
+            {
+                SparseMatrix<fT, IndexT> const & mat = *terms[t].matrix;
+                if (pos[t] < mat.index()[i+1]) col = std::min<size_t>(col, mat.indices()[pos[t]]);
+            }
+            if (col == std::numeric_limits<size_t>::max()) break;
+
+            fT value = 0;
+            bool stored = false;
+            for(size_t t=0; t<nterm; ++t)
+            {
+                SparseMatrix<fT, IndexT> const & mat = *terms[t].matrix;
+                if (pos[t] == mat.index()[i+1] || mat.indices()[pos[t]] != col) continue;
+                if constexpr (is_pattern<fT>::value)
+                    stored = stored || terms[t].scale;
+                else
+                    value += terms[t].scale * mat.data()[pos[t]];
+                ++pos[t];
+            }
+            if (is_pattern<fT>::value ? stored : fabs(value) > eps_) emit(col, value);
         }
-    return *this;
+    };
+
+    // Count the merged length of every row
+    Buffer<size_t> index(nrow+1, 0);
+    #pragma omp parallel
+    {
+        std::vector<size_t> pos(nterm);
+        #pragma omp for schedule(dynamic, 256)
+        for(size_t i=0; i<nrow; ++i)
+        {
+            size_t count = 0;
+            merge(i, pos, [&](size_t, fT) { ++count; });
+            index[i+1] = count;
+        }
+    }
+    for(size_t i=0; i<nrow; ++i) index[i+1] += index[i];
+
+    // Merge again, writing directly into the final position
+    Buffer<IndexT> indices(index[nrow]);
+    ValueBuffer<fT> data(index[nrow]);
+    #pragma omp parallel
+    {
+        std::vector<size_t> pos(nterm);
+        #pragma omp for schedule(dynamic, 256)
+        for(size_t i=0; i<nrow; ++i)
+        {
+            size_t out = index[i];
+            merge(i, pos, [&](size_t col, fT value)
+            {
+                indices[out] = static_cast<IndexT>(col);
+                if constexpr (!is_pattern<fT>::value) data[out] = value;
+                ++out;
+            });
+        }
+    }
+
+    return SparseMatrix<fT, IndexT>(nrow, ncol, std::move(index), std::move(indices), std::move(data));
 }
-template<typename fT>
-SparseMatrix<fT> SparseMatrix<fT>::operator-(const SparseMatrix<fT>& other) const
+
+/*
+ * Fused product of a sum of scaled matrices with dense vectors
+ * ret = sum of scale * matrix * vector over the terms, every term brings
+ * its own vector. A single parallel pass over the rows covers all terms.
+ * Patterns combine with or and and instead, as in multiply.
+ * @param terms scaled matrices with the same number of rows
+ * @param ret dense vector of size nrow, overwritten with the sum
+*/
+template<typename fT, typename IndexT>
+void combine_multiply(std::vector<MatrixTerm<fT, IndexT>> const & terms, fT * ret)
 {
-    // New matrix to be returned
-    // Initialized with called class
-    SparseMatrix<fT> ret(*this);
-    ret -= other;
-    return ret;
+    SPARSE_STAT_SCOPE(combine_multiply, terms_nnz(terms));
+    if (terms.empty()) return;
+    const size_t nrow = terms[0].matrix->nrow();
+    for (auto const & term : terms)
+    {
+        if (term.matrix->nrow() != nrow)
+        {
+            throw std::out_of_range(
+                "the dimension of first matrix "
+                "differs from that of second matrix");
+        }
+    }
+
+    #pragma omp parallel for schedule(dynamic, 256)
+    for(size_t i=0; i<nrow; ++i)
+    {
+        fT sum = 0;
+        for (auto const & term : terms)
+        {
+            const size_t * index = term.matrix->index().data();
+            const IndexT * indices = term.matrix->indices().data();
+            const fT * x = term.vector;
+            if constexpr (is_pattern<fT>::value)
+            {
+                if (!term.scale) continue;
+                for(size_t j=index[i]; j<index[i+1] && !sum; ++j) sum = x[indices[j]];
+            }
+            else
+            {
+                const fT * data = term.matrix->data().data();
+                fT dot = 0;
+                for(size_t j=index[i]; j<index[i+1]; ++j) dot += data[j] * x[indices[j]];
+                sum += term.scale * dot;
+            }
+        }
+        ret[i] = sum;
+    }
 }
 
 /*
  * Multiplication Operator
- * Return results of matrix multiplication
+ * Scale in place, see expression.hpp for the lazy operators
 */
-template<typename fT>
-SparseMatrix<fT>& SparseMatrix<fT>::operator*=(fT alpha) 
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT>& SparseMatrix<fT, IndexT>::operator*=(fT alpha) 
 {
+    SPARSE_STAT_SCOPE(scale, nnz());
+    // A pattern only changes when every element becomes zero
+    if constexpr (pattern())
+    {
+        if (!(fabs(alpha) > eps_)) reset(false);
+    }
     // Multiply element array by alpha
-    for (size_t i=0; i < m_data.size(); ++i) m_data.at(i) *= alpha;
+    else
+    {
+        fT * data = m_data.data();
+        for (size_t i=0; i < m_data.size(); ++i) data[i] *= alpha;
+    }
+    drop_format();
     return *this;
 }
-template<typename fT>
-SparseMatrix<fT> SparseMatrix<fT>::operator*(fT alpha) const
+
+/*
+ * Sparse matrix multiplication
+ * Two-pass Gustavson product, the lazy operator * of expression.hpp
+ * calls this once both operands are matrices
+*/
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> SparseMatrix<fT, IndexT>::multiply(const SparseMatrix<fT, IndexT>& other) const
 {
+    SPARSE_STAT_SCOPE(multiply, nnz() + other.nnz());
+    // Check dimension
+    validate_multiplication(*this, other);
+
     // New matrix to be returned
-    // Initialized with called class
-    SparseMatrix<fT> ret(*this);
-    ret *= alpha;
+    // Initialized with correct dimension
+    SparseMatrix<fT, IndexT> ret(m_nrow, other.m_ncol);
+    const size_t unset = static_cast<size_t>(-1);
+
+    // Symbolic pass
+    // Count distinct output columns of every row with a dense marker,
+    // the marker remembers the last row which touched the column
+    #pragma omp parallel
+    {
+        std::vector<size_t> marker(ret.m_ncol, unset);
+
+        #pragma omp for schedule(dynamic, 64)
+        for(size_t i=0; i<m_nrow; ++i)
+        {
+            size_t count = 0;
+            for(size_t j=m_index[i]; j<m_index[i+1]; ++j)
+            {
+                const size_t k = m_indices[j];
+                for(size_t l=other.m_index[k]; l<other.m_index[k+1]; ++l)
+                {
+                    const size_t col = other.m_indices[l];
+                    if(marker[col] != i)
+                    {
+                        marker[col] = i;
+                        ++count;
+                    }
+                }
+            }
+            ret.m_index[i+1] = count;
+        }
+    }
+
+    // Turn row counts into row offsets
+    for(size_t i=0; i<m_nrow; ++i) ret.m_index[i+1] += ret.m_index[i];
+    ret.m_indices.resize(ret.m_index[m_nrow]);
+    ret.m_data.resize(ret.m_index[m_nrow]);
+
+    // Numeric pass
+    // Accumulate every row into a dense accumulator, then scatter the
+    // touched columns back in sorted order into the preallocated slice
+    bool cancelled = false;
+    #pragma omp parallel reduction(||:cancelled)
+    {
+        std::vector<size_t> marker(ret.m_ncol, unset);
+        // Patterns only need the sorted columns, not the products
+        Buffer<fT> accumulator(pattern() ? 0 : ret.m_ncol, static_cast<fT>(0.));
+
+        #pragma omp for schedule(dynamic, 64)
+        for(size_t i=0; i<m_nrow; ++i)
+        {
+            size_t pos = ret.m_index[i];
+            for(size_t j=m_index[i]; j<m_index[i+1]; ++j)
+            {
+                const size_t k = m_indices[j];
+                const fT value = m_data[j];
+                for(size_t l=other.m_index[k]; l<other.m_index[k+1]; ++l)
+                {
+                    const size_t col = other.m_indices[l];
+                    if(marker[col] != i)
+                    {
+                        marker[col] = i;
+                        if constexpr (!pattern()) accumulator[col] = value * other.m_data[l];
+                        ret.m_indices[pos++] = col;
+                    }
+                    else if constexpr (!pattern())
+                        accumulator[col] += value * other.m_data[l];
+                }
+            }
+
+            std::sort(ret.m_indices.begin() + ret.m_index[i],
+                      ret.m_indices.begin() + ret.m_index[i+1]);
+            if constexpr (!pattern())
+            {
+                for(size_t j=ret.m_index[i]; j<ret.m_index[i+1]; ++j)
+                {
+                    ret.m_data[j] = accumulator[ret.m_indices[j]];
+                    if(fabs(ret.m_data[j]) <= eps_) cancelled = true;
+                }
+            }
+        }
+    }
+
+    // Products may cancel out to zero, those entries are not kept
+    if(cancelled)
+    {
+        size_t pos = 0;
+        size_t start = 0;
+        for(size_t i=0; i<ret.m_nrow; ++i)
+        {
+            const size_t end = ret.m_index[i+1];
+            for(size_t j=start; j<end; ++j)
+            {
+                if(fabs(ret.m_data[j]) > eps_)
+                {
+                    ret.m_indices[pos] = ret.m_indices[j];
+                    if constexpr (!pattern()) ret.m_data[pos] = ret.m_data[j];
+                    ++pos;
+                }
+            }
+            start = end;
+            ret.m_index[i+1] = pos;
+        }
+        ret.m_indices.resize(pos);
+        ret.m_data.resize(pos);
+    }
+
     return ret;
 }
-template<typename fT>
-SparseMatrix<fT> SparseMatrix<fT>::operator* (const SparseMatrix<fT>& other) const
+template<typename fT, typename IndexT>
+std::vector<fT> SparseMatrix<fT, IndexT>::operator* (const std::vector<fT> & other) const
 {
-    // New matrix to be returned
-    // Initialized with correct dimension
-    SparseMatrix<fT> ret(m_nrow, other.m_ncol);
+    // New vector to be returned
+    std::vector<fT> ret(m_nrow);
+    multiply(other, ret);
+    return ret;
+}
+
+/*
+ * Sparse matrix vector multiplication into caller provided buffer
+ * @param other dense vector of size ncol
+ * @param ret dense vector of size nrow, overwritten with the product
+*/
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::multiply(const std::vector<fT> & other, std::vector<fT> & ret) const
+{
+    if (m_ncol != other.size())
+    {
+        throw std::out_of_range(
+            "the dimension of first matrix column "
+            "differs from that of vector size");
+    }
+    ret.resize(m_nrow);
+    if constexpr (std::is_same<fT, bool>::value)
+    {
+        // std::vector<bool> is bit packed, go through plain arrays
+        Buffer<fT> input(m_ncol), output(m_nrow);
+        std::copy(other.begin(), other.end(), input.begin());
+        multiply(input.data(), output.data());
+        std::copy(output.begin(), output.end(), ret.begin());
+    }
+    else
+        multiply(other.data(), ret.data());
+}
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::multiply(const fT * other, fT * ret) const
+{
+    SPARSE_STAT_SCOPE(multiply_vector, nnz());
+    if constexpr (!pattern())
+    {
+        if (m_format != Format::csr)
+        {
+            const std::shared_ptr<const FormatPlan<fT, IndexT>> plan = format_plan();
+            if (plan->sell) return plan->sell->multiply(other, ret);
+            if (plan->block) return plan->block->multiply(other, ret);
+        }
+    }
+    const CsrProduct<fT, IndexT> kernel{m_index.data(), m_indices.data(), m_data.data(), other, ret};
+    const SimdCall<CsrProduct<fT, IndexT>> call = simd_select<CsrProduct<fT, IndexT>>();
+
+    // Rows are split by their number of elements, not handed out in batches
+    #pragma omp parallel
+    {
+        size_t begin, end;
+        thread_rows(begin, end);
+        call(kernel, begin, end);
+    }
+}
+
+/*
+ * Choose the layout of the matrix vector products
+ * Any other layout than csr is converted from the matrix on the first
+ * product after every change. Pattern matrices always multiply in CSR.
+*/
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::set_format(Format format)
+{
+    m_format = format;
+    drop_format();
+}
+
+/*
+ * Layout the products run on, automatic resolved to the one picked by
+ * analyze_structure
+*/
+template<typename fT, typename IndexT>
+Format SparseMatrix<fT, IndexT>::active_format() const
+{
+    if (pattern() || m_format == Format::csr) return Format::csr;
+    return format_plan()->format;
+}
 
-    for(size_t i=0; i<ret.m_nrow; ++i)
-        for(size_t k=0; k<ret.m_ncol; ++k)
-            for(size_t j=0; j<m_ncol; ++j)
-                ret(i, k, ret(i, k) + ((*this)(i,j) * other(j,k)));
+/*
+ * Converted layout of the current content
+ * Concurrent products may both convert, the plans are identical and the
+ * last one is kept
+*/
+template<typename fT, typename IndexT>
+std::shared_ptr<const FormatPlan<fT, IndexT>> SparseMatrix<fT, IndexT>::format_plan() const
+{
+    std::shared_ptr<const FormatPlan<fT, IndexT>> ret = std::atomic_load(&m_plan);
+    if constexpr (!pattern())
+    {
+        if (!ret)
+        {
+            ret = make_format_plan(*this, m_format);
+            std::atomic_store(&m_plan, ret);
+        }
+    }
     return ret;
 }
-template<typename fT>
-std::vector<fT> SparseMatrix<fT>::operator* (const std::vector<fT> other) const
+
+/*
+ * Sparse matrix multiple vector multiplication into caller provided buffer
+ * @param other dense row-major block of ncol x k
+ * @param ret dense row-major block of nrow x k, overwritten with the product
+ * @param k number of vectors in the block
+*/
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::multiply(const fT * other, fT * ret, size_t k) const
 {
-    // New vector to be returned
-    std::vector<fT> ret;
+    SPARSE_STAT_SCOPE(multiply_block, nnz());
+    if constexpr (!pattern())
+    {
+        if (m_format != Format::csr)
+        {
+            const std::shared_ptr<const FormatPlan<fT, IndexT>> plan = format_plan();
+            if (plan->sell) return plan->sell->multiply(other, ret, k);
+            if (plan->block) return plan->block->multiply(other, ret, k);
+        }
+    }
+    const CsrBlockProduct<fT, IndexT> kernel{m_index.data(), m_indices.data(), m_data.data(), other, ret, k};
+    const SimdCall<CsrBlockProduct<fT, IndexT>> call = simd_select<CsrBlockProduct<fT, IndexT>>();
+
+    #pragma omp parallel
+    {
+        size_t begin, end;
+        thread_rows(begin, end);
+        call(kernel, begin, end);
+    }
+}
+
+/*
+ * Transpose
+ * Return the transposed matrix, built with a counting sort over columns.
+ * Every thread counts the columns of its own block of rows, so the scatter
+ * gets a private cursor per thread and column, needs no atomics and keeps
+ * the output rows sorted. Shared atomic counters are used instead when the
+ * per-thread counters would outgrow the matrix itself.
+*/
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> SparseMatrix<fT, IndexT>::transpose() const
+{
+    SPARSE_STAT_SCOPE(transpose, nnz());
+    const size_t nnz = m_indices.size();
+    const size_t * index = m_index.data();
+    const IndexT * indices = m_indices.data();
+    const fT * data = m_data.data();
+
+    Buffer<size_t> ret_index(m_ncol+1, 0);
+    Buffer<IndexT> ret_indices(nnz);
+    ValueBuffer<fT> ret_data(nnz);
+    size_t * count = ret_index.data();
+    IndexT * out_indices = ret_indices.data();
+    fT * out_data = ret_data.data();
 
-    if(m_ncol == other.size())
-        for(size_t i = 0; i < m_nrow; ++i)
+    std::vector<size_t> cursor;
+    bool blocked = true;
+    #pragma omp parallel
+    {
+#ifdef _OPENMP
+        const size_t nthread = static_cast<size_t>(omp_get_num_threads());
+        const size_t tid = static_cast<size_t>(omp_get_thread_num());
+#else
+        const size_t nthread = 1;
+        const size_t tid = 0;
+#endif
+        #pragma omp single
         {
-            fT sum = static_cast<fT>(0.);
-            for(size_t j = m_index.at(i); j < m_index.at(i+1); ++j)
-                sum += other.at(m_indices.at(j)) * m_data.at(j);
+            blocked = nthread * m_ncol <= nnz + m_ncol;
+            if (blocked) cursor.assign(nthread * m_ncol, 0);
         }
-    else
+
+        if (blocked)
+        {
+            size_t begin, end;
+            thread_rows(begin, end);
+            size_t * local = cursor.data() + tid * m_ncol;
+            for(size_t j=index[begin]; j<index[end]; ++j) ++local[indices[j]];
+            #pragma omp barrier
+
+            // Column c of a thread starts behind column c of all lower threads
+            #pragma omp for
+            for(size_t c=0; c<m_ncol; ++c)
+            {
+                size_t total = 0;
+                for(size_t t=0; t<nthread; ++t)
+                {
+                    const size_t value = cursor[t * m_ncol + c];
+                    cursor[t * m_ncol + c] = total;
+                    total += value;
+                }
+                count[c+1] = total;
+            }
+            #pragma omp single
+            for(size_t c=0; c<m_ncol; ++c) count[c+1] += count[c];
+
+            for(size_t i=begin; i<end; ++i)
+            {
+                for(size_t j=index[i]; j<index[i+1]; ++j)
+                {
+                    const size_t pos = count[indices[j]] + local[indices[j]]++;
+                    out_indices[pos] = static_cast<IndexT>(i);
+                    if constexpr (!pattern()) out_data[pos] = data[j];
+                }
+            }
+        }
+    }
+
+    if (!blocked)
     {
-        throw std::out_of_range(
-            "the dimension of first matrix column"
-            "differs from that of vector size");
+        #pragma omp parallel for
+        for(size_t j=0; j<nnz; ++j)
+        {
+            #pragma omp atomic
+            ++count[indices[j]+1];
+        }
+        for(size_t i=0; i<m_ncol; ++i) count[i+1] += count[i];
+
+        // Scatter every element into its column, rows are sorted afterwards
+        cursor.assign(ret_index.begin(), ret_index.end()-1);
+        #pragma omp parallel for schedule(dynamic, 256)
+        for(size_t i=0; i<m_nrow; ++i)
+        {
+            for(size_t j=index[i]; j<index[i+1]; ++j)
+            {
+                size_t pos;
+                #pragma omp atomic capture
+                pos = cursor[indices[j]]++;
+                out_indices[pos] = static_cast<IndexT>(i);
+                if constexpr (!pattern()) out_data[pos] = data[j];
+            }
+        }
     }
 
+    SparseMatrix<fT, IndexT> ret(m_ncol, m_nrow, std::move(ret_index), std::move(ret_indices), std::move(ret_data));
+    if (!blocked) ret.sort_rows();
     return ret;
 }
 
+/*
+ * Symmetric permutation
+ * Element (i, j) moves to (perm[i], perm[j]). Rows are first placed in
+ * their new order with renamed columns, then sorted by transposing twice,
+ * since the counting sort leaves every output row sorted. All passes are
+ * parallel and linear in the number of elements.
+ * @param perm new index of every row and column
+ * @return permuted matrix
+*/
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT> SparseMatrix<fT, IndexT>::permute(std::vector<size_t> const & perm) const
+{
+    SPARSE_STAT_SCOPE(permute, nnz());
+    if (m_nrow != m_ncol || perm.size() != m_nrow)
+    {
+        throw std::out_of_range(
+            "the permutation size differs "
+            "from that of square matrix");
+    }
+    const size_t n = m_nrow;
+
+    // Original row of every new row
+    std::vector<size_t> inverse(n, n);
+    for(size_t i=0; i<n; ++i)
+    {
+        if (perm[i] >= n || inverse[perm[i]] != n)
+        {
+            throw std::out_of_range(
+                "the permutation does not "
+                "hold every index once");
+        }
+        inverse[perm[i]] = i;
+    }
+
+    const size_t * index = m_index.data();
+    const IndexT * indices = m_indices.data();
+    const fT * data = m_data.data();
+
+    Buffer<size_t> ret_index(n+1, 0);
+    size_t * count = ret_index.data();
+    #pragma omp parallel for
+    for(size_t r=0; r<n; ++r) count[r+1] = index[inverse[r]+1] - index[inverse[r]];
+    for(size_t r=0; r<n; ++r) count[r+1] += count[r];
+
+    Buffer<IndexT> ret_indices(m_indices.size());
+    ValueBuffer<fT> ret_data(m_data.size());
+    IndexT * out_indices = ret_indices.data();
+    fT * out_data = ret_data.data();
+    #pragma omp parallel for schedule(dynamic, 256)
+    for(size_t r=0; r<n; ++r)
+    {
+        const size_t i = inverse[r];
+        size_t pos = count[r];
+        for(size_t j=index[i]; j<index[i+1]; ++j, ++pos)
+        {
+            out_indices[pos] = static_cast<IndexT>(perm[indices[j]]);
+            if constexpr (!pattern()) out_data[pos] = data[j];
+        }
+    }
+
+    SparseMatrix<fT, IndexT> ret(n, n, std::move(ret_index), std::move(ret_indices), std::move(ret_data));
+    return ret.transpose().transpose();
+}
+
 /*
  * Division Operator
- * Return results of matrix division
+ * Divide in place, see expression.hpp for the lazy operators
 */
-template<typename fT>
-SparseMatrix<fT>& SparseMatrix<fT>::operator/=(fT alpha) 
+template<typename fT, typename IndexT>
+SparseMatrix<fT, IndexT>& SparseMatrix<fT, IndexT>::operator/=(fT alpha) 
 {
-    // Divide element array by alpha
-    for (size_t i=0; i < m_data.size(); ++i) m_data.at(i) /= alpha;
+    SPARSE_STAT_SCOPE(scale, nnz());
+    // Divide element array by alpha, a pattern is left as it is
+    if constexpr (!pattern())
+    {
+        fT * data = m_data.data();
+        for (size_t i=0; i < m_data.size(); ++i) data[i] /= alpha;
+    }
+    drop_format();
     return *this;
 }
-template<typename fT>
-SparseMatrix<fT> SparseMatrix<fT>::operator/(fT alpha) const
+
+/*
+ * Sort the columns of every row in ascending order
+ * Rows which are already sorted are left untouched
+*/
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::sort_rows()
 {
-    // New matrix to be returned
-    // Initialized with called class
-    SparseMatrix<fT> ret(*this);
-    ret /= alpha;
-    return ret;
+    SPARSE_STAT_SCOPE(sort_rows, nnz());
+    // Take ownership once, not inside the parallel loop
+    const Buffer<size_t> & offsets = m_index;
+    const size_t * index = offsets.data();
+    IndexT * indices = m_indices.data();
+    fT * data = m_data.data();
+    #pragma omp parallel for schedule(dynamic, 256)
+    for(size_t i=0; i<m_nrow; ++i)
+    {
+        const size_t start = index[i], end = index[i+1];
+        if (std::is_sorted(indices + start, indices + end)) continue;
+        if constexpr (pattern())
+        {
+            std::sort(indices + start, indices + end);
+        }
+        else
+        {
+            std::vector<std::pair<size_t, fT>> row;
+            row.reserve(end - start);
+            for(size_t j=start; j<end; ++j) row.emplace_back(indices[j], data[j]);
+            std::sort(row.begin(), row.end(),
+                [](const std::pair<size_t, fT> & a, const std::pair<size_t, fT> & b)
+                { return a.first < b.first; });
+            for(size_t j=start; j<end; ++j)
+            {
+                indices[j] = static_cast<IndexT>(row[j-start].first);
+                data[j] = row[j-start].second;
+            }
+        }
+    }
 }
 
 /*
- * Return index of data associated with specified row and column
- * Return index for m_data
+ * Check CSR arrays taken over from outside
+ * Throws if the row offsets decrease or a column is out of range
+ * @return whether every row is sorted without duplicates or explicit
+ *         zeros, as the other members expect
 */
-template<typename fT>
-size_t SparseMatrix<fT>::findIndex(size_t nrow, size_t ncol) const
+template<typename fT, typename IndexT>
+bool SparseMatrix<fT, IndexT>::canonical() const
 {
-    typename std::vector<size_t>::const_iterator indices_it = \
-            std::find(
-                m_indices.begin() + m_index.at(nrow),
-                m_indices.begin() + m_index.at(nrow+1),
-                ncol);
+    const size_t * index = m_index.data();
+    const IndexT * indices = m_indices.data();
 
-    return static_cast<size_t>(std::distance(m_indices.begin(), indices_it));
+    bool valid = true;
+    #pragma omp parallel for reduction(&&:valid)
+    for(size_t i=0; i<m_nrow; ++i) valid = valid && index[i] <= index[i+1];
+    if (valid)
+    {
+        bool sorted = true;
+        #pragma omp parallel for schedule(dynamic, 256) reduction(&&:valid, sorted)
+        for(size_t i=0; i<m_nrow; ++i)
+        {
+            for(size_t j=index[i]; j<index[i+1]; ++j)
+            {
+                valid = valid && indices[j] < m_ncol;
+                sorted = sorted && (j == index[i] || indices[j-1] < indices[j]);
+                if constexpr (!pattern()) sorted = sorted && fabs(m_data[j]) > eps_;
+            }
+        }
+        if (valid) return sorted;
+    }
+    throw std::out_of_range(
+        "the CSR arrays are not "
+        "a valid sparse matrix");
 }
 
 /*
- * Expand the size of the row 
+ * Bring CSR arrays taken over from outside into the expected form
+ * Rows are sorted, repeated columns are summed and zeros are dropped.
+ * Arrays which already are in this form are kept without a copy.
 */
-template<typename fT>
-void SparseMatrix<fT>::expand_row()
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::canonicalize()
 {
-    ++m_nrow;
-    m_index.push_back(m_index.back());
+    SPARSE_STAT_SCOPE(canonicalize, nnz());
+    if (canonical())
+    {
+        rebuild_hash();
+        return;
+    }
+    const Buffer<size_t> & index = m_index;
+    const Buffer<IndexT> & indices = m_indices;
+    const ValueBuffer<fT> & data = m_data;
+
+    // Hand the merged elements of row i in column order to emit
+    auto merge_row = [&](size_t i, std::vector<std::pair<IndexT, fT>> & row, auto emit)
+    {
+        row.clear();
+        for(size_t j=index[i]; j<index[i+1]; ++j) row.emplace_back(indices[j], data[j]);
+        std::stable_sort(row.begin(), row.end(),
+            [](const std::pair<IndexT, fT> & a, const std::pair<IndexT, fT> & b)
+            { return a.first < b.first; });
+        for(size_t k=0, l=0; k<row.size(); k=l)
+        {
+            fT value = row[k].second;
+            for(l=k+1; l<row.size() && row[l].first==row[k].first; ++l)
+                if constexpr (!pattern()) value += row[l].second;
+            if (pattern() || fabs(value) > eps_) emit(row[k].first, value);
+        }
+    };
+
+    Buffer<size_t> ret_index(m_nrow+1, 0);
+    size_t * count = ret_index.data();
+    #pragma omp parallel
+    {
+        std::vector<std::pair<IndexT, fT>> row;
+        #pragma omp for schedule(dynamic, 256)
+        for(size_t i=0; i<m_nrow; ++i)
+        {
+            size_t length = 0;
+            merge_row(i, row, [&](IndexT, fT) { ++length; });
+            count[i+1] = length;
+        }
+    }
+    for(size_t i=0; i<m_nrow; ++i) count[i+1] += count[i];
+
+    Buffer<IndexT> ret_indices(count[m_nrow]);
+    ValueBuffer<fT> ret_data(count[m_nrow]);
+    IndexT * out_indices = ret_indices.data();
+    fT * out_data = ret_data.data();
+    #pragma omp parallel
+    {
+        std::vector<std::pair<IndexT, fT>> row;
+        #pragma omp for schedule(dynamic, 256)
+        for(size_t i=0; i<m_nrow; ++i)
+        {
+            size_t pos = count[i];
+            merge_row(i, row, [&](IndexT col, fT value)
+            {
+                out_indices[pos] = col;
+                if constexpr (!pattern()) out_data[pos] = value;
+                ++pos;
+            });
+        }
+    }
+
+    m_index = std::move(ret_index);
+    m_indices = std::move(ret_indices);
+    m_data = std::move(ret_data);
+    rebuild_hash();
+    drop_format();
 }
 
 /*
- * Expand the size of the col 
+ * Check that both dimensions fit into the index type
+ * Rows are checked as well since they become columns once transposed
 */
-template<typename fT>
-void SparseMatrix<fT>::expand_col()
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::validate_dimension(size_t nrow, size_t ncol)
 {
-    ++m_ncol;
+    if (nrow > std::numeric_limits<IndexT>::max() || ncol > std::numeric_limits<IndexT>::max())
+    {
+        throw std::out_of_range(
+            "the matrix dimension exceeds "
+            "the range of the index type");
+    }
 }
 
 /*
- * Shrink the size of the row 
+ * Row range of the calling thread
+ * Split the rows so that every thread gets a similar number of
+ * non-zero elements, each row is also weighted as one element so
+ * that long runs of empty rows are spread out as well
 */
-template<typename fT>
-void SparseMatrix<fT>::shrink_row()
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::thread_rows(size_t & begin, size_t & end) const
 {
-    --m_nrow;
-    size_t end = m_index.back();
-    m_index.pop_back();
-    size_t start = m_index.back();
-    m_indices.erase(m_indices.begin()+start, m_indices.begin()+end);
-    m_data.erase(m_data.begin()+start, m_data.begin()+end);
+#ifdef _OPENMP
+    const size_t nthread = static_cast<size_t>(omp_get_num_threads());
+    const size_t tid = static_cast<size_t>(omp_get_thread_num());
+#else
+    const size_t nthread = 1;
+    const size_t tid = 0;
+#endif
+    const size_t total = m_index[m_nrow] + m_nrow;
+
+    // Smallest row whose weighted offset reaches the target
+    auto bound = [&](size_t part) -> size_t
+    {
+        const size_t target = total / nthread * part + total % nthread * part / nthread;
+        size_t lo = 0, hi = m_nrow;
+        while (lo < hi)
+        {
+            const size_t mid = lo + (hi - lo) / 2;
+            if (m_index[mid] + mid < target) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    };
+
+    begin = bound(tid);
+    end = (tid + 1 == nthread) ? m_nrow : bound(tid + 1);
 }
 
 /*
- * Shrink the size of the col 
+ * Return index of data associated with specified row and column
+ * Return index for m_data, or the end of the row if the element is zero
+ * Rows with a column hash table are answered in constant time, other
+ * rows are scanned when short and binary searched otherwise
 */
-template<typename fT>
-void SparseMatrix<fT>::shrink_col()
+template<typename fT, typename IndexT>
+size_t SparseMatrix<fT, IndexT>::findIndex(size_t nrow, size_t ncol) const
 {
-    --m_ncol;
-    for(auto i = m_index.begin(); i != m_index.end()-1; ++i)
+    const size_t start = m_index.at(nrow);
+    const size_t end = m_index.at(nrow+1);
+    SPARSE_STAT_COUNT(find_index, end - start);
+
+    if (m_hash_threshold && end - start >= m_hash_threshold)
     {
-        for(auto j = m_indices.begin()+(*i), k = m_data.begin()+(*i);
-            j != m_indices.begin()+*(i+1) && k != m_data.begin()+*(i+1);)
+        auto it = m_row_hash.find(nrow);
+        if (it != m_row_hash.end())
         {
-            // If indices is out of column, then remove
-            // m_ncol has been decreased above
-            // Reassign iterator with next item after erase
-            if(*j == m_ncol) 
-            {
-                for(auto z=i+1; z!=m_index.end(); ++z) --(*z);
-                j = m_indices.erase(j);
-                k = m_data.erase(k);
-            }
-            // Else continue normally
-            else
+            const RowHash & table = it->second;
+            const size_t mask = table.slot.size() - 1;
+            for(size_t h = hash_column(ncol, table.shift);; h = (h + 1) & mask)
             {
-                ++j;
-                ++k;
+                const size_t offset = table.slot[h];
+                if (offset == 0) return end;
+                if (m_indices[start + offset - 1] == ncol) return start + offset - 1;
             }
         }
     }
+
+    const size_t j = lowerIndex(nrow, ncol);
+    return (j < end && m_indices[j] == ncol) ? j : end;
+}
+
+/*
+ * Return index of the first element of the row whose column is not less
+ * than the specified column, this is where the column would be inserted
+*/
+template<typename fT, typename IndexT>
+size_t SparseMatrix<fT, IndexT>::lowerIndex(size_t nrow, size_t ncol) const
+{
+    const size_t start = m_index.at(nrow);
+    const size_t end = m_index.at(nrow+1);
+    const IndexT * indices = m_indices.data();
+
+    if (end - start <= linear_search_)
+    {
+        size_t j = start;
+        while (j < end && indices[j] < ncol) ++j;
+        return j;
+    }
+    return static_cast<size_t>(std::lower_bound(indices + start, indices + end, ncol) - indices);
 }
 
-template class SparseMatrix<double>;
+/*
+ * Set the row length above which rows keep a column hash table
+ * @param threshold minimum row length, zero removes all hash tables
+*/
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::set_hash_threshold(size_t threshold)
+{
+    m_hash_threshold = threshold;
+    rebuild_hash();
+}
+
+/*
+ * Rebuild the column hash tables of all rows above the threshold
+*/
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::rebuild_hash()
+{
+    m_row_hash.clear();
+    if (!m_hash_threshold) return;
+
+    const Buffer<size_t> & index = m_index;
+    std::vector<size_t> heavy;
+    for(size_t i=0; i<m_nrow; ++i)
+        if (index[i+1] - index[i] >= m_hash_threshold) heavy.push_back(i);
+
+    std::vector<RowHash> tables(heavy.size());
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(size_t i=0; i<heavy.size(); ++i)
+        tables[i] = build_row_hash(heavy[i]);
+    for(size_t i=0; i<heavy.size(); ++i)
+        m_row_hash.emplace(heavy[i], std::move(tables[i]));
+}
+
+/*
+ * Rebuild or drop the column hash table of a single row
+*/
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::hash_row(size_t nrow)
+{
+    if (m_index[nrow+1] - m_index[nrow] >= m_hash_threshold)
+        m_row_hash[nrow] = build_row_hash(nrow);
+    else
+        m_row_hash.erase(nrow);
+}
+
+/*
+ * Open addressing table of a row
+ * The table holds twice as many slots as the row length, every slot
+ * stores the offset of the element inside the row plus one
+*/
+template<typename fT, typename IndexT>
+typename SparseMatrix<fT, IndexT>::RowHash SparseMatrix<fT, IndexT>::build_row_hash(size_t nrow) const
+{
+    const size_t start = m_index[nrow];
+    const size_t length = m_index[nrow+1] - start;
+
+    RowHash table;
+    unsigned bits = 1;
+    while ((static_cast<size_t>(1) << bits) < 2 * length) ++bits;
+    table.shift = 64 - bits;
+    table.slot.assign(static_cast<size_t>(1) << bits, 0);
+
+    const size_t mask = table.slot.size() - 1;
+    for(size_t j=0; j<length; ++j)
+    {
+        size_t h = hash_column(m_indices[start + j], table.shift);
+        while (table.slot[h]) h = (h + 1) & mask;
+        table.slot[h] = j + 1;
+    }
+    return table;
+}
+
+/*
+ * Expand the size of the row 
+ * @param count number of empty rows appended at once
+*/
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::expand_row(size_t count)
+{
+    SPARSE_STAT_SCOPE(resize, 0);
+    validate_dimension(m_nrow + count, m_ncol);
+    m_nrow += count;
+    m_index.resize(m_index.size() + count, m_index.back());
+    drop_format();
+}
+
+/*
+ * Expand the size of the col 
+ * @param count number of empty columns appended
+*/
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::expand_col(size_t count)
+{
+    SPARSE_STAT_SCOPE(resize, 0);
+    validate_dimension(m_nrow, m_ncol + count);
+    m_ncol += count;
+    drop_format();
+}
+
+/*
+ * Shrink the size of the row 
+ * @param count number of rows removed from the end
+*/
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::shrink_row(size_t count)
+{
+    SPARSE_STAT_SCOPE(resize, nnz());
+    if (count > m_nrow)
+    {
+        throw std::out_of_range(
+            "the number of removed rows "
+            "exceeds that of matrix rows");
+    }
+    m_nrow -= count;
+    m_index.resize(m_nrow+1);
+    m_indices.resize(m_index.back());
+    m_data.resize(m_index.back());
+    for(size_t i=m_nrow; i<m_nrow+count; ++i) m_row_hash.erase(i);
+    drop_format();
+}
+
+/*
+ * Shrink the size of the col 
+ * Rows are sorted, so the removed columns are a suffix of every row and
+ * the surviving elements are moved to the front in a single pass
+ * @param count number of columns removed from the end
+*/
+template<typename fT, typename IndexT>
+void SparseMatrix<fT, IndexT>::shrink_col(size_t count)
+{
+    SPARSE_STAT_SCOPE(resize, nnz());
+    if (count > m_ncol)
+    {
+        throw std::out_of_range(
+            "the number of removed columns "
+            "exceeds that of matrix columns");
+    }
+    m_ncol -= count;
+
+    size_t * index = m_index.data();
+    IndexT * indices = m_indices.data();
+    fT * data = m_data.data();
+    size_t pos = 0, start = 0;
+    for(size_t i=0; i<m_nrow; ++i)
+    {
+        const size_t end = index[i+1];
+        const size_t keep = std::lower_bound(indices + start, indices + end, m_ncol) - (indices + start);
+        std::copy(indices + start, indices + start + keep, indices + pos);
+        if constexpr (!pattern()) std::copy(data + start, data + start + keep, data + pos);
+        index[i] = pos;
+        pos += keep;
+        start = end;
+    }
+    index[m_nrow] = pos;
+    m_indices.resize(pos);
+    m_data.resize(pos);
+    rebuild_hash();
+    drop_format();
+}
 
+#define INSTANTIATE(fT, IndexT) \
+    template class SparseMatrix<fT, IndexT>; \
+    template SparseMatrix<fT, IndexT> axpby(fT, const SparseMatrix<fT, IndexT> &, \
+                                            fT, const SparseMatrix<fT, IndexT> &); \
+    template SparseMatrix<fT, IndexT> combine(std::vector<MatrixTerm<fT, IndexT>> const &); \
+    template void combine_multiply(std::vector<MatrixTerm<fT, IndexT>> const &, fT *);
+SPARSE_ALL_TYPES(INSTANTIATE)
@@ -0,0 +1,161 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+#include "stats.hpp"
+
+/*
+ * Counters of one thread
+ * Only the owning thread adds to them, so a relaxed load and store is
+ * enough and the hot path never contends. stats() reads them from other
+ * threads, which is why they are atomic at all.
+*/
+struct StatCounters
+{
+    std::atomic<uint64_t> op[static_cast<size_t>(StatOp::count)][3];
+    std::atomic<uint64_t> buffer[static_cast<size_t>(StatBuffer::count)][2];
+
+    StatCounters() { clear(); }
+    void clear()
+    {
+        for (auto & counters : op) for (auto & counter : counters) counter.store(0, std::memory_order_relaxed);
+        for (auto & counters : buffer) for (auto & counter : counters) counter.store(0, std::memory_order_relaxed);
+    }
+};
+
+static inline void bump(std::atomic<uint64_t> & counter, uint64_t value)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+static inline void merge(StatCounters & total, StatCounters const & other)
+{
+    for(size_t i=0; i<static_cast<size_t>(StatOp::count); ++i)
+        for(size_t j=0; j<3; ++j) bump(total.op[i][j], other.op[i][j].load(std::memory_order_relaxed));
+    for(size_t i=0; i<static_cast<size_t>(StatBuffer::count); ++i)
+        for(size_t j=0; j<2; ++j) bump(total.buffer[i][j], other.buffer[i][j].load(std::memory_order_relaxed));
+}
+
+/*
+ * Counters of the live threads, and the sum of those which exited
+*/
+struct StatRegistry
+{
+    std::mutex mutex;
+    std::vector<StatCounters *> live;
+    StatCounters retired;
+};
+
+static StatRegistry & registry()
+{
+    // Never destroyed, threads may exit after the static destructors ran
+    static StatRegistry * ret = new StatRegistry();
+    return *ret;
+}
+
+/*
+ * Registers the counters of a thread for its lifetime
+*/
+class StatThread {
+
+public:
+
+    StatThread()
+    {
+        StatRegistry & reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        reg.live.push_back(&m_counters);
+    }
+    ~StatThread()
+    {
+        StatRegistry & reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        merge(reg.retired, m_counters);
+        reg.live.erase(std::find(reg.live.begin(), reg.live.end(), &m_counters));
+    }
+
+    StatCounters & counters() { return m_counters; }
+
+private:
+
+    StatCounters m_counters;
+
+};
+
+static StatCounters & local_counters()
+{
+    thread_local StatThread thread;
+    return thread.counters();
+}
+
+void stat_record(StatOp op, uint64_t nanoseconds, uint64_t nnz)
+{
+    std::atomic<uint64_t> * counters = local_counters().op[static_cast<size_t>(op)];
+    bump(counters[0], 1);
+    bump(counters[1], nanoseconds);
+    bump(counters[2], nnz);
+}
+
+void stat_buffer(StatBuffer kind, uint64_t bytes)
+{
+    std::atomic<uint64_t> * counters = local_counters().buffer[static_cast<size_t>(kind)];
+    bump(counters[0], 1);
+    bump(counters[1], bytes);
+}
+
+/*
+ * Sum of the counters of all threads
+ * Operations which only ran with the instrumentation off report zeros
+*/
+Stats stats()
+{
+    StatCounters total;
+    {
+        StatRegistry & reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        merge(total, reg.retired);
+        for (StatCounters const * counters : reg.live) merge(total, *counters);
+    }
+
+    static const char * op_names[] = {
+#define SPARSE_STAT_NAME(name) #name,
+        SPARSE_STAT_OPS(SPARSE_STAT_NAME)
+#undef SPARSE_STAT_NAME
+    };
+    static const char * buffer_names[] = {"allocate", "reallocate", "own"};
+
+    Stats ret;
+#ifdef SPARSE_STATS
+    ret.enabled = true;
+#endif
+    for(size_t i=0; i<static_cast<size_t>(StatOp::count); ++i)
+    {
+        OpStats op;
+        op.calls = total.op[i][0].load(std::memory_order_relaxed);
+        op.nanoseconds = total.op[i][1].load(std::memory_order_relaxed);
+        op.nnz = total.op[i][2].load(std::memory_order_relaxed);
+        ret.ops.emplace_back(op_names[i], op);
+    }
+    for(size_t i=0; i<static_cast<size_t>(StatBuffer::count); ++i)
+    {
+        BufferStats buffer;
+        buffer.count = total.buffer[i][0].load(std::memory_order_relaxed);
+        buffer.bytes = total.buffer[i][1].load(std::memory_order_relaxed);
+        ret.buffers.emplace_back(buffer_names[i], buffer);
+    }
+    return ret;
+}
+
+/*
+ * Zero the counters of all threads
+ * Counts of operations running at the same time may partly survive
+*/
+void reset_stats()
+{
+    StatRegistry & reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    reg.retired.clear();
+    for (StatCounters * counters : reg.live) counters->clear();
+}
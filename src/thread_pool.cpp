@@ -0,0 +1,63 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#include <algorithm>
+#include <utility>
+
+#include "thread_pool.hpp"
+
+/**
+ * Constructor
+ * Start the workers, at least one
+**/
+ThreadPool::ThreadPool(size_t nthread)
+{
+    nthread = std::max<size_t>(nthread, 1);
+    m_workers.reserve(nthread);
+    for(size_t i=0; i<nthread; ++i) m_workers.emplace_back(&ThreadPool::run, this);
+}
+
+/**
+ * Destructor
+ * Finish the queued jobs and join the workers
+**/
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for (auto & worker : m_workers) worker.join();
+}
+
+/*
+ * Queue a job for the next idle worker
+ * Jobs must not throw, they report their own errors
+*/
+void ThreadPool::submit(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.push_back(std::move(job));
+    }
+    m_wake.notify_one();
+}
+
+/*
+ * Worker loop, runs jobs until the pool stops and the queue is empty
+*/
+void ThreadPool::run()
+{
+    for (;;)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+            if (m_jobs.empty()) return;
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+        }
+        job();
+    }
+}
@@ -0,0 +1,216 @@
+// Developer: Wilbert (wilbert.phen@gmail.com)
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+#include "graph.hpp"
+#include "atomic.hpp"
+#include "stats.hpp"
+#include "instantiate.hpp"
+
+#define bfs_alpha_ 15
+#define bfs_beta_ 18
+
+/*
+ * Top-down step
+ * Push over the out-edges of the frontier queue[begin, end), newly found
+ * nodes are appended behind the frontier in blocks claimed per thread
+ * @return sum of the out-degree of the new frontier
+*/
+template<typename IndexT>
+static size_t top_down_step(const size_t * index, const IndexT * indices,
+                            int64_t * parent, int64_t * depth, int64_t level,
+                            size_t * queue, size_t begin, size_t end, size_t & tail)
+{
+    size_t scout = 0;
+    #pragma omp parallel reduction(+:scout)
+    {
+        std::vector<size_t> local;
+        local.reserve(1024);
+        auto flush = [&]()
+        {
+            const size_t pos = fetch_add(tail, local.size());
+            std::copy(local.begin(), local.end(), queue + pos);
+            local.clear();
+        };
+
+        #pragma omp for schedule(dynamic, 64) nowait
+        for(size_t i=begin; i<end; ++i)
+        {
+            const size_t u = queue[i];
+            for(size_t j=index[u]; j<index[u+1]; ++j)
+            {
+                const size_t v = indices[j];
+                if (atomic_load(parent[v]) < 0 &&
+                    compare_and_swap(parent[v], static_cast<int64_t>(-1), static_cast<int64_t>(u)))
+                {
+                    depth[v] = level + 1;
+                    scout += index[v+1] - index[v];
+                    local.push_back(v);
+                    if (local.size() == local.capacity()) flush();
+                }
+            }
+        }
+        flush();
+    }
+    return scout;
+}
+
+/*
+ * Bottom-up step
+ * Every unvisited node pulls from its in-edges until it finds a parent in
+ * the frontier bitmap. Nodes are handled in blocks of 64 so that every word
+ * of the next bitmap is written by a single thread without atomics.
+ * @return number of nodes in the next frontier
+*/
+template<typename IndexT>
+static size_t bottom_up_step(const size_t * index, const IndexT * indices, size_t n,
+                             int64_t * parent, int64_t * depth, int64_t level,
+                             const uint64_t * front, uint64_t * next)
+{
+    const size_t nword = (n + 63) / 64;
+    size_t awake = 0;
+    #pragma omp parallel for schedule(dynamic, 64) reduction(+:awake)
+    for(size_t w=0; w<nword; ++w)
+    {
+        uint64_t bits = 0;
+        const size_t last = std::min(n, (w + 1) * 64);
+        for(size_t v=w*64; v<last; ++v)
+        {
+            if (parent[v] >= 0) continue;
+            for(size_t j=index[v]; j<index[v+1]; ++j)
+            {
+                const size_t u = indices[j];
+                if (front[u / 64] >> (u % 64) & 1)
+                {
+                    parent[v] = static_cast<int64_t>(u);
+                    depth[v] = level + 1;
+                    bits |= static_cast<uint64_t>(1) << (v % 64);
+                    ++awake;
+                    break;
+                }
+            }
+        }
+        next[w] = bits;
+    }
+    return awake;
+}
+
+/*
+ * Breadth-first search from the source node
+ * Direction-optimizing traversal: levels are expanded top-down while the
+ * frontier is small, and bottom-up over the in-edges once the frontier
+ * holds more edges than 1/alpha of the unexplored part. It switches back
+ * once the frontier falls below 1/beta of the nodes and is shrinking.
+*/
+template<typename fT, typename IndexT>
+BFSResult SparseGraph<fT, IndexT>::bfs(size_t source) const
+{
+    const size_t n = dim();
+    if (source >= n)
+    {
+        throw std::out_of_range(
+            "the source node is "
+            "outside of the graph");
+    }
+
+    const std::shared_ptr<const SparseMatrix<fT, IndexT>> pinned = kernel_snapshot();
+    const SparseMatrix<fT, IndexT> & adj = *pinned;
+    SPARSE_STAT_SCOPE(bfs, adj.nnz());
+    const size_t * index = adj.index().data();
+    const IndexT * indices = adj.indices().data();
+
+    BFSResult ret;
+    ret.parent.assign(n, -1);
+    ret.depth.assign(n, -1);
+    int64_t * parent = ret.parent.data();
+    int64_t * depth = ret.depth.data();
+    parent[source] = static_cast<int64_t>(source);
+    depth[source] = 0;
+
+    // Every node enters the queue once, the frontier is a window into it
+    std::vector<size_t> queue(n);
+    queue[0] = source;
+    size_t begin = 0, end = 1, tail = 1;
+
+    // In-edges and bitmaps are only set up once bottom-up is used, updates
+    // compacted in the meantime raced with the search anyway
+    std::shared_ptr<const SparseMatrix<fT, IndexT>> in_pinned;
+    const size_t * in_index = nullptr;
+    const IndexT * in_indices = nullptr;
+    std::vector<uint64_t> front, next;
+
+    size_t edges_to_check = adj.nnz();
+    size_t scout = index[source+1] - index[source];
+    int64_t level = 0;
+
+    while (begin < end)
+    {
+        if (scout > edges_to_check / bfs_alpha_)
+        {
+            if (!in_index)
+            {
+                in_pinned = kernel_snapshot(true);
+                in_index = in_pinned->index().data();
+                in_indices = in_pinned->indices().data();
+                front.resize((n + 63) / 64);
+                next.resize((n + 63) / 64);
+            }
+
+            // Frontier queue to bitmap
+            std::fill(front.begin(), front.end(), 0);
+            #pragma omp parallel for
+            for(size_t i=begin; i<end; ++i)
+                fetch_or(front[queue[i] / 64], static_cast<uint64_t>(1) << (queue[i] % 64));
+
+            size_t awake = end - begin, old_awake;
+            do
+            {
+                old_awake = awake;
+                awake = bottom_up_step(in_index, in_indices, n, parent, depth, level,
+                                       front.data(), next.data());
+                front.swap(next);
+                ++level;
+            } while (awake >= old_awake || awake > n / bfs_beta_);
+
+            // Frontier bitmap back to queue, along with its out-degree sum
+            begin = end = tail;
+            size_t degree = 0;
+            #pragma omp parallel reduction(+:degree)
+            {
+                std::vector<size_t> local;
+                #pragma omp for schedule(static) nowait
+                for(size_t w=0; w<front.size(); ++w)
+                {
+                    for(uint64_t bits=front[w]; bits; bits &= bits - 1)
+                    {
+                        const size_t v = w * 64 + static_cast<size_t>(__builtin_ctzll(bits));
+                        degree += index[v+1] - index[v];
+                        local.push_back(v);
+                    }
+                }
+                const size_t pos = fetch_add(tail, local.size());
+                std::copy(local.begin(), local.end(), queue.begin() + pos);
+            }
+            end = tail;
+            scout = degree;
+        }
+        else
+        {
+            edges_to_check -= std::min(edges_to_check, scout);
+            scout = top_down_step(index, indices, parent, depth, level,
+                                  queue.data(), begin, end, tail);
+            begin = end;
+            end = tail;
+            ++level;
+        }
+    }
+
+    return ret;
+}
+
+#define INSTANTIATE(fT, IndexT) \
+    template BFSResult SparseGraph<fT, IndexT>::bfs(size_t) const;
+SPARSE_ALL_TYPES(INSTANTIATE)